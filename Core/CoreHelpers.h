@@ -1,10 +1,15 @@
 #ifndef _CORE_HELPERS_H_
 #define _CORE_HELPERS_H_
 
+#if defined(_WIN32)
 #include <Windows.h>
+#endif
 #include <stdio.h>
+#include <math.h>
+#include <string.h>
 #include <vector>
 #include <string>
+#include <chrono>
 
 #define ASSERT_ALWAYS(expression) ALWAYS_ASSERT_RAW(expression,__FILE__,__LINE__,__FUNCTION__,#expression)
 
@@ -67,6 +72,69 @@ inline unsigned char ColorToChar(float x)
 	return (unsigned char)Saturate255(x*256.0f);
 }
 
+inline int FloatAsInt(float x)
+{
+	int ret;
+	memcpy(&ret,&x,sizeof(ret));
+	return ret;
+}
+
+inline float IntAsFloat(int x)
+{
+	float ret;
+	memcpy(&ret,&x,sizeof(ret));
+	return ret;
+}
+
+// Polynomial approximations for per-pixel work. FastLog2 is accurate to about 1e-6 (absolute) for normal
+// positive floats, and FastExp2 to about 3e-7 (relative) for x in [-126,126]. Both are branch free apart
+// from selects, so they vectorize. FastLog2 needs to be that accurate because FastPow multiplies its error
+// by the exponent, and PQ raises to the power of ~79.
+inline float FastLog2(float x)
+{
+	int bits = FloatAsInt(x);
+	int e = ((bits >> 23) & 255) - 127;
+	float m = IntAsFloat((bits & 0x007fffff) | 0x3f800000);
+
+	// reduce the mantissa to [sqrt(.5),sqrt(2))
+	bool upper = (m > 1.41421356f);
+	m = upper ? m*0.5f : m;
+	e = upper ? e+1 : e;
+
+	// log2(m) = 2/ln(2) * atanh(s), with s = (m-1)/(m+1)
+	float s = (m - 1.0f)/(m + 1.0f);
+	float s2 = s*s;
+	float p = 0.412198583f;
+	p = p*s2 + 0.577078016f;
+	p = p*s2 + 0.961796694f;
+	p = p*s2 + 2.885390082f;
+	return float(e) + p*s;
+}
+
+inline float FastExp2(float x)
+{
+	x = MaxFloat(-126.0f,MinFloat(126.0f,x));
+
+	int i = (int)x;
+	i -= (x < float(i)) ? 1 : 0; // floor
+	float t = x - float(i);
+
+	float p = 0.00189437942f;
+	p = p*t + 0.00894058253f;
+	p = p*t + 0.0558765569f;
+	p = p*t + 0.240131692f;
+	p = p*t + 0.693156777f;
+	p = p*t + 0.99999977f;
+
+	return p * IntAsFloat((i + 127) << 23);
+}
+
+// x^y for x >= 0, returns 0 for x <= 0
+inline float FastPow(float x, float y)
+{
+	return x > 0.0f ? FastExp2(y*FastLog2(x)) : 0.0f;
+}
+
 template <class A>
 inline void Swap(A & lhs, A & rhs) restrict(amp) restrict(cpu)
 {
@@ -84,21 +152,41 @@ inline std::string FourDigitString(int i)
 }
 
 
-inline unsigned __int64 GetQualityTimeMicroSec()
+#if defined(_WIN32)
+
+inline unsigned long long GetQualityTimeNanoSec()
 {
-	LARGE_INTEGER freq;
+	// the frequency is fixed at boot, so only query it once
+	static const LONGLONG s_freq = []()
+	{
+		LARGE_INTEGER freq;
+		BOOL bRet = QueryPerformanceFrequency(&freq);
+		ASSERT_ALWAYS(bRet);
+		return freq.QuadPart;
+	}();
+
 	LARGE_INTEGER currTime;
-	BOOL bRet;
-	bRet = QueryPerformanceFrequency(&freq);
+	BOOL bRet = QueryPerformanceCounter(&currTime);
 	ASSERT_ALWAYS(bRet);
 
-	bRet = QueryPerformanceCounter(&currTime);
-	ASSERT_ALWAYS(bRet);
+	// split into whole seconds and remainder so the multiply can't overflow
+	unsigned long long ticks = (unsigned long long)currTime.QuadPart;
+	unsigned long long freq = (unsigned long long)s_freq;
+	return (ticks / freq) * 1000000000ULL + ((ticks % freq) * 1000000000ULL) / freq;
+}
+
+#else
+
+inline unsigned long long GetQualityTimeNanoSec()
+{
+	return (unsigned long long)std::chrono::duration_cast < std::chrono::nanoseconds > (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
 
-	double numSec = ((double)currTime.QuadPart)/((double)freq.QuadPart);
-	unsigned __int64 microSec = (unsigned __int64)(numSec * 1000000.0);
-	return microSec;
+#endif
 
+inline unsigned long long GetQualityTimeMicroSec()
+{
+	return GetQualityTimeNanoSec() / 1000ULL;
 }
 
 
@@ -117,7 +205,7 @@ inline A AlignSize(A x, B size)
 	*/
 }
 
-inline unsigned __int64 AlignSize64(unsigned __int64 x, unsigned __int64 size)
+inline unsigned long long AlignSize64(unsigned long long x, unsigned long long size)
 {
 	return (((x+size)-1)/size)*size;
 }
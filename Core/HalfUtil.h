@@ -0,0 +1,80 @@
+#ifndef _HALF_UTIL_H_
+#define _HALF_UTIL_H_
+
+#include "CoreHelpers.h"
+
+#include <string.h>
+#include <emmintrin.h>
+
+// IEEE half floats without F16C, so the SSE2 builds can use them. Rounds to nearest even, overflow goes to inf.
+inline unsigned short FloatToHalf(float val)
+{
+	unsigned int bits;
+	memcpy(&bits,&val,sizeof(bits));
+
+	unsigned int sign = (bits >> 16) & 0x8000;
+	unsigned int absBits = bits & 0x7fffffff;
+
+	// inf and nan
+	if (absBits >= 0x7f800000)
+		return (unsigned short)(sign | 0x7c00 | (absBits > 0x7f800000 ? 0x200 : 0));
+
+	// 65520 and up round to inf
+	if (absBits >= 0x477ff000)
+		return (unsigned short)(sign | 0x7c00);
+
+	// below 2^-14 the half is denormal, adding .5 makes the float adder round to the 2^-24 grid
+	if (absBits < 0x38800000)
+	{
+		float absVal;
+		memcpy(&absVal,&absBits,sizeof(absVal));
+		absVal += 0.5f;
+
+		unsigned int denormBits;
+		memcpy(&denormBits,&absVal,sizeof(denormBits));
+		return (unsigned short)(sign | (denormBits - 0x3f000000));
+	}
+
+	// rebias the exponent and round the 13 dropped bits
+	unsigned int mantOdd = (absBits >> 13) & 1;
+	absBits += 0xc8000fff + mantOdd;
+	return (unsigned short)(sign | (absBits >> 13));
+}
+
+inline float HalfToFloat(unsigned short val)
+{
+	// shift into place and scale by 2^112 to rebias, which also handles the denormals
+	unsigned int absBits = (unsigned int)(val & 0x7fff) << 13;
+	float magic;
+	unsigned int magicBits = 0x77800000;
+	memcpy(&magic,&magicBits,sizeof(magic));
+
+	float absVal;
+	memcpy(&absVal,&absBits,sizeof(absVal));
+	absVal *= magic;
+
+	unsigned int bits;
+	memcpy(&bits,&absVal,sizeof(bits));
+	if ((val & 0x7fff) >= 0x7c00)
+		bits |= 0x7f800000;
+	bits |= (unsigned int)(val & 0x8000) << 16;
+
+	float ret;
+	memcpy(&ret,&bits,sizeof(ret));
+	return ret;
+}
+
+// 4 halves at src to floats, same as HalfToFloat()
+inline __m128 SimdHalfToFloat4(const unsigned short * src)
+{
+	__m128i halves = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)src),_mm_setzero_si128());
+
+	__m128i absHalves = _mm_and_si128(halves,_mm_set1_epi32(0x7fff));
+	__m128 absVal = _mm_mul_ps(_mm_castsi128_ps(_mm_slli_epi32(absHalves,13)),_mm_castsi128_ps(_mm_set1_epi32(0x77800000)));
+
+	__m128i infNan = _mm_and_si128(_mm_cmpgt_epi32(absHalves,_mm_set1_epi32(0x7bff)),_mm_set1_epi32(0x7f800000));
+	__m128i sign = _mm_slli_epi32(_mm_and_si128(halves,_mm_set1_epi32(0x8000)),16);
+	return _mm_castsi128_ps(_mm_or_si128(_mm_or_si128(_mm_castps_si128(absVal),infNan),sign));
+}
+
+#endif
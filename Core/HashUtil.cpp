@@ -0,0 +1,68 @@
+#include "HashUtil.h"
+
+// xxHash64 primes
+static const unsigned long long s_prime1 = 11400714785074694791ULL;
+static const unsigned long long s_prime2 = 14029467366897019727ULL;
+static const unsigned long long s_prime3 = 1609587929392839161ULL;
+static const unsigned long long s_prime4 = 9650029242287828579ULL;
+static const unsigned long long s_prime5 = 2870177450012600261ULL;
+
+static inline unsigned long long RotateLeft64(unsigned long long x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline unsigned long long HashRound(unsigned long long acc, unsigned long long val)
+{
+	acc += val * s_prime2;
+	acc = RotateLeft64(acc,31);
+	return acc * s_prime1;
+}
+
+unsigned long long HashUtil::HashBytes(const void * data, size_t numBytes, unsigned long long seed)
+{
+	const unsigned char * src = (const unsigned char *)data;
+
+	unsigned long long lane0 = seed + s_prime1 + s_prime2;
+	unsigned long long lane1 = seed + s_prime2;
+	unsigned long long lane2 = seed;
+	unsigned long long lane3 = seed - s_prime1;
+
+	size_t numChunks = numBytes / 32;
+	for (size_t i = 0; i < numChunks; i++)
+	{
+		unsigned long long words[4];
+		memcpy(words,src + i*32,32);
+		lane0 = HashRound(lane0,words[0]);
+		lane1 = HashRound(lane1,words[1]);
+		lane2 = HashRound(lane2,words[2]);
+		lane3 = HashRound(lane3,words[3]);
+	}
+
+	unsigned long long h = RotateLeft64(lane0,1) + RotateLeft64(lane1,7) + RotateLeft64(lane2,12) + RotateLeft64(lane3,18);
+	h += (unsigned long long)numBytes;
+
+	size_t offset = numChunks*32;
+	for (; offset + 8 <= numBytes; offset += 8)
+	{
+		unsigned long long word;
+		memcpy(&word,src + offset,8);
+		h ^= HashRound(0,word);
+		h = RotateLeft64(h,27) * s_prime1 + s_prime4;
+	}
+
+	for (; offset < numBytes; offset++)
+	{
+		h ^= src[offset] * s_prime5;
+		h = RotateLeft64(h,11) * s_prime1;
+	}
+
+	// avalanche
+	h ^= h >> 33;
+	h *= s_prime2;
+	h ^= h >> 29;
+	h *= s_prime3;
+	h ^= h >> 32;
+	return h;
+}
+
@@ -0,0 +1,14 @@
+#ifndef _HASH_UTIL_H_
+#define _HASH_UTIL_H_
+
+#include "CoreHelpers.h"
+
+class HashUtil
+{
+public:
+	// 64 bit hash of numBytes bytes, continuing from seed. Four independent lanes over 32 byte chunks, so the
+	// multiplies pipeline. Same structure as xxHash64 but not the same output, it's meant for change detection.
+	static unsigned long long HashBytes(const void * data, size_t numBytes, unsigned long long seed);
+};
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef _IMAGE_VIEW_H_
+#define _IMAGE_VIEW_H_
+
+#include "CoreHelpers.h"
+
+#include <stddef.h>
+
+// Non-owning view of an RGB or RGBA image. All strides are in bytes, so interleaved, planar and padded row layouts
+// all fit. Channel c of pixel (x,y) is at m_data + y*m_rowPitch + x*m_pixelStride + c*m_channelStride.
+struct ImageView
+{
+	enum eSampleType
+	{
+		kSampleType_Float,
+		kSampleType_U8,
+		kSampleType_U16,
+		kSampleType_Num
+	};
+
+	ImageView()
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		m_data = NULL;
+		m_width = 0;
+		m_height = 0;
+		m_rowPitch = 0;
+		m_pixelStride = 0;
+		m_channelStride = 0;
+		m_numChannels = 3;
+		m_sampleType = kSampleType_Float;
+	}
+
+	static int GetSampleSize(eSampleType sampleType)
+	{
+		if (sampleType == kSampleType_U8)
+			return 1;
+		if (sampleType == kSampleType_U16)
+			return 2;
+		return 4;
+	}
+
+	// RGBRGB... or RGBARGBA..., rowPitch of 0 means the rows are packed
+	static ImageView MakeInterleaved(void * data, int width, int height, int numChannels, eSampleType sampleType, ptrdiff_t rowPitch = 0)
+	{
+		ImageView view;
+		view.m_data = (unsigned char *)data;
+		view.m_width = width;
+		view.m_height = height;
+		view.m_numChannels = numChannels;
+		view.m_sampleType = sampleType;
+		view.m_channelStride = GetSampleSize(sampleType);
+		view.m_pixelStride = view.m_channelStride * numChannels;
+		view.m_rowPitch = (rowPitch != 0) ? rowPitch : view.m_pixelStride * width;
+		return view;
+	}
+
+	// One plane per channel. rowPitch of 0 means packed rows, planePitch of 0 means the planes are back to back.
+	static ImageView MakePlanar(void * data, int width, int height, int numChannels, eSampleType sampleType, ptrdiff_t rowPitch = 0, ptrdiff_t planePitch = 0)
+	{
+		ImageView view;
+		view.m_data = (unsigned char *)data;
+		view.m_width = width;
+		view.m_height = height;
+		view.m_numChannels = numChannels;
+		view.m_sampleType = sampleType;
+		view.m_pixelStride = GetSampleSize(sampleType);
+		view.m_rowPitch = (rowPitch != 0) ? rowPitch : view.m_pixelStride * width;
+		view.m_channelStride = (planePitch != 0) ? planePitch : view.m_rowPitch * height;
+		return view;
+	}
+
+	unsigned char * GetSamplePtr(int x, int y, int c) const
+	{
+		return m_data + y*m_rowPitch + x*m_pixelStride + c*m_channelStride;
+	}
+
+	bool HasAlpha() const
+	{
+		return m_numChannels == 4;
+	}
+
+	unsigned char * m_data;
+	int m_width;
+	int m_height;
+	ptrdiff_t m_rowPitch;
+	ptrdiff_t m_pixelStride;
+	ptrdiff_t m_channelStride;
+	int m_numChannels; // 3 or 4, the 4th is alpha
+	eSampleType m_sampleType;
+};
+
+#endif
@@ -0,0 +1,85 @@
+#ifndef _PARALLEL_UTIL_H_
+#define _PARALLEL_UTIL_H_
+
+#include "CoreHelpers.h"
+
+#include <thread>
+#include <atomic>
+#include <vector>
+
+class ParallelUtil
+{
+public:
+	// number of hardware threads, never less than 1
+	static int GetNumHardwareThreads()
+	{
+		int num = (int)std::thread::hardware_concurrency();
+		return MaxInt(1,num);
+	}
+
+	// numThreads <= 0 means use all hardware threads
+	static int ResolveNumThreads(int numThreads)
+	{
+		return numThreads <= 0 ? GetNumHardwareThreads() : numThreads;
+	}
+
+	static int CalcNumBlocks(int numItems, int blockSize)
+	{
+		return (numItems + blockSize - 1) / blockSize;
+	}
+
+	// Splits [0,numItems) into blocks of blockSize items and calls func(threadIndex, begin, end) for each block.
+	// Blocks are handed out dynamically, so the thread that processes a block is not deterministic, but the block
+	// boundaries are. If you need a deterministic reduction, store partial results per block (begin/blockSize)
+	// and sum them in block order afterwards.
+	template <class Func>
+	static void ParallelForBlocks(int numItems, int blockSize, int numThreads, const Func & func)
+	{
+		if (numItems <= 0)
+			return;
+
+		blockSize = MaxInt(1,blockSize);
+		int numBlocks = CalcNumBlocks(numItems,blockSize);
+		numThreads = MinInt(ResolveNumThreads(numThreads),numBlocks);
+
+		if (numThreads <= 1)
+		{
+			for (int blockIter = 0; blockIter < numBlocks; blockIter++)
+			{
+				int begin = blockIter*blockSize;
+				int end = MinInt(begin+blockSize,numItems);
+				func(0,begin,end);
+			}
+			return;
+		}
+
+		std::atomic < int > nextBlock(0);
+
+		auto worker = [&](int threadIndex)
+		{
+			for (;;)
+			{
+				int blockIter = nextBlock.fetch_add(1);
+				if (blockIter >= numBlocks)
+					break;
+
+				int begin = blockIter*blockSize;
+				int end = MinInt(begin+blockSize,numItems);
+				func(threadIndex,begin,end);
+			}
+		};
+
+		// the calling thread does its share of the work as thread 0
+		std::vector < std::thread > threads;
+		threads.reserve(numThreads-1);
+		for (int i = 1; i < numThreads; i++)
+			threads.push_back(std::thread(worker,i));
+
+		worker(0);
+
+		for (int i = 0; i < (int)threads.size(); i++)
+			threads[i].join();
+	}
+};
+
+#endif
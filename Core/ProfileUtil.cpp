@@ -0,0 +1,222 @@
+#include "ProfileUtil.h"
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <map>
+#include <algorithm>
+
+struct ThreadEventBuffer
+{
+	std::vector < ProfileUtil::ZoneEvent > m_events;
+	long long m_numWritten;
+	int m_threadId;
+	bool m_inUse;
+};
+
+static std::atomic < bool > s_enabled(false);
+static std::mutex s_bufferMutex;
+static std::vector < std::unique_ptr < ThreadEventBuffer > > s_buffers;
+static int s_eventsPerThread = 1 << 16;
+
+// ParallelForBlocks() starts new threads on every call, so a thread hands its buffer back when it exits and the
+// next new thread picks it up. The number of buffers stays at the max number of live threads.
+struct ThreadEventBufferHandle
+{
+	ThreadEventBufferHandle()
+	{
+		m_buffer = NULL;
+	}
+
+	~ThreadEventBufferHandle()
+	{
+		if (m_buffer != NULL)
+		{
+			std::lock_guard < std::mutex > lock(s_bufferMutex);
+			m_buffer->m_inUse = false;
+		}
+	}
+
+	ThreadEventBuffer * m_buffer;
+};
+
+static thread_local ThreadEventBufferHandle t_bufferHandle;
+
+static ThreadEventBuffer * GetThreadEventBuffer()
+{
+	if (t_bufferHandle.m_buffer != NULL)
+		return t_bufferHandle.m_buffer;
+
+	std::lock_guard < std::mutex > lock(s_bufferMutex);
+
+	ThreadEventBuffer * buffer = NULL;
+	for (int i = 0; i < (int)s_buffers.size() && buffer == NULL; i++)
+	{
+		if (!s_buffers[i]->m_inUse)
+			buffer = s_buffers[i].get();
+	}
+
+	if (buffer == NULL)
+	{
+		s_buffers.push_back(std::unique_ptr < ThreadEventBuffer >(new ThreadEventBuffer));
+		buffer = s_buffers.back().get();
+		buffer->m_events.resize(s_eventsPerThread);
+		buffer->m_numWritten = 0;
+		buffer->m_threadId = (int)s_buffers.size() - 1;
+	}
+
+	buffer->m_inUse = true;
+	t_bufferHandle.m_buffer = buffer;
+	return buffer;
+}
+
+void ProfileUtil::SetEnabled(bool enabled)
+{
+	s_enabled.store(enabled,std::memory_order_relaxed);
+}
+
+bool ProfileUtil::IsEnabled()
+{
+	return s_enabled.load(std::memory_order_relaxed);
+}
+
+void ProfileUtil::SetEventsPerThread(int numEvents)
+{
+	std::lock_guard < std::mutex > lock(s_bufferMutex);
+	s_eventsPerThread = MaxInt(1,numEvents);
+}
+
+void ProfileUtil::RecordZone(const char * name, unsigned long long beginNanoSec, unsigned long long endNanoSec)
+{
+	ThreadEventBuffer * buffer = GetThreadEventBuffer();
+
+	int size = (int)buffer->m_events.size();
+	ZoneEvent & event = buffer->m_events[buffer->m_numWritten % size];
+	event.m_name = name;
+	event.m_beginNanoSec = beginNanoSec;
+	event.m_endNanoSec = endNanoSec;
+	event.m_threadId = buffer->m_threadId;
+
+	buffer->m_numWritten++;
+}
+
+void ProfileUtil::Clear()
+{
+	std::lock_guard < std::mutex > lock(s_bufferMutex);
+	for (int i = 0; i < (int)s_buffers.size(); i++)
+		s_buffers[i]->m_numWritten = 0;
+}
+
+void ProfileUtil::GatherEvents(std::vector < ZoneEvent > & dstEvents)
+{
+	dstEvents.clear();
+
+	std::lock_guard < std::mutex > lock(s_bufferMutex);
+	for (int i = 0; i < (int)s_buffers.size(); i++)
+	{
+		const ThreadEventBuffer & buffer = *s_buffers[i];
+		long long size = (long long)buffer.m_events.size();
+
+		long long first = std::max(0LL,buffer.m_numWritten - size);
+		for (long long j = first; j < buffer.m_numWritten; j++)
+			dstEvents.push_back(buffer.m_events[j % size]);
+	}
+}
+
+void ProfileUtil::CalcZoneStats(std::vector < ZoneStats > & dstStats)
+{
+	std::vector < ZoneEvent > events;
+	GatherEvents(events);
+
+	// by string, since the same literal can have a different address in each translation unit
+	std::map < std::string, ZoneStats > statsMap;
+	for (int i = 0; i < (int)events.size(); i++)
+	{
+		const ZoneEvent & event = events[i];
+		double microSec = double(event.m_endNanoSec - event.m_beginNanoSec) * 0.001;
+
+		ZoneStats & stats = statsMap[event.m_name];
+		if (stats.m_count == 0)
+		{
+			stats.m_name = event.m_name;
+			stats.m_minMicroSec = microSec;
+			stats.m_maxMicroSec = microSec;
+		}
+
+		stats.m_count++;
+		stats.m_totalMicroSec += microSec;
+		stats.m_minMicroSec = std::min(stats.m_minMicroSec,microSec);
+		stats.m_maxMicroSec = std::max(stats.m_maxMicroSec,microSec);
+	}
+
+	dstStats.clear();
+	for (std::map < std::string, ZoneStats >::const_iterator it = statsMap.begin(); it != statsMap.end(); ++it)
+		dstStats.push_back(it->second);
+
+	std::sort(dstStats.begin(),dstStats.end(),[](const ZoneStats & a, const ZoneStats & b)
+	{
+		return a.m_totalMicroSec > b.m_totalMicroSec;
+	});
+}
+
+void ProfileUtil::PrintZoneStats(FILE * fout)
+{
+	std::vector < ZoneStats > stats;
+	CalcZoneStats(stats);
+
+	fprintf(fout,"%-32s %10s %14s %12s %12s %12s\n","zone","count","total (us)","avg (us)","min (us)","max (us)");
+	for (int i = 0; i < (int)stats.size(); i++)
+	{
+		const ZoneStats & s = stats[i];
+		fprintf(fout,"%-32s %10lld %14.1f %12.3f %12.3f %12.3f\n",s.m_name.c_str(),s.m_count,s.m_totalMicroSec,s.GetAvgMicroSec(),s.m_minMicroSec,s.m_maxMicroSec);
+	}
+}
+
+static void WriteJsonString(FILE * fout, const char * str)
+{
+	fputc('"',fout);
+	for (const char * c = str; *c != '\0'; c++)
+	{
+		if (*c == '"' || *c == '\\')
+			fputc('\\',fout);
+		if ((unsigned char)*c >= 0x20)
+			fputc(*c,fout);
+	}
+	fputc('"',fout);
+}
+
+bool ProfileUtil::WriteChromeTrace(const char * fileName)
+{
+	std::vector < ZoneEvent > events;
+	GatherEvents(events);
+
+	FILE * fout = fopen(fileName,"wt");
+	if (fout == NULL)
+		return false;
+
+	// timestamps relative to the first event, in microseconds
+	unsigned long long baseNanoSec = 0;
+	for (int i = 0; i < (int)events.size(); i++)
+	{
+		if (i == 0 || events[i].m_beginNanoSec < baseNanoSec)
+			baseNanoSec = events[i].m_beginNanoSec;
+	}
+
+	fprintf(fout,"{\"traceEvents\":[\n");
+	for (int i = 0; i < (int)events.size(); i++)
+	{
+		const ZoneEvent & event = events[i];
+		double ts = double(event.m_beginNanoSec - baseNanoSec) * 0.001;
+		double dur = double(event.m_endNanoSec - event.m_beginNanoSec) * 0.001;
+
+		fprintf(fout,"{\"name\":");
+		WriteJsonString(fout,event.m_name);
+		fprintf(fout,",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}%s\n",event.m_threadId,ts,dur,(i + 1 < (int)events.size()) ? "," : "");
+	}
+	fprintf(fout,"],\"displayTimeUnit\":\"ns\"}\n");
+
+	bool success = (ferror(fout) == 0);
+	fclose(fout);
+	return success;
+}
+
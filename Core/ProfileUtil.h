@@ -0,0 +1,111 @@
+#ifndef _PROFILE_UTIL_H_
+#define _PROFILE_UTIL_H_
+
+#include "CoreHelpers.h"
+
+// Build with PROFILE_ZONES_ENABLED set to 0 to compile every PROFILE_ZONE() out completely.
+#ifndef PROFILE_ZONES_ENABLED
+#define PROFILE_ZONES_ENABLED 1
+#endif
+
+// Lightweight scoped zones. Each thread writes into its own ring buffer, so recording doesn't take a lock, and
+// when a buffer is full the oldest events get overwritten. Recording is off until SetEnabled(true), and a disabled
+// zone costs one atomic load. Zones are meant for block level work (a few microseconds or more), not single pixels.
+//
+// Names must be string literals (or otherwise outlive the profiler), only the pointer is stored.
+//
+// Gathering, stats and the trace dump read the buffers of all threads, so only call them (and Clear()) while
+// nothing is being recorded.
+class ProfileUtil
+{
+public:
+	struct ZoneEvent
+	{
+		const char * m_name;
+		unsigned long long m_beginNanoSec;
+		unsigned long long m_endNanoSec;
+		int m_threadId;
+	};
+
+	struct ZoneStats
+	{
+		ZoneStats()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			m_name.clear();
+			m_count = 0;
+			m_totalMicroSec = 0.0;
+			m_minMicroSec = 0.0;
+			m_maxMicroSec = 0.0;
+		}
+
+		double GetAvgMicroSec() const
+		{
+			return m_count > 0 ? m_totalMicroSec / double(m_count) : 0.0;
+		}
+
+		std::string m_name;
+		long long m_count;
+		double m_totalMicroSec;
+		double m_minMicroSec;
+		double m_maxMicroSec;
+	};
+
+	class ScopedZone
+	{
+	public:
+		ScopedZone(const char * name)
+		{
+			m_name = IsEnabled() ? name : NULL;
+			m_beginNanoSec = m_name ? GetQualityTimeNanoSec() : 0;
+		}
+
+		~ScopedZone()
+		{
+			if (m_name)
+				RecordZone(m_name,m_beginNanoSec,GetQualityTimeNanoSec());
+		}
+
+	private:
+		const char * m_name;
+		unsigned long long m_beginNanoSec;
+	};
+
+	static void SetEnabled(bool enabled);
+	static bool IsEnabled();
+
+	// Size of each thread's ring buffer, in events. Only affects buffers created after the call.
+	static void SetEventsPerThread(int numEvents);
+
+	static void RecordZone(const char * name, unsigned long long beginNanoSec, unsigned long long endNanoSec);
+
+	static void Clear();
+
+	// all events still in the ring buffers, oldest first within each thread
+	static void GatherEvents(std::vector < ZoneEvent > & dstEvents);
+
+	// per name totals, sorted by total time
+	static void CalcZoneStats(std::vector < ZoneStats > & dstStats);
+	static void PrintZoneStats(FILE * fout);
+
+	// JSON in the Chrome trace event format, for chrome://tracing or Perfetto
+	static bool WriteChromeTrace(const char * fileName);
+};
+
+#if PROFILE_ZONES_ENABLED
+
+#define PROFILE_CONCAT_INNER(a,b) a##b
+#define PROFILE_CONCAT(a,b) PROFILE_CONCAT_INNER(a,b)
+#define PROFILE_ZONE(name) ProfileUtil::ScopedZone PROFILE_CONCAT(profileZone_,__LINE__)(name)
+
+#else
+
+#define PROFILE_ZONE(name)
+
+#endif
+
+#endif
@@ -0,0 +1,232 @@
+#include "ShProbeGrid.h"
+
+#include "ParallelUtil.h"
+#include "ProfileUtil.h"
+
+#include <emmintrin.h>
+
+void ShProbeGrid::Init(int numX, int numY, int numZ, Vec3 boundsMin, Vec3 boundsMax)
+{
+	ASSERT_ALWAYS(numX >= 1 && numY >= 1 && numZ >= 1);
+
+	m_numX = numX;
+	m_numY = numY;
+	m_numZ = numZ;
+	m_numBricksX = (numX + kBrickDim - 1) / kBrickDim;
+	m_numBricksY = (numY + kBrickDim - 1) / kBrickDim;
+	m_numBricksZ = (numZ + kBrickDim - 1) / kBrickDim;
+	m_boundsMin = boundsMin;
+	m_boundsMax = boundsMax;
+
+	m_bricks.assign((size_t)m_numBricksX*m_numBricksY*m_numBricksZ*kBrickFloats,0.0f);
+	for (size_t i = kNumCoefs; i < m_bricks.size(); i += kProbeFloats)
+		m_bricks[i] = 1.0f;
+}
+
+// Points at the first coef of the probe, the visibility is at kNumCoefs.
+const float * ShProbeGrid::GetProbeCoefs(int x, int y, int z) const
+{
+	int brickIndex = ((z/kBrickDim)*m_numBricksY + (y/kBrickDim))*m_numBricksX + (x/kBrickDim);
+	int localIndex = ((z%kBrickDim)*kBrickDim + (y%kBrickDim))*kBrickDim + (x%kBrickDim);
+	return &m_bricks[(size_t)brickIndex*kBrickFloats + localIndex*kProbeFloats];
+}
+
+float * ShProbeGrid::GetProbeCoefs(int x, int y, int z)
+{
+	return const_cast < float * >(static_cast < const ShProbeGrid * >(this)->GetProbeCoefs(x,y,z));
+}
+
+void ShProbeGrid::SetProbe(int x, int y, int z, const ColorSh3 & sh)
+{
+	float * coefs = GetProbeCoefs(x,y,z);
+	for (int j = 0; j < 9; j++)
+	{
+		for (int c = 0; c < 3; c++)
+			coefs[j*3 + c] = sh.m_coefs[j].m_data[c];
+	}
+}
+
+ColorSh3 ShProbeGrid::GetProbe(int x, int y, int z) const
+{
+	const float * coefs = GetProbeCoefs(x,y,z);
+
+	ColorSh3 ret;
+	for (int j = 0; j < 9; j++)
+	{
+		for (int c = 0; c < 3; c++)
+			ret.m_coefs[j].m_data[c] = coefs[j*3 + c];
+	}
+	return ret;
+}
+
+void ShProbeGrid::SetVisibility(int x, int y, int z, float visibility)
+{
+	GetProbeCoefs(x,y,z)[kNumCoefs] = visibility;
+}
+
+float ShProbeGrid::GetVisibility(int x, int y, int z) const
+{
+	return GetProbeCoefs(x,y,z)[kNumCoefs];
+}
+
+void ShProbeGrid::CalcCellCoord(CellCoord & dst, Vec3 pos) const
+{
+	const int numProbes[3] = { m_numX, m_numY, m_numZ };
+	for (int i = 0; i < 3; i++)
+	{
+		float extent = m_boundsMax.m_data[i] - m_boundsMin.m_data[i];
+		float g = (extent > 0.0f) ? (pos.m_data[i] - m_boundsMin.m_data[i]) / extent * float(numProbes[i] - 1) : 0.0f;
+		g = MaxFloat(0.0f,MinFloat(g,float(numProbes[i] - 1)));
+
+		int base = MinInt((int)g,MaxInt(0,numProbes[i] - 2));
+		dst.m_base[i] = base;
+		dst.m_next[i] = MinInt(base + 1,numProbes[i] - 1);
+		dst.m_frac[i] = g - float(base);
+	}
+}
+
+ColorSh3 ShProbeGrid::SampleCell(const CellCoord & cell, bool useVisibility) const
+{
+	// the corners are the base probe plus any mix of the x, y and z steps, which can cross into the next brick
+	const ptrdiff_t brickStrides[3] = { kBrickFloats, (ptrdiff_t)m_numBricksX*kBrickFloats, (ptrdiff_t)m_numBricksX*m_numBricksY*kBrickFloats };
+	const ptrdiff_t localStrides[3] = { kProbeFloats, kBrickDim*kProbeFloats, kBrickDim*kBrickDim*kProbeFloats };
+	ptrdiff_t steps[3];
+	for (int a = 0; a < 3; a++)
+	{
+		int base = cell.m_base[a];
+		int next = cell.m_next[a];
+		steps[a] = (next/kBrickDim - base/kBrickDim)*brickStrides[a] + (next%kBrickDim - base%kBrickDim)*localStrides[a];
+	}
+
+	const float * baseCoefs = GetProbeCoefs(cell.m_base[0],cell.m_base[1],cell.m_base[2]);
+
+	float weights[8];
+	const float * coefs[8];
+	float visibleWeight = 0.0f;
+	for (int i = 0; i < 8; i++)
+	{
+		float wx = (i & 1) ? cell.m_frac[0] : 1.0f - cell.m_frac[0];
+		float wy = (i & 2) ? cell.m_frac[1] : 1.0f - cell.m_frac[1];
+		float wz = (i & 4) ? cell.m_frac[2] : 1.0f - cell.m_frac[2];
+		weights[i] = wx*wy*wz;
+		coefs[i] = baseCoefs + ((i & 1) ? steps[0] : 0) + ((i & 2) ? steps[1] : 0) + ((i & 4) ? steps[2] : 0);
+		visibleWeight += weights[i] * coefs[i][kNumCoefs];
+	}
+
+	if (useVisibility && visibleWeight > 1e-6f)
+	{
+		float invVisibleWeight = 1.0f / visibleWeight;
+		for (int i = 0; i < 8; i++)
+			weights[i] *= coefs[i][kNumCoefs] * invVisibleWeight;
+	}
+
+	// 7 vectors per probe, the last lane of the last one is the visibility and gets ignored
+	__m128 sums[kProbeFloats/4];
+	for (int k = 0; k < kProbeFloats/4; k++)
+		sums[k] = _mm_setzero_ps();
+
+	for (int i = 0; i < 8; i++)
+	{
+		__m128 w = _mm_set1_ps(weights[i]);
+		const float * src = coefs[i];
+		for (int k = 0; k < kProbeFloats/4; k++)
+			sums[k] = _mm_add_ps(sums[k],_mm_mul_ps(w,_mm_loadu_ps(src + k*4)));
+	}
+
+	float result[kProbeFloats];
+	for (int k = 0; k < kProbeFloats/4; k++)
+		_mm_storeu_ps(result + k*4,sums[k]);
+
+	ColorSh3 ret;
+	for (int j = 0; j < 9; j++)
+		ret.m_coefs[j] = Vec3(result[j*3+0],result[j*3+1],result[j*3+2]);
+	return ret;
+}
+
+ColorSh3 ShProbeGrid::Sample(Vec3 pos, bool useVisibility) const
+{
+	CellCoord cell;
+	CalcCellCoord(cell,pos);
+	return SampleCell(cell,useVisibility);
+}
+
+// spreads the low 10 bits out to every third bit
+static unsigned int SpreadBits3(unsigned int val)
+{
+	val &= 0x3ff;
+	val = (val | (val << 16)) & 0x030000ff;
+	val = (val | (val << 8)) & 0x0300f00f;
+	val = (val | (val << 4)) & 0x030c30c3;
+	val = (val | (val << 2)) & 0x09249249;
+	return val;
+}
+
+static unsigned int CalcMortonCode(int x, int y, int z)
+{
+	return SpreadBits3(x) | (SpreadBits3(y) << 1) | (SpreadBits3(z) << 2);
+}
+
+// queries per thread block in SampleBatch()
+static const int s_sampleBlockSize = 1024;
+
+// Stable LSD radix sort on the 30 bit morton code in the high half of each key, 10 bits per pass. Equal codes keep
+// their index order, same as a full sort of the keys.
+static void SortByMortonCode(std::vector < unsigned long long > & keys)
+{
+	const int numKeys = (int)keys.size();
+	std::vector < unsigned long long > temp(numKeys);
+	std::vector < int > offsets(1 << 10);
+
+	for (int shift = 32; shift < 62; shift += 10)
+	{
+		for (int i = 0; i < (int)offsets.size(); i++)
+			offsets[i] = 0;
+		for (int i = 0; i < numKeys; i++)
+			offsets[(keys[i] >> shift) & 0x3ff]++;
+
+		int sum = 0;
+		for (int i = 0; i < (int)offsets.size(); i++)
+		{
+			int count = offsets[i];
+			offsets[i] = sum;
+			sum += count;
+		}
+
+		for (int i = 0; i < numKeys; i++)
+			temp[offsets[(keys[i] >> shift) & 0x3ff]++] = keys[i];
+		keys.swap(temp);
+	}
+}
+
+void ShProbeGrid::SampleBatch(ColorSh3 * dst, const Vec3 * positions, int numPositions, bool useVisibility, int numThreads) const
+{
+	PROFILE_ZONE("ShProbeGrid::SampleBatch");
+
+	std::vector < unsigned long long > order(numPositions);
+
+	// the morton code goes in the high bits and the query index in the low bits
+	ParallelUtil::ParallelForBlocks(numPositions,s_sampleBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			CellCoord cell;
+			CalcCellCoord(cell,positions[i]);
+			unsigned int code = CalcMortonCode(cell.m_base[0],cell.m_base[1],cell.m_base[2]);
+			order[i] = ((unsigned long long)code << 32) | (unsigned int)i;
+		}
+	});
+
+	SortByMortonCode(order);
+
+	// the cell is recomputed rather than stored, that's cheaper than a second scattered read per query
+	ParallelUtil::ParallelForBlocks(numPositions,s_sampleBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			int index = (int)(order[i] & 0xffffffff);
+			CellCoord cell;
+			CalcCellCoord(cell,positions[index]);
+			dst[index] = SampleCell(cell,useVisibility);
+		}
+	});
+}
@@ -0,0 +1,87 @@
+#ifndef _SH_PROBE_GRID_H_
+#define _SH_PROBE_GRID_H_
+
+#include "CoreHelpers.h"
+#include "Vec3.h"
+#include "ShUtil.h"
+
+#include <vector>
+
+// Regular grid of ColorSh3 probes spanning [m_boundsMin,m_boundsMax]. Probes are stored in 4x4x4 bricks, and each
+// probe is 28 contiguous floats: the 27 channel coefs followed by its visibility, so a trilinear query is 7 SSE loads
+// per corner. A brick is 7KB and keeps the y and z neighbours close instead of a row or a slice away, so queries
+// sorted in Morton order keep hitting the same few bricks.
+struct ShProbeGrid
+{
+	enum
+	{
+		kBrickDim = 4,
+		kBrickProbes = kBrickDim*kBrickDim*kBrickDim,
+		kNumCoefs = 27,
+		kProbeFloats = 28,
+		kBrickFloats = kProbeFloats*kBrickProbes
+	};
+
+	ShProbeGrid()
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		m_numX = 0;
+		m_numY = 0;
+		m_numZ = 0;
+		m_numBricksX = 0;
+		m_numBricksY = 0;
+		m_numBricksZ = 0;
+		m_boundsMin = Vec3(0,0,0);
+		m_boundsMax = Vec3(1,1,1);
+		m_bricks.clear();
+	}
+
+	// All probes start at zero with a visibility of 1. Each dimension needs at least 1 probe.
+	void Init(int numX, int numY, int numZ, Vec3 boundsMin, Vec3 boundsMax);
+
+	void SetProbe(int x, int y, int z, const ColorSh3 & sh);
+	ColorSh3 GetProbe(int x, int y, int z) const;
+
+	// 0 for probes that shouldn't contribute (inside geometry etc), only used by the visibility weighted queries
+	void SetVisibility(int x, int y, int z, float visibility);
+	float GetVisibility(int x, int y, int z) const;
+
+	// Trilinear interpolation of the 8 probes around pos, clamped to the bounds. With useVisibility the trilinear
+	// weights are scaled by the probe visibility and renormalized, falling back to plain trilinear when all 8 are
+	// invisible.
+	ColorSh3 Sample(Vec3 pos, bool useVisibility) const;
+
+	// Same as Sample() for many positions. The queries are sorted by the Morton code of their cell before they are
+	// split across threads, and the results go back in the original order.
+	void SampleBatch(ColorSh3 * dst, const Vec3 * positions, int numPositions, bool useVisibility, int numThreads) const;
+
+	int m_numX;
+	int m_numY;
+	int m_numZ;
+	int m_numBricksX;
+	int m_numBricksY;
+	int m_numBricksZ;
+	Vec3 m_boundsMin;
+	Vec3 m_boundsMax;
+
+	std::vector < float > m_bricks; // kBrickFloats per brick, kProbeFloats per probe with x fastest
+
+private:
+	struct CellCoord
+	{
+		int m_base[3];
+		int m_next[3];
+		float m_frac[3];
+	};
+
+	void CalcCellCoord(CellCoord & dst, Vec3 pos) const;
+	ColorSh3 SampleCell(const CellCoord & cell, bool useVisibility) const;
+	float * GetProbeCoefs(int x, int y, int z);
+	const float * GetProbeCoefs(int x, int y, int z) const;
+};
+
+#endif
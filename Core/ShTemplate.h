@@ -0,0 +1,478 @@
+#ifndef _SH_TEMPLATE_H_
+#define _SH_TEMPLATE_H_
+
+#include "CoreHelpers.h"
+#include "Vec3.h"
+#include "ShUtil.h"
+
+#include <vector>
+#include <algorithm>
+
+// SH of any order from 2 to 5 with any number of channels. Coef l*l+l+m is band l, m in [-l,l], with the same
+// basis and signs as GreySh3/ColorSh3, so Sh<3,1> and Sh<3,3> hold exactly the same numbers.
+template <int Order, int Channels>
+struct Sh
+{
+	static_assert(Order >= 2 && Order <= 5, "Sh supports orders 2 to 5");
+
+	enum
+	{
+		kOrder = Order,
+		kNumCoefs = Order*Order,
+		kNumChannels = Channels
+	};
+
+	Sh()
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		for (int i = 0; i < kNumCoefs; i++)
+		{
+			for (int c = 0; c < Channels; c++)
+				m_coefs[i][c] = 0.0f;
+		}
+	}
+
+	float m_coefs[kNumCoefs][Channels];
+};
+
+// Rotation matrices for bands 1 to Order-1, band l is (2l+1)x(2l+1) and starts at GetBandOffset(l).
+template <int Order>
+struct ShBandRotation
+{
+	static int GetBandOffset(int band)
+	{
+		return band*(2*band - 1)*(2*band + 1)/3 - 1;
+	}
+
+	enum
+	{
+		kNumFloats = Order*(2*Order - 1)*(2*Order + 1)/3 - 1
+	};
+
+	float m_bands[kNumFloats];
+};
+
+// Everything the basis needs is a compile time constant. The associated Legendre polynomials in z are unrolled by
+// the templates below, and the constants only depend on the template arguments, so they fold away.
+namespace ShTemplateDetail
+{
+	// Newton iterations, only ever called with constants. A fixed count since the last bit can flip back and forth.
+	constexpr double ConstSqrtIter(double x, double cur, int numIters)
+	{
+		return (numIters == 0) ? cur : ConstSqrtIter(x,0.5*(cur + x/cur),numIters-1);
+	}
+
+	constexpr double ConstSqrt(double x)
+	{
+		return (x <= 0.0) ? 0.0 : ConstSqrtIter(x,x > 1.0 ? x : 1.0,64);
+	}
+
+	// (lo)!/(hi)! for lo <= hi
+	constexpr double FactorialRatio(int lo, int hi)
+	{
+		return (hi <= lo) ? 1.0 : FactorialRatio(lo,hi-1) / double(hi);
+	}
+
+	constexpr double DoubleFactorial(int n)
+	{
+		return (n <= 1) ? 1.0 : double(n) * DoubleFactorial(n-2);
+	}
+
+	// K(l,m), with the sqrt(2) for m != 0 folded in
+	constexpr double Normalization(int l, int m)
+	{
+		return ConstSqrt((2.0*l + 1.0) / (4.0*3.14159265358979323846) * FactorialRatio(l-m,l+m)) * (m == 0 ? 1.0 : 1.41421356237309504880);
+	}
+
+	template <int L, int M>
+	struct Constants
+	{
+		static constexpr float kNorm = float(Normalization(L,M));
+
+		// Q(M,M) with the Condon-Shortley phase
+		static constexpr float kStart = float((M % 2 ? -1.0 : 1.0) * DoubleFactorial(2*M - 1));
+
+		// Q(L,M) = (a*z*Q(L-1,M) - b*Q(L-2,M))
+		static constexpr float kStepA = float(2*L - 1) / float(L > M ? L - M : 1);
+		static constexpr float kStepB = float(L + M - 1) / float(L > M ? L - M : 1);
+	};
+
+	template <int L, int M>
+	inline void Store(float * dst, float q, float cosM, float sinM)
+	{
+		if (M == 0)
+			dst[L*L + L] = Constants < L, M >::kNorm * q;
+		else
+		{
+			float scaled = Constants < L, M >::kNorm * q;
+			dst[L*L + L + M] = scaled * cosM;
+			dst[L*L + L - M] = scaled * sinM;
+		}
+	}
+
+	// bands L and up for one M, q1 = Q(L-1,M) and q2 = Q(L-2,M)
+	template <int Order, int L, int M, bool Done = (L >= Order)>
+	struct LegendreSteps
+	{
+		static inline void Eval(float * dst, float z, float cosM, float sinM, float q1, float q2)
+		{
+			float q = Constants < L, M >::kStepA * z * q1 - Constants < L, M >::kStepB * q2;
+			Store < L, M >(dst,q,cosM,sinM);
+			LegendreSteps < Order, L+1, M >::Eval(dst,z,cosM,sinM,q,q1);
+		}
+	};
+
+	template <int Order, int L, int M>
+	struct LegendreSteps < Order, L, M, true >
+	{
+		static inline void Eval(float *, float, float, float, float, float)
+		{
+		}
+	};
+
+	// all the coefs with |m| = M, and then M+1. cosM and sinM are the real and imaginary parts of (x+iy)^M.
+	template <int Order, int M, bool Done = (M >= Order)>
+	struct OrderSteps
+	{
+		static inline void Eval(float * dst, float x, float y, float z, float cosM, float sinM)
+		{
+			float qMM = Constants < M, M >::kStart;
+			Store < M, M >(dst,qMM,cosM,sinM);
+			LegendreSteps < Order, M+1, M >::Eval(dst,z,cosM,sinM,qMM,0.0f);
+
+			OrderSteps < Order, M+1 >::Eval(dst,x,y,z,x*cosM - y*sinM,x*sinM + y*cosM);
+		}
+	};
+
+	template <int Order, int M>
+	struct OrderSteps < Order, M, true >
+	{
+		static inline void Eval(float *, float, float, float, float, float)
+		{
+		}
+	};
+}
+
+class ShTemplateUtil
+{
+public:
+	// the Order*Order basis values for a unit direction
+	template <int Order>
+	static void EvalBasis(float dst[Order*Order], Vec3 N)
+	{
+		ShTemplateDetail::OrderSteps < Order, 0 >::Eval(dst,N.x,N.y,N.z,1.0f,0.0f);
+	}
+
+	template <int Order>
+	static Sh < Order, 1 > ProjectNormal(Vec3 N)
+	{
+		Sh < Order, 1 > ret;
+		float basis[Order*Order];
+		EvalBasis < Order >(basis,N);
+		for (int i = 0; i < Order*Order; i++)
+			ret.m_coefs[i][0] = basis[i];
+		return ret;
+	}
+
+	// dst += ProjectNormal(N) * weights
+	template <int Order, int Channels>
+	static void AddProjectedNormal(Sh < Order, Channels > & dst, Vec3 N, const float weights[Channels])
+	{
+		float basis[Order*Order];
+		EvalBasis < Order >(basis,N);
+		for (int i = 0; i < Order*Order; i++)
+		{
+			for (int c = 0; c < Channels; c++)
+				dst.m_coefs[i][c] += basis[i] * weights[c];
+		}
+	}
+
+	// per channel dot product
+	template <int Order, int Channels>
+	static void DotProduct(float dst[Channels], const Sh < Order, Channels > & lhs, const Sh < Order, Channels > & rhs)
+	{
+		for (int c = 0; c < Channels; c++)
+			dst[c] = 0.0f;
+		for (int i = 0; i < Order*Order; i++)
+		{
+			for (int c = 0; c < Channels; c++)
+				dst[c] += lhs.m_coefs[i][c] * rhs.m_coefs[i][c];
+		}
+	}
+
+	template <int Order>
+	static float DotProduct(const Sh < Order, 1 > & lhs, const Sh < Order, 1 > & rhs)
+	{
+		float ret;
+		DotProduct < Order, 1 >(&ret,lhs,rhs);
+		return ret;
+	}
+
+	// value of the function in direction N, per channel
+	template <int Order, int Channels>
+	static void EvalDirection(float dst[Channels], const Sh < Order, Channels > & src, Vec3 N)
+	{
+		float basis[Order*Order];
+		EvalBasis < Order >(basis,N);
+
+		for (int c = 0; c < Channels; c++)
+			dst[c] = 0.0f;
+		for (int i = 0; i < Order*Order; i++)
+		{
+			for (int c = 0; c < Channels; c++)
+				dst[c] += src.m_coefs[i][c] * basis[i];
+		}
+	}
+
+	// Same convention as ShUtil::RotateSh(), rotating ProjectNormal(n) gives ProjectNormal(mat*n). Bands 1 and 2
+	// come from ShUtil::BuildShRotation(), the higher bands are fit to the rotated basis at a fixed set of
+	// directions (see GetRotationFit()).
+	template <int Order>
+	static void BuildRotation(ShBandRotation < Order > & dst, const float mat[3][3])
+	{
+		ShRotation lowBands;
+		ShUtil::BuildShRotation(lowBands,mat);
+
+		float * band1 = dst.m_bands + ShBandRotation < Order >::GetBandOffset(1);
+		for (int r = 0; r < 3; r++)
+		{
+			for (int c = 0; c < 3; c++)
+				band1[r*3 + c] = lowBands.m_band1[r][c];
+		}
+
+		if (Order >= 3)
+		{
+			float * band2 = dst.m_bands + ShBandRotation < Order >::GetBandOffset(2);
+			for (int r = 0; r < 5; r++)
+			{
+				for (int c = 0; c < 5; c++)
+					band2[r*5 + c] = lowBands.m_band2[r][c];
+			}
+		}
+
+		if (Order >= 4)
+		{
+			const RotationFit & fit = GetRotationFit < Order >();
+
+			// basis at R^T d for every fit direction
+			int numDirs = (int)fit.m_dirs.size();
+			std::vector < float > rotatedBasis(numDirs*Order*Order);
+			for (int k = 0; k < numDirs; k++)
+			{
+				Vec3 d = fit.m_dirs[k];
+				Vec3 rd;
+				for (int c = 0; c < 3; c++)
+					rd.m_data[c] = mat[0][c]*d.x + mat[1][c]*d.y + mat[2][c]*d.z;
+				EvalBasis < Order >(&rotatedBasis[k*Order*Order],rd);
+			}
+
+			for (int band = 3; band < Order; band++)
+			{
+				int size = 2*band + 1;
+				int first = band*band;
+				const double * pinv = &fit.m_pinvs[band][0];
+				float * bandMat = dst.m_bands + ShBandRotation < Order >::GetBandOffset(band);
+
+				for (int r = 0; r < size; r++)
+				{
+					for (int c = 0; c < size; c++)
+					{
+						double sum = 0.0;
+						for (int k = 0; k < numDirs; k++)
+							sum += pinv[r*numDirs + k] * rotatedBasis[k*Order*Order + first + c];
+						bandMat[r*size + c] = float(sum);
+					}
+				}
+			}
+		}
+	}
+
+	template <int Order, int Channels>
+	static void Rotate(Sh < Order, Channels > & dst, const Sh < Order, Channels > & src, const ShBandRotation < Order > & rot)
+	{
+		Sh < Order, Channels > ret;
+		for (int c = 0; c < Channels; c++)
+			ret.m_coefs[0][c] = src.m_coefs[0][c];
+
+		for (int band = 1; band < Order; band++)
+		{
+			int size = 2*band + 1;
+			int first = band*band;
+			const float * bandMat = rot.m_bands + ShBandRotation < Order >::GetBandOffset(band);
+			for (int r = 0; r < size; r++)
+			{
+				for (int i = 0; i < size; i++)
+				{
+					float m = bandMat[r*size + i];
+					for (int c = 0; c < Channels; c++)
+						ret.m_coefs[first + r][c] += m * src.m_coefs[first + i][c];
+				}
+			}
+		}
+
+		dst = ret;
+	}
+
+	template <int Order, int Channels>
+	static Sh < Order, Channels > Rotate(const Sh < Order, Channels > & src, const float mat[3][3])
+	{
+		ShBandRotation < Order > rot;
+		BuildRotation(rot,mat);
+
+		Sh < Order, Channels > ret;
+		Rotate(ret,src,rot);
+		return ret;
+	}
+
+	static Sh < 3, 1 > FromGreySh3(const GreySh3 & src)
+	{
+		Sh < 3, 1 > ret;
+		for (int i = 0; i < 9; i++)
+			ret.m_coefs[i][0] = src.m_coefs[i];
+		return ret;
+	}
+
+	static Sh < 3, 3 > FromColorSh3(const ColorSh3 & src)
+	{
+		Sh < 3, 3 > ret;
+		for (int i = 0; i < 9; i++)
+		{
+			for (int c = 0; c < 3; c++)
+				ret.m_coefs[i][c] = src.m_coefs[i].m_data[c];
+		}
+		return ret;
+	}
+
+	static ColorSh3 ToColorSh3(const Sh < 3, 3 > & src)
+	{
+		ColorSh3 ret;
+		for (int i = 0; i < 9; i++)
+			ret.m_coefs[i] = Vec3(src.m_coefs[i][0],src.m_coefs[i][1],src.m_coefs[i][2]);
+		return ret;
+	}
+
+private:
+	// Least squares fit of the band rotations: with Y[k][m] the basis at direction d_k, the rotated coefs are
+	// pinv(Y) * Yr * coefs where Yr is the basis at R^T d_k. Twice as many directions as coefs in the biggest band
+	// keeps the fit well conditioned. Built once per order.
+	struct RotationFit
+	{
+		std::vector < Vec3 > m_dirs;
+		std::vector < double > m_pinvs[5]; // per band, (2l+1) x numDirs
+	};
+
+	template <int Order>
+	static const RotationFit & GetRotationFit()
+	{
+		static const RotationFit s_fit = BuildRotationFit < Order >();
+		return s_fit;
+	}
+
+	template <int Order>
+	static RotationFit BuildRotationFit()
+	{
+		RotationFit fit;
+
+		// fibonacci sphere
+		int numDirs = 2*(2*Order - 1);
+		for (int k = 0; k < numDirs; k++)
+		{
+			double z = 1.0 - (2.0*k + 1.0) / double(numDirs);
+			double r = sqrt(1.0 - z*z);
+			double phi = 2.39996322972865332 * k;
+			fit.m_dirs.push_back(Vec3(float(r*cos(phi)),float(r*sin(phi)),float(z)));
+		}
+
+		std::vector < float > basis(numDirs*Order*Order);
+		for (int k = 0; k < numDirs; k++)
+			EvalBasis < Order >(&basis[k*Order*Order],fit.m_dirs[k]);
+
+		for (int band = 3; band < Order; band++)
+		{
+			int size = 2*band + 1;
+			int first = band*band;
+
+			// pinv = (Y^T Y)^-1 Y^T, solved with Gauss-Jordan on [Y^T Y | Y^T]
+			int numCols = size + numDirs;
+			std::vector < double > aug(size*numCols);
+			for (int r = 0; r < size; r++)
+			{
+				for (int c = 0; c < size; c++)
+				{
+					double sum = 0.0;
+					for (int k = 0; k < numDirs; k++)
+						sum += double(basis[k*Order*Order + first + r]) * double(basis[k*Order*Order + first + c]);
+					aug[r*numCols + c] = sum;
+				}
+				for (int k = 0; k < numDirs; k++)
+					aug[r*numCols + size + k] = basis[k*Order*Order + first + r];
+			}
+
+			for (int col = 0; col < size; col++)
+			{
+				int pivot = col;
+				for (int r = col+1; r < size; r++)
+				{
+					if (fabs(aug[r*numCols + col]) > fabs(aug[pivot*numCols + col]))
+						pivot = r;
+				}
+				for (int c = 0; c < numCols; c++)
+					std::swap(aug[col*numCols + c],aug[pivot*numCols + c]);
+
+				double invPivot = 1.0 / aug[col*numCols + col];
+				for (int c = 0; c < numCols; c++)
+					aug[col*numCols + c] *= invPivot;
+
+				for (int r = 0; r < size; r++)
+				{
+					double scale = aug[r*numCols + col];
+					if (r == col || scale == 0.0)
+						continue;
+					for (int c = 0; c < numCols; c++)
+						aug[r*numCols + c] -= scale * aug[col*numCols + c];
+				}
+			}
+
+			fit.m_pinvs[band].resize(size*numDirs);
+			for (int r = 0; r < size; r++)
+			{
+				for (int k = 0; k < numDirs; k++)
+					fit.m_pinvs[band][r*numDirs + k] = aug[r*numCols + size + k];
+			}
+		}
+
+		return fit;
+	}
+};
+
+// Order 3 is the hot case, so it uses the same expanded polynomial as ShUtil::ProjectNormal() instead of the
+// recurrence. The constants are the normalizations times the Legendre factors: Q(2,1) = -3z, Q(2,0) = 1.5z^2 - 0.5
+// and Q(2,2) = 3.
+template <>
+inline void ShTemplateUtil::EvalBasis < 3 >(float dst[9], Vec3 N)
+{
+	using ShTemplateDetail::Constants;
+
+	const float c0 = Constants < 0, 0 >::kNorm;
+	const float c1 = Constants < 1, 0 >::kNorm; // same as Constants < 1, 1 >::kNorm
+	const float c2 = 3.0f * Constants < 2, 1 >::kNorm;
+	const float c3 = 1.5f * Constants < 2, 0 >::kNorm;
+	const float c4 = -0.5f * Constants < 2, 0 >::kNorm;
+	const float c5 = 3.0f * Constants < 2, 2 >::kNorm;
+
+	dst[0] = c0;
+	dst[1] = -c1 * N.y;
+	dst[2] = c1 * N.z;
+	dst[3] = -c1 * N.x;
+	dst[4] = c2*N.x*N.y;
+	dst[5] = -c2*N.y*N.z;
+	dst[6] = c3*N.z*N.z + c4;
+	dst[7] = -c2*N.x*N.z;
+	dst[8] = c5*(N.x*N.x - N.y*N.y);
+}
+
+#endif
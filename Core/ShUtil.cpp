@@ -1,6 +1,11 @@
 #include "ShUtil.h"
 
-//#include "LinearAlgebraUtil.h"
+#include "ParallelUtil.h"
+#include "ProfileUtil.h"
+#include "SimdHelpers.h"
+#include "HalfUtil.h"
+
+#include <vector>
 
 const static float s_c0 = 0.28209479177f; // 1 / (2 * sqrt(pi))
 const static float s_c1 = 0.4886025119f; // sqrt(3)/(2*sqrt(pi))
@@ -12,19 +17,7 @@ const static float s_c3 = 0.94617469575; // (3*sqrt(5))/(4*sqrt(pi))
 const static float s_c4 = -0.31539156525;// (-sqrt(5))/(4*sqrt(pi))
 const static float s_c5 = 0.54627421529; // (sqrt(15))/(4*sqrt(pi))
 
-const static float s_c_scale = 1.0/0.91529123286551084;
-const static float s_c_scale_inv = 0.91529123286551084;
-
-const static float s_rc2 = 1.5853309190550713*s_c_scale;
-const static float s_c4_div_c3 = s_c4/s_c3;
-const static float s_c4_div_c3_x2 = (s_c4/s_c3)*2.0;
-
-const static float s_scale_dst2 = s_c3 * s_c_scale_inv;
-const static float s_scale_dst4 = s_c5 * s_c_scale_inv;
-
-
-
-const static float s_inv_sqrt_2 = 0.70710678118f;
+const static float s_c3_plus_c4 = s_c3 + s_c4; // sqrt(5)/(2*sqrt(pi))
 
 float ShUtil::DotProduct(const GreySh3 & lhs, const GreySh3 & rhs)
 {
@@ -56,485 +49,1295 @@ GreySh3 ShUtil::ProjectNormal(Vec3 N)
 	return ret;
 }
 
-static void ProjectBand1(float dst[3], const float src[3])
+// Band 1 is a vector: s1*Y1 + s2*Y2 + s3*Y3 = c1 * dot(a,n) with a = (-s3,-s1,s2). Rotating the function
+// rotates a.
+template <class T>
+static void RotateBand1(T dst[3], const T src[3], const float mat[3][3])
 {
-	dst[0] = -s_c1 * src[1];
-	dst[1] = s_c1 * src[2];
-	dst[2] = -s_c1 * src[0];
-}
+	T ax = -1.0f*src[2];
+	T ay = -1.0f*src[0];
+	T az = src[1];
 
+	T rx = ax*mat[0][0] + ay*mat[0][1] + az*mat[0][2];
+	T ry = ax*mat[1][0] + ay*mat[1][1] + az*mat[1][2];
+	T rz = ax*mat[2][0] + ay*mat[2][1] + az*mat[2][2];
 
-static void ProjectBand2(float dst[5], const float src[3])
-{
-	dst[0] = s_c2*src[0]*src[1];
-	dst[1] = -s_c2*src[1]*src[2];
-	dst[2] = s_c3*src[2]*src[2] + s_c4;
-	dst[3] = -s_c2*src[0]*src[2];
-	dst[4] = s_c5*(src[0]*src[0] - src[1]*src[1]);
+	dst[0] = -1.0f*ry;
+	dst[1] = rz;
+	dst[2] = -1.0f*rx;
 }
 
-static void MulMatVec3(float dst[3], const float lhs[3][3], const float rhs[3])
+// Band 2 is a traceless symmetric quadratic form n^T Q n (Y6 = c3*z*z + c4 is traceless on the sphere), and
+// rotating the function turns Q into R Q R^T. About 60 mul/add, all in float.
+template <class T>
+static void RotateBand2(T dst[5], const T src[5], const float mat[3][3])
 {
+	const float halfC2 = 0.5f*s_c2;
+
+	T q[3][3];
+	q[0][1] = q[1][0] = src[0]*halfC2;
+	q[1][2] = q[2][1] = src[1]*(-halfC2);
+	q[0][2] = q[2][0] = src[3]*(-halfC2);
+	q[0][0] = src[4]*s_c5 + src[2]*s_c4;
+	q[1][1] = src[4]*(-s_c5) + src[2]*s_c4;
+	q[2][2] = src[2]*s_c3_plus_c4;
+
+	// t = Q R^T
+	T t[3][3];
 	for (int r = 0; r < 3; r++)
 	{
-		float sum = 0.0f;
 		for (int c = 0; c < 3; c++)
-			sum += lhs[r][c]*rhs[c];
-		dst[r] = sum;
+			t[r][c] = q[r][0]*mat[c][0] + q[r][1]*mat[c][1] + q[r][2]*mat[c][2];
 	}
+
+	// only the entries of R t that the basis needs
+	T rxx = t[0][0]*mat[0][0] + t[1][0]*mat[0][1] + t[2][0]*mat[0][2];
+	T ryy = t[0][1]*mat[1][0] + t[1][1]*mat[1][1] + t[2][1]*mat[1][2];
+	T rzz = t[0][2]*mat[2][0] + t[1][2]*mat[2][1] + t[2][2]*mat[2][2];
+	T rxy = t[0][1]*mat[0][0] + t[1][1]*mat[0][1] + t[2][1]*mat[0][2];
+	T ryz = t[0][2]*mat[1][0] + t[1][2]*mat[1][1] + t[2][2]*mat[1][2];
+	T rxz = t[0][2]*mat[0][0] + t[1][2]*mat[0][1] + t[2][2]*mat[0][2];
+
+	dst[0] = rxy*(2.0f/s_c2);
+	dst[1] = ryz*(-2.0f/s_c2);
+	dst[2] = rzz*(1.0f/s_c3_plus_c4);
+	dst[3] = rxz*(-2.0f/s_c2);
+	dst[4] = (rxx - ryy)*(0.5f/s_c5);
 }
 
-static void MulMatVec3Flat(float dst[3], const float lhs[9], const float rhs[3])
+static void MulMatMat3(float dst[3][3], const float lhs[3][3], const float rhs[3][3])
 {
 	for (int r = 0; r < 3; r++)
 	{
-		float sum = 0.0f;
 		for (int c = 0; c < 3; c++)
-			sum += lhs[r*3+c]*rhs[c];
-		dst[r] = sum;
+		{
+			float sum = 0;
+			for (int i = 0; i < 3; i++)
+			{
+				sum += lhs[r][i] * rhs[i][c];
+			}
+			dst[r][c] = sum;
+		}
 	}
 }
 
-static void MulMatTransVec3(float dst[3], const float lhs[3][3], const float rhs[3])
+void ShUtil::MakeRotationMatrixRadians(float dst[3][3], float thetaX, float thetaY, float thetaZ)
 {
-	for (int r = 0; r < 3; r++)
+	float rotX[3][3];
+	float rotY[3][3];
+	float rotZ[3][3];
+
+	float cx = cosf(thetaX);
+	float cy = cosf(thetaY);
+	float cz = cosf(thetaZ);
+
+	float sx = sinf(thetaX);
+	float sy = sinf(thetaY);
+	float sz = sinf(thetaZ);
+
+	memset(rotX,0,sizeof(rotX));
+	memset(rotY,0,sizeof(rotY));
+	memset(rotZ,0,sizeof(rotZ));
+
+	rotX[0][0] = 1.0f;
+	rotX[1][1] = cx;
+	rotX[1][2] = -sx;
+	rotX[2][1] = sx;
+	rotX[2][2] = cx;
+
+	rotY[0][0] = cy;
+	rotY[0][2] = sy;
+	rotY[1][1] = 1.0f;
+	rotY[2][0] = -sy;
+	rotY[2][2] = cy;
+
+	rotZ[0][0] = cz;
+	rotZ[0][1] = -sz;
+	rotZ[1][0] = sz;
+	rotZ[1][1] = cz;
+	rotZ[2][2] = 1.0f;
+
+	float rotZY[3][3];
+	MulMatMat3(rotZY,rotZ,rotY);
+	MulMatMat3(dst,rotZY,rotX);
+
+}
+
+static const float s_degToRad = 3.14159f/180.0f;
+
+void ShUtil::MakeRotationMatrixDegrees(float dst[3][3], float thetaX, float thetaY, float thetaZ)
+{
+	float thetaRadX = s_degToRad * thetaX;
+	float thetaRadY = s_degToRad * thetaY;
+	float thetaRadZ = s_degToRad * thetaZ;
+
+	MakeRotationMatrixRadians(dst,thetaRadX,thetaRadY,thetaRadZ);
+}
+
+
+void ShUtil::BuildShRotation(ShRotation & dst, const float mat[3][3])
+{
+	// the columns are the rotated unit vectors
+	for (int c = 0; c < 3; c++)
 	{
-		float sum = 0.0f;
-		for (int c = 0; c < 3; c++)
-			sum += lhs[c][r]*rhs[c];
-		dst[r] = sum;
+		float unit[3] = { 0, 0, 0 };
+		float rotated[3];
+		unit[c] = 1.0f;
+		RotateBand1(rotated,unit,mat);
+		for (int r = 0; r < 3; r++)
+			dst.m_band1[r][c] = rotated[r];
+	}
+
+	for (int c = 0; c < 5; c++)
+	{
+		float unit[5] = { 0, 0, 0, 0, 0 };
+		float rotated[5];
+		unit[c] = 1.0f;
+		RotateBand2(rotated,unit,mat);
+		for (int r = 0; r < 5; r++)
+			dst.m_band2[r][c] = rotated[r];
 	}
 }
 
-static void MulMatVec3(float dst[3], const std::vector < float > lhs, const float rhs[3])
+GreySh3 ShUtil::RotateSh(const GreySh3 & lhs, const float mat[3][3])
 {
+	GreySh3 ret;
+	ret.m_coefs[0] = lhs.m_coefs[0];
+	RotateBand1(ret.m_coefs+1,lhs.m_coefs+1,mat);
+	RotateBand2(ret.m_coefs+4,lhs.m_coefs+4,mat);
+	return ret;
+}
+
+ColorSh3 ShUtil::RotateSh(const ColorSh3 & lhs, const float mat[3][3])
+{
+	ColorSh3 ret;
+	ret.m_coefs[0] = lhs.m_coefs[0];
+	RotateBand1(ret.m_coefs+1,lhs.m_coefs+1,mat);
+	RotateBand2(ret.m_coefs+4,lhs.m_coefs+4,mat);
+	return ret;
+}
+
+template <class T>
+static void ApplyShRotation(T dst[9], const T src[9], const ShRotation & rot)
+{
+	dst[0] = src[0];
 	for (int r = 0; r < 3; r++)
-	{
-		float sum = 0.0f;
-		for (int c = 0; c < 3; c++)
-			sum += lhs[r*3+c]*rhs[c];
-		dst[r] = sum;
-	}
+		dst[1+r] = src[1]*rot.m_band1[r][0] + src[2]*rot.m_band1[r][1] + src[3]*rot.m_band1[r][2];
+	for (int r = 0; r < 5; r++)
+		dst[4+r] = src[4]*rot.m_band2[r][0] + src[5]*rot.m_band2[r][1] + src[6]*rot.m_band2[r][2] + src[7]*rot.m_band2[r][3] + src[8]*rot.m_band2[r][4];
+}
+
+GreySh3 ShUtil::RotateSh(const GreySh3 & lhs, const ShRotation & rot)
+{
+	GreySh3 ret;
+	ApplyShRotation(ret.m_coefs,lhs.m_coefs,rot);
+	return ret;
 }
-static void MulMatTransVec3(float dst[3], const std::vector < float > lhs, const float rhs[3])
+
+ColorSh3 ShUtil::RotateSh(const ColorSh3 & lhs, const ShRotation & rot)
+{
+	ColorSh3 ret;
+	ApplyShRotation(ret.m_coefs,lhs.m_coefs,rot);
+	return ret;
+}
+
+// Rotates 4 single channel SH at once, one per SSE lane. Each one is 9 floats coefStride apart. All the loads
+// happen before the stores, so dst can be the same as src.
+static void RotateShSimd4(float * const dst[4], const float * const src[4], int coefStride, const ShRotation & rot)
 {
+	__m128 s[9];
+	for (int j = 0; j < 9; j++)
+		s[j] = _mm_setr_ps(src[0][j*coefStride],src[1][j*coefStride],src[2][j*coefStride],src[3][j*coefStride]);
+
+	__m128 d[9];
+	d[0] = s[0];
 	for (int r = 0; r < 3; r++)
 	{
-		float sum = 0.0f;
-		for (int c = 0; c < 3; c++)
-			sum += lhs[c*3+r]*rhs[c];
-		dst[r] = sum;
+		__m128 sum = _mm_mul_ps(s[1],_mm_set1_ps(rot.m_band1[r][0]));
+		sum = _mm_add_ps(sum,_mm_mul_ps(s[2],_mm_set1_ps(rot.m_band1[r][1])));
+		sum = _mm_add_ps(sum,_mm_mul_ps(s[3],_mm_set1_ps(rot.m_band1[r][2])));
+		d[1+r] = sum;
+	}
+	for (int r = 0; r < 5; r++)
+	{
+		__m128 sum = _mm_mul_ps(s[4],_mm_set1_ps(rot.m_band2[r][0]));
+		for (int c = 1; c < 5; c++)
+			sum = _mm_add_ps(sum,_mm_mul_ps(s[4+c],_mm_set1_ps(rot.m_band2[r][c])));
+		d[4+r] = sum;
+	}
+
+	for (int j = 0; j < 9; j++)
+	{
+		float lanes[4];
+		_mm_storeu_ps(lanes,d[j]);
+		for (int k = 0; k < 4; k++)
+			dst[k][j*coefStride] = lanes[k];
 	}
 }
 
+// SH per thread block in the batch functions
+static const int s_rotateBlockSize = 256;
 
-static void RotateBand1Opt(float dst[3], const float src[3], const float mat[3][3])
+// Shared by the grey and color versions. Channel i is numChannels floats in, and its coefs are coefStride floats
+// apart. The leftover channels are padded by repeating the last one.
+static void RotateShChannels(float * dstBase, const float * srcBase, int numSh, int shStride, int numChannels, int coefStride, const ShRotation & rot, int numThreads)
 {
-	dst[0] = ( mat[1][1])*src[0] + (-mat[1][2])*src[1] + ( mat[1][0])*src[2];
-	dst[1] = (-mat[2][1])*src[0] + ( mat[2][2])*src[1] + (-mat[2][0])*src[2];
-	dst[2] = ( mat[0][1])*src[0] + (-mat[0][2])*src[1] + ( mat[0][0])*src[2];
+	ParallelUtil::ParallelForBlocks(numSh,s_rotateBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		int firstChannel = begin*numChannels;
+		int endChannel = end*numChannels;
+		for (int i = firstChannel; i < endChannel; i += 4)
+		{
+			float * dst[4];
+			const float * src[4];
+			for (int k = 0; k < 4; k++)
+			{
+				int channel = MinInt(i + k,endChannel - 1);
+				int sh = channel / numChannels;
+				int offset = sh*shStride + (channel - sh*numChannels);
+				dst[k] = dstBase + offset;
+				src[k] = srcBase + offset;
+			}
+			RotateShSimd4(dst,src,coefStride,rot);
+		}
+	});
 }
 
+void ShUtil::RotateShBatch(GreySh3 * dst, const GreySh3 * src, int numSh, const float mat[3][3], int numThreads)
+{
+	ShRotation rot;
+	BuildShRotation(rot,mat);
+	RotateShChannels(dst[0].m_coefs,src[0].m_coefs,numSh,sizeof(GreySh3)/sizeof(float),1,1,rot,numThreads);
+}
 
-static void RotateBand1(float dst[3], const float src[3], const float mat[3][3])
+void ShUtil::RotateShBatch(ColorSh3 * dst, const ColorSh3 * src, int numSh, const float mat[3][3], int numThreads)
 {
-	// fic rotations!
-	ASSERT_ALWAYS(0);
+	ShRotation rot;
+	BuildShRotation(rot,mat);
+	RotateShChannels(dst[0].m_coefs[0].m_data,src[0].m_coefs[0].m_data,numSh,sizeof(ColorSh3)/sizeof(float),3,sizeof(Vec3)/sizeof(float),rot,numThreads);
+}
 
+void ShUtil::RotateShBatch(GreySh3 * dst, const GreySh3 * src, const float (*mats)[3][3], int numSh, int numThreads)
+{
+	ParallelUtil::ParallelForBlocks(numSh,s_rotateBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			dst[i] = RotateSh(src[i],mats[i]);
+	});
+}
 
-	float r0[3] = {1,0,0};
-	float r1[3] = {0,1,0};
-	float r2[3] = {0,0,1};
+void ShUtil::RotateShBatch(ColorSh3 * dst, const ColorSh3 * src, const float (*mats)[3][3], int numSh, int numThreads)
+{
+	ParallelUtil::ParallelForBlocks(numSh,s_rotateBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			dst[i] = RotateSh(src[i],mats[i]);
+	});
+}
 
-	float data_trans[3][3];
+// same basis as ProjectNormal(), 4 normals at a time
+static inline void ProjectNormalSimd4(__m128 dst[9], __m128 x, __m128 y, __m128 z)
+{
+	__m128 c1 = _mm_set1_ps(s_c1);
+	__m128 c2 = _mm_set1_ps(s_c2);
+	__m128 negC1 = _mm_set1_ps(-s_c1);
+	__m128 negC2 = _mm_set1_ps(-s_c2);
+
+	dst[0] = _mm_set1_ps(s_c0);
+	dst[1] = _mm_mul_ps(negC1,y);
+	dst[2] = _mm_mul_ps(c1,z);
+	dst[3] = _mm_mul_ps(negC1,x);
+	dst[4] = _mm_mul_ps(c2,_mm_mul_ps(x,y));
+	dst[5] = _mm_mul_ps(negC2,_mm_mul_ps(y,z));
+	dst[6] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(s_c3),_mm_mul_ps(z,z)),_mm_set1_ps(s_c4));
+	dst[7] = _mm_mul_ps(negC2,_mm_mul_ps(x,z));
+	dst[8] = _mm_mul_ps(_mm_set1_ps(s_c5),_mm_sub_ps(_mm_mul_ps(x,x),_mm_mul_ps(y,y)));
+}
 
-	ProjectBand1(data_trans[0],r0);
-	ProjectBand1(data_trans[1],r1);
-	ProjectBand1(data_trans[2],r2);
+static inline float HorizontalSum(__m128 val)
+{
+	float lanes[4];
+	_mm_storeu_ps(lanes,val);
+	return (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+}
 
-	// make columns
-	std::vector < float > matData(9);
-	for (int r = 0; r < 3; r++)
+static inline void ClearColorSums(__m128 sums[9][3])
+{
+	for (int j = 0; j < 9; j++)
 	{
 		for (int c = 0; c < 3; c++)
+			sums[j][c] = _mm_setzero_ps();
+	}
+}
+
+static inline void AccumulateColorSimd4(__m128 sums[9][3], const __m128 basis[9], __m128 r, __m128 g, __m128 b)
+{
+	for (int j = 0; j < 9; j++)
+	{
+		sums[j][0] = _mm_add_ps(sums[j][0],_mm_mul_ps(basis[j],r));
+		sums[j][1] = _mm_add_ps(sums[j][1],_mm_mul_ps(basis[j],g));
+		sums[j][2] = _mm_add_ps(sums[j][2],_mm_mul_ps(basis[j],b));
+	}
+}
+
+static inline void StoreColorSums(ColorSh3 & dst, __m128 sums[9][3])
+{
+	for (int j = 0; j < 9; j++)
+		dst.m_coefs[j] = Vec3(HorizontalSum(sums[j][0]),HorizontalSum(sums[j][1]),HorizontalSum(sums[j][2]));
+}
+
+// normals per thread block in the projection functions, a multiple of 4
+static const int s_projectBlockSize = 4096;
+
+void ShUtil::ProjectNormalsSoa(float * const dstCoefs[9], const float * srcX, const float * srcY, const float * srcZ, int numNormals, int numThreads)
+{
+	ParallelUtil::ParallelForBlocks(numNormals,s_projectBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		int i = begin;
+		for (; i + 4 <= end; i += 4)
 		{
-			matData[r*3+c] = data_trans[c][r];
+			__m128 basis[9];
+			ProjectNormalSimd4(basis,_mm_loadu_ps(srcX+i),_mm_loadu_ps(srcY+i),_mm_loadu_ps(srcZ+i));
+			for (int j = 0; j < 9; j++)
+				_mm_storeu_ps(dstCoefs[j]+i,basis[j]);
 		}
-	}
 
-	std::vector < float > matInv(9);
+		for (; i < end; i++)
+		{
+			GreySh3 sh = ProjectNormal(Vec3(srcX[i],srcY[i],srcZ[i]));
+			for (int j = 0; j < 9; j++)
+				dstCoefs[j][i] = sh.m_coefs[j];
+		}
+	});
+}
 
-	// LU factorization not included in this library, but you would put it here
-	//LinearAlgebraUtil::CalcInverseLUDirect(matInv,matData,3);
+void ShUtil::AccumulateProjectedNormals(GreySh3 & accum, const float * srcX, const float * srcY, const float * srcZ, const float * weights, int numNormals, int numThreads)
+{
+	int numBlocks = ParallelUtil::CalcNumBlocks(numNormals,s_projectBlockSize);
+	std::vector < GreySh3 > blockSums(numBlocks);
 
-	float rot0[3];
-	float rot1[3];
-	float rot2[3];
-	MulMatVec3(rot0,mat,r0);
-	MulMatVec3(rot1,mat,r1);
-	MulMatVec3(rot2,mat,r2);
+	ParallelUtil::ParallelForBlocks(numNormals,s_projectBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		__m128 sums[9];
+		for (int j = 0; j < 9; j++)
+			sums[j] = _mm_setzero_ps();
 
-	float proj_trans[3][3];
-	ProjectBand1(proj_trans[0],rot0);
-	ProjectBand1(proj_trans[1],rot1);
-	ProjectBand1(proj_trans[2],rot2);
+		int i = begin;
+		for (; i + 4 <= end; i += 4)
+		{
+			__m128 basis[9];
+			ProjectNormalSimd4(basis,_mm_loadu_ps(srcX+i),_mm_loadu_ps(srcY+i),_mm_loadu_ps(srcZ+i));
+			__m128 w = (weights != NULL) ? _mm_loadu_ps(weights+i) : _mm_set1_ps(1.0f);
+			for (int j = 0; j < 9; j++)
+				sums[j] = _mm_add_ps(sums[j],_mm_mul_ps(basis[j],w));
+		}
 
+		GreySh3 & blockSum = blockSums[begin / s_projectBlockSize];
+		for (int j = 0; j < 9; j++)
+			blockSum.m_coefs[j] = HorizontalSum(sums[j]);
 
-	std::vector < float > projData(9);
-	for (int r = 0; r < 3; r++)
+		for (; i < end; i++)
+		{
+			GreySh3 sh = ProjectNormal(Vec3(srcX[i],srcY[i],srcZ[i]));
+			float w = (weights != NULL) ? weights[i] : 1.0f;
+			for (int j = 0; j < 9; j++)
+				blockSum.m_coefs[j] += sh.m_coefs[j] * w;
+		}
+	});
+
+	for (int blockIter = 0; blockIter < numBlocks; blockIter++)
 	{
-		for (int c = 0; c < 3; c++)
+		for (int j = 0; j < 9; j++)
+			accum.m_coefs[j] += blockSums[blockIter].m_coefs[j];
+	}
+}
+
+void ShUtil::AccumulateProjectedNormals(ColorSh3 & accum, const float * srcX, const float * srcY, const float * srcZ, const float * colorR, const float * colorG, const float * colorB, int numNormals, int numThreads)
+{
+	int numBlocks = ParallelUtil::CalcNumBlocks(numNormals,s_projectBlockSize);
+	std::vector < ColorSh3 > blockSums(numBlocks);
+
+	ParallelUtil::ParallelForBlocks(numNormals,s_projectBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		__m128 sums[9][3];
+		ClearColorSums(sums);
+
+		int i = begin;
+		for (; i + 4 <= end; i += 4)
 		{
-			projData[r*3+c] = proj_trans[c][r];
+			__m128 basis[9];
+			ProjectNormalSimd4(basis,_mm_loadu_ps(srcX+i),_mm_loadu_ps(srcY+i),_mm_loadu_ps(srcZ+i));
+			AccumulateColorSimd4(sums,basis,_mm_loadu_ps(colorR+i),_mm_loadu_ps(colorG+i),_mm_loadu_ps(colorB+i));
 		}
+
+		ColorSh3 & blockSum = blockSums[begin / s_projectBlockSize];
+		StoreColorSums(blockSum,sums);
+
+		for (; i < end; i++)
+		{
+			GreySh3 sh = ProjectNormal(Vec3(srcX[i],srcY[i],srcZ[i]));
+			Vec3 color(colorR[i],colorG[i],colorB[i]);
+			for (int j = 0; j < 9; j++)
+				blockSum.m_coefs[j] += color * sh.m_coefs[j];
+		}
+	});
+
+	for (int blockIter = 0; blockIter < numBlocks; blockIter++)
+	{
+		for (int j = 0; j < 9; j++)
+			accum.m_coefs[j] += blockSums[blockIter].m_coefs[j];
+	}
+}
+
+// The polynomial terms of one channel, in the ColorSh3Simd order. bandScale scales the coefs of each band.
+static void CalcPolynomialTerms(float dst[ColorSh3Simd::kTerm_Num], const ColorSh3 & src, int channel, const float bandScale[3])
+{
+	float coefs[9];
+	for (int j = 0; j < 9; j++)
+	{
+		int band = (j == 0) ? 0 : (j < 4 ? 1 : 2);
+		coefs[j] = src.m_coefs[j].m_data[channel] * bandScale[band];
 	}
 
-	float tempVec[3];
-	MulMatVec3Flat(tempVec,&matInv[0],src);
-	MulMatVec3Flat(dst,&projData[0],tempVec);
+	dst[ColorSh3Simd::kTerm_Const] = s_c0*coefs[0] + s_c4*coefs[6];
+	dst[ColorSh3Simd::kTerm_X] = -s_c1*coefs[3];
+	dst[ColorSh3Simd::kTerm_Y] = -s_c1*coefs[1];
+	dst[ColorSh3Simd::kTerm_Z] = s_c1*coefs[2];
+	dst[ColorSh3Simd::kTerm_XY] = s_c2*coefs[4];
+	dst[ColorSh3Simd::kTerm_YZ] = -s_c2*coefs[5];
+	dst[ColorSh3Simd::kTerm_XZ] = -s_c2*coefs[7];
+	dst[ColorSh3Simd::kTerm_ZZ] = s_c3*coefs[6];
+	dst[ColorSh3Simd::kTerm_XXMinusYY] = s_c5*coefs[8];
 }
 
-static void MulMatVec5(float dst[5], const float lhs[25], const float rhs[5])
+static const float s_unitBandScale[3] = { 1.0f, 1.0f, 1.0f };
+
+// clamped cosine lobe per band: pi, 2pi/3, pi/4
+static const float s_cosineBandScale[3] = { 3.14159265f, 2.09439510f, 0.78539816f };
+
+void ShUtil::BuildColorSh3Simd(ColorSh3Simd & dst, const ColorSh3 & src)
 {
-	for (int r = 0; r < 5; r++)
+	for (int c = 0; c < 3; c++)
+	{
+		float terms[ColorSh3Simd::kTerm_Num];
+		CalcPolynomialTerms(terms,src,c,s_unitBandScale);
+
+		for (int t = 0; t < ColorSh3Simd::kTerm_Num; t++)
+		{
+			for (int k = 0; k < 4; k++)
+				dst.m_terms[t][c][k] = terms[t];
+		}
+	}
+}
+
+void ShUtil::BuildIrradianceMatrices(ShIrradianceMatrices & dst, const ColorSh3 & src, bool convolveCosine)
+{
+	for (int c = 0; c < 3; c++)
 	{
-		float sum = 0.0f;
-		for (int c = 0; c < 5; c++)
-			sum += lhs[r*5+c]*rhs[c];
-		dst[r] = sum;
+		float terms[ColorSh3Simd::kTerm_Num];
+		CalcPolynomialTerms(terms,src,c,convolveCosine ? s_cosineBandScale : s_unitBandScale);
+
+		// the cross terms are split across both halves of the symmetric matrix
+		Mat44 & mat = dst.m_channels[c];
+		mat.InitZero();
+		mat.At(0,0) = terms[ColorSh3Simd::kTerm_XXMinusYY];
+		mat.At(1,1) = -terms[ColorSh3Simd::kTerm_XXMinusYY];
+		mat.At(2,2) = terms[ColorSh3Simd::kTerm_ZZ];
+		mat.At(3,3) = terms[ColorSh3Simd::kTerm_Const];
+		mat.At(0,1) = mat.At(1,0) = 0.5f*terms[ColorSh3Simd::kTerm_XY];
+		mat.At(1,2) = mat.At(2,1) = 0.5f*terms[ColorSh3Simd::kTerm_YZ];
+		mat.At(0,2) = mat.At(2,0) = 0.5f*terms[ColorSh3Simd::kTerm_XZ];
+		mat.At(0,3) = mat.At(3,0) = 0.5f*terms[ColorSh3Simd::kTerm_X];
+		mat.At(1,3) = mat.At(3,1) = 0.5f*terms[ColorSh3Simd::kTerm_Y];
+		mat.At(2,3) = mat.At(3,2) = 0.5f*terms[ColorSh3Simd::kTerm_Z];
 	}
 }
 
-static void Rotate3rdOrderScalar(float & d0, float & d1, float & d2, float & d3, float & d4, float & d5, float & d6, float & d7, float & d8,
-								 float s0, float s1, float s2, float s3, float s4, float s5, float s6, float s7, float s8,
-							  float m00, float m01, float m02,
-							  float m10, float m11, float m12,
-							  float m20, float m21, float m22)
+Vec3 ShUtil::EvalIrradianceMatrices(const ShIrradianceMatrices & src, Vec3 N)
 {
-	// fic rotations!
-	ASSERT_ALWAYS(0);
+	Vec4 n(N.x,N.y,N.z,1.0f);
 
-	// band 0
+	Vec3 ret;
+	for (int c = 0; c < 3; c++)
+		ret.m_data[c] = Vec4::Dot(n,Mat44::MulMatVec(src.m_channels[c],n));
+	return ret;
+}
+
+static inline void EvalIrradianceSimd4(__m128 dst[3], __m128 x, __m128 y, __m128 z, const ColorSh3Simd & sh)
+{
+	__m128 poly[ColorSh3Simd::kTerm_Num];
+	poly[ColorSh3Simd::kTerm_X] = x;
+	poly[ColorSh3Simd::kTerm_Y] = y;
+	poly[ColorSh3Simd::kTerm_Z] = z;
+	poly[ColorSh3Simd::kTerm_XY] = _mm_mul_ps(x,y);
+	poly[ColorSh3Simd::kTerm_YZ] = _mm_mul_ps(y,z);
+	poly[ColorSh3Simd::kTerm_XZ] = _mm_mul_ps(x,z);
+	poly[ColorSh3Simd::kTerm_ZZ] = _mm_mul_ps(z,z);
+	poly[ColorSh3Simd::kTerm_XXMinusYY] = _mm_sub_ps(_mm_mul_ps(x,x),_mm_mul_ps(y,y));
+
+	for (int c = 0; c < 3; c++)
 	{
-		d0 = s0;
+		__m128 sum = _mm_loadu_ps(sh.m_terms[ColorSh3Simd::kTerm_Const][c]);
+		for (int t = ColorSh3Simd::kTerm_X; t < ColorSh3Simd::kTerm_Num; t++)
+			sum = _mm_add_ps(sum,_mm_mul_ps(poly[t],_mm_loadu_ps(sh.m_terms[t][c])));
+		dst[c] = sum;
 	}
+}
 
-	// band 1
+// octahedral decode of 4 normals, normalized
+static inline void DecodeNormalOctSimd4(__m128 & dstX, __m128 & dstY, __m128 & dstZ, __m128i packed)
+{
+	__m128i mask = _mm_set1_epi32(0xffff);
+	__m128 scale = _mm_set1_ps(2.0f/65535.0f);
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 x = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(packed,mask)),scale),one);
+	__m128 y = _mm_sub_ps(_mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(packed,16)),scale),one);
+
+	__m128 signMask = _mm_set1_ps(-0.0f);
+	__m128 absX = _mm_andnot_ps(signMask,x);
+	__m128 absY = _mm_andnot_ps(signMask,y);
+	__m128 z = _mm_sub_ps(_mm_sub_ps(one,absX),absY);
+
+	// lower hemisphere is folded over the diagonals
+	__m128 lower = _mm_cmplt_ps(z,_mm_setzero_ps());
+	__m128 foldX = _mm_or_ps(_mm_sub_ps(one,absY),_mm_and_ps(signMask,x));
+	__m128 foldY = _mm_or_ps(_mm_sub_ps(one,absX),_mm_and_ps(signMask,y));
+	x = SimdSelect(lower,foldX,x);
+	y = SimdSelect(lower,foldY,y);
+
+	__m128 len = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x,x),_mm_mul_ps(y,y)),_mm_mul_ps(z,z)));
+	__m128 invLen = _mm_div_ps(one,len);
+	dstX = _mm_mul_ps(x,invLen);
+	dstY = _mm_mul_ps(y,invLen);
+	dstZ = _mm_mul_ps(z,invLen);
+}
+
+static inline float OctWrap(float a, float b)
+{
+	return (1.0f - fabsf(b)) * (a >= 0.0f ? 1.0f : -1.0f);
+}
+
+unsigned int ShUtil::EncodeNormalOct(Vec3 N)
+{
+	float invSum = 1.0f / (fabsf(N.x) + fabsf(N.y) + fabsf(N.z));
+	float x = N.x * invSum;
+	float y = N.y * invSum;
+	if (N.z < 0.0f)
 	{
-		// 9 mul
-		d1 = m10*s3 + m11*s1 + m12*s2;
-		d2 = m20*s3 + m21*s1 + m22*s2;
-		d3 = m00*s3 + m01*s1 + m02*s2;
+		float wrapX = OctWrap(x,y);
+		float wrapY = OctWrap(y,x);
+		x = wrapX;
+		y = wrapY;
 	}
 
-	// band 2
+	unsigned int u = (unsigned int)(Saturate(x*0.5f + 0.5f) * 65535.0f + 0.5f);
+	unsigned int v = (unsigned int)(Saturate(y*0.5f + 0.5f) * 65535.0f + 0.5f);
+	return u | (v << 16);
+}
+
+Vec3 ShUtil::DecodeNormalOct(unsigned int packed)
+{
+	float x = float(packed & 0xffff) * (2.0f/65535.0f) - 1.0f;
+	float y = float(packed >> 16) * (2.0f/65535.0f) - 1.0f;
+	float z = 1.0f - fabsf(x) - fabsf(y);
+	if (z < 0.0f)
 	{
-		static float s_other = 1.73205113f;
+		float wrapX = OctWrap(x,y);
+		float wrapY = OctWrap(y,x);
+		x = wrapX;
+		y = wrapY;
+	}
 
-		static float c3_div_c2 = 0.866025329f;
-		static float c5_div_c2 = .5f;
+	Vec3 ret(x,y,z);
+	ret.NormalizeMe();
+	return ret;
+}
 
-		static float dst3_rhs = -0.3333333333f;
-		static float dst3_rhs_m2 = -.666666666f;
-
-		// 1 mad, 5 add/subtract
-		float x0 = (s5 - s7 + s8 + s8);
-		float x1 = (s_other*s6 + s4 - s7 + s8);
-		float x2 = s4;
-		float x3 = s7;
-		float x4 = s5;
-
-		// 9 add
-		float r2_0 = m00+m01;
-		float r2_1 = m10+m11;
-		float r2_2 = m20+m21;
-
-		float r3_0 = m00+m02;
-		float r3_1 = m10+m12;
-		float r3_2 = m20+m22;
-
-		float r4_0 = m01+m02;
-		float r4_1 = m11+m12;
-		float r4_2 = m21+m22;
-
-		// 55 mul/mad
-		d4 =  x0 * m00 * m10;
-		d5 =  x0 * m10 * m20;
-		d6 =  x0 * (m20 * m20 + dst3_rhs);
-		d7 =  x0 * m00 * m20;
-		d8 =  x0 * (m00 * m00 - m10 * m10);
-
-		d4 += x1 * m02 * m12;
-		d5 += x1 * m12 * m22;
-		d6 += x1 * (m22 * m22 + dst3_rhs);
-		d7 += x1 * m02 * m22;
-		d8 += x1 * (m02 * m02 - m12 * m12);
-
-		d4 += x2 * r2_0 * r2_1;
-		d5 += x2 * r2_1 * r2_2;
-		d6 += x2 * (r2_2 * r2_2 + dst3_rhs_m2);
-		d7 += x2 * r2_0 * r2_2;
-		d8 += x2 * (r2_0 * r2_0 - r2_1 * r2_1);
-
-		d4 += x3 * r3_0 * r3_1;
-		d5 += x3 * r3_1 * r3_2;
-		d6 += x3 * (r3_2 * r3_2 + dst3_rhs_m2);
-		d7 += x3 * r3_0 * r3_2;
-		d8 += x3 * (r3_0 * r3_0 - r3_1 * r3_1);
-
-		d4 += x4 * r4_0 * r4_1;
-		d5 += x4 * r4_1 * r4_2;
-		d6 += x4 * (r4_2 * r4_2 + dst3_rhs_m2);
-		d7 += x4 * r4_0 * r4_2;
-		d8 += x4 * (r4_0 * r4_0 - r4_1 * r4_1);
-
-		// two mul
-		d6 *= c3_div_c2;
-		d8 *= c5_div_c2;
-	}
-
-}
-
-static void RotateBand2Scalar(float dst[5],
-							  const float x[5],
-							  float m00, float m01, float m02,
-							  float m10, float m11, float m12,
-							  float m20, float m21, float m22)
-{
-	// Sparse matrix multiply
-	double sh0 =  x[3] + x[4] + x[4] - x[1];
-	double sh1 =  x[0] + s_rc2*x[2] +  x[3] + x[4];
-	double sh2 =  x[0];
-	double sh3 = -x[3];
-	double sh4 = -x[1];
-
-	// Rotations.  R0 and R1 just use the raw matrix columns
-	double r2x = m00 + m01;
-	double r2y = m10 + m11;
-	double r2z = m20 + m21;
-
-	double r3x = m00 + m02;
-	double r3y = m10 + m12;
-	double r3z = m20 + m22;
-
-	double r4x = m01 + m02;
-	double r4y = m11 + m12;
-	double r4z = m21 + m22;
-
-	// dense matrix multiplication one column at a time
-	
-	// column 0
-	double sh0_x = sh0 * m00;
-	double sh0_y = sh0 * m10;
-	double d0 = sh0_x * m10;
-	double d1 = sh0_y * m20;
-	double d2 = sh0 * (m20 * m20 + s_c4_div_c3);
-	double d3 = sh0_x * m20;
-	double d4 = sh0_x * m00 - sh0_y * m10;
-	
-	// column 1
-	double sh1_x = sh1 * m02;
-	double sh1_y = sh1 * m12;
-	d0 += sh1_x * m12;
-	d1 += sh1_y * m22;
-	d2 += sh1 * (m22 * m22 + s_c4_div_c3);
-	d3 += sh1_x * m22;
-	d4 += sh1_x * m02 - sh1_y * m12;
-	
-	// column 2
-	double sh2_x = sh2 * r2x;
-	double sh2_y = sh2 * r2y;
-	d0 += sh2_x * r2y;
-	d1 += sh2_y * r2z;
-	d2 += sh2 * (r2z * r2z + s_c4_div_c3_x2);
-	d3 += sh2_x * r2z;
-	d4 += sh2_x * r2x - sh2_y * r2y;
-
-	// column 3
-	double sh3_x = sh3 * r3x;
-	double sh3_y = sh3 * r3y;
-	d0 += sh3_x * r3y;
-	d1 += sh3_y * r3z;
-	d2 += sh3 * (r3z * r3z + s_c4_div_c3_x2);
-	d3 += sh3_x * r3z;
-	d4 += sh3_x * r3x - sh3_y * r3y;
-
-	// column 4
-	double sh4_x = sh4 * r4x;
-	double sh4_y = sh4 * r4y;
-	d0 += sh4_x * r4y;
-	d1 += sh4_y * r4z;
-	d2 += sh4 * (r4z * r4z + s_c4_div_c3_x2);
-	d3 += sh4_x * r4z;
-	d4 += sh4_x * r4x - sh4_y * r4y;
-
-	// extra multipliers
-	dst[0] = d0;
-	dst[1] = -d1;
-	dst[2] = d2 * s_scale_dst2;
-	dst[3] = -d3;
-	dst[4] = d4 * s_scale_dst4;
-}
-
-static void RotateBand2Opt(float dst[5], const float src[5], const float mat[3][3])
-{
-	RotateBand2Scalar(dst,
-					  src,
-					  mat[0][0], mat[0][1], mat[0][2],
-					  mat[1][0], mat[1][1], mat[1][2],
-					  mat[2][0], mat[2][1], mat[2][2]);
-}
-
-static void RotateBand2(float dst[5], const float src[5], const float mat[3][3])
-{
-	float r0[3] = {1,0,0};
-	float r1[3] = {0,0,1};
-	float r2[3] = {s_inv_sqrt_2,s_inv_sqrt_2,0};
-	float r3[3] = {s_inv_sqrt_2,0,s_inv_sqrt_2};
-	float r4[3] = {0,s_inv_sqrt_2,s_inv_sqrt_2};
-
-	float data_trans[5][5];
-
-	ProjectBand2(data_trans[0],r0);
-	ProjectBand2(data_trans[1],r1);
-	ProjectBand2(data_trans[2],r2);
-	ProjectBand2(data_trans[3],r3);
-	ProjectBand2(data_trans[4],r4);
-
-	// make columns
-	std::vector < float > matData(25);
-	for (int r = 0; r < 5; r++)
+// pixels per thread block in the irradiance functions
+static const int s_irradianceBlockSize = 4096;
+
+// Padding the tail to 4 wide keeps the scalar and vector results identical.
+template <class LoadFunc>
+static void EvalIrradianceBlocks(float * dstR, float * dstG, float * dstB, int numNormals, const ColorSh3Simd & sh, int numThreads, const LoadFunc & loadFunc)
+{
+	ParallelUtil::ParallelForBlocks(numNormals,s_irradianceBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
 	{
-		for (int c = 0; c < 5; c++)
+		for (int i = begin; i < end; i += 4)
 		{
-			matData[r*5+c] = data_trans[c][r];
+			int num = MinInt(4,end - i);
+
+			__m128 x, y, z;
+			loadFunc(x,y,z,i,num);
+
+			__m128 rgb[3];
+			EvalIrradianceSimd4(rgb,x,y,z,sh);
+
+			if (num == 4)
+			{
+				_mm_storeu_ps(dstR+i,rgb[0]);
+				_mm_storeu_ps(dstG+i,rgb[1]);
+				_mm_storeu_ps(dstB+i,rgb[2]);
+			}
+			else
+			{
+				float lanes[3][4];
+				for (int c = 0; c < 3; c++)
+					_mm_storeu_ps(lanes[c],rgb[c]);
+				for (int k = 0; k < num; k++)
+				{
+					dstR[i+k] = lanes[0][k];
+					dstG[i+k] = lanes[1][k];
+					dstB[i+k] = lanes[2][k];
+				}
+			}
 		}
-	}
+	});
+}
 
-	std::vector < float > matInv(25);
+static inline __m128 LoadPartial(const float * src, int num)
+{
+	if (num == 4)
+		return _mm_loadu_ps(src);
 
-	// LU factorization not included in this library, but you would put it here
-	//LinearAlgebraUtil::CalcInverseLUDirect(matInv,matData,5);
+	float lanes[4] = { 0, 0, 0, 0 };
+	for (int k = 0; k < num; k++)
+		lanes[k] = src[k];
+	return _mm_loadu_ps(lanes);
+}
 
+void ShUtil::EvalIrradianceSoa(float * dstR, float * dstG, float * dstB, const float * srcX, const float * srcY, const float * srcZ, int numNormals, const ColorSh3Simd & sh, int numThreads)
+{
+	PROFILE_ZONE("ShUtil::EvalIrradianceSoa");
 
-	float rot0[3];
-	float rot1[3];
-	float rot2[3];
-	float rot3[3];
-	float rot4[3];
-	MulMatVec3(rot0,mat,r0);
-	MulMatVec3(rot1,mat,r1);
-	MulMatVec3(rot2,mat,r2);
-	MulMatVec3(rot3,mat,r3);
-	MulMatVec3(rot4,mat,r4);
+	EvalIrradianceBlocks(dstR,dstG,dstB,numNormals,sh,numThreads,[&](__m128 & x, __m128 & y, __m128 & z, int i, int num)
+	{
+		x = LoadPartial(srcX+i,num);
+		y = LoadPartial(srcY+i,num);
+		z = LoadPartial(srcZ+i,num);
+	});
+}
 
-	float proj_trans[5][5];
-	ProjectBand2(proj_trans[0],rot0);
-	ProjectBand2(proj_trans[1],rot1);
-	ProjectBand2(proj_trans[2],rot2);
-	ProjectBand2(proj_trans[3],rot3);
-	ProjectBand2(proj_trans[4],rot4);
+void ShUtil::EvalIrradianceOct(float * dstR, float * dstG, float * dstB, const unsigned int * srcOct, int numNormals, const ColorSh3Simd & sh, int numThreads)
+{
+	PROFILE_ZONE("ShUtil::EvalIrradianceOct");
 
+	EvalIrradianceBlocks(dstR,dstG,dstB,numNormals,sh,numThreads,[&](__m128 & x, __m128 & y, __m128 & z, int i, int num)
+	{
+		__m128i packed;
+		if (num == 4)
+			packed = _mm_loadu_si128((const __m128i *)(srcOct+i));
+		else
+		{
+			// 0x7fff7fff decodes to a valid normal
+			unsigned int lanes[4] = { 0x7fff7fff, 0x7fff7fff, 0x7fff7fff, 0x7fff7fff };
+			for (int k = 0; k < num; k++)
+				lanes[k] = srcOct[i+k];
+			packed = _mm_loadu_si128((const __m128i *)lanes);
+		}
+		DecodeNormalOctSimd4(x,y,z,packed);
+	});
+}
 
-	std::vector < float > projData(25);
-	for (int r = 0; r < 5; r++)
+// converts one row to float planes, with the sample type switch outside the loops
+static void LoadRowRgb(float * dstR, float * dstG, float * dstB, const ImageView & view, int y)
+{
+	float * dst[3] = { dstR, dstG, dstB };
+	for (int c = 0; c < 3; c++)
 	{
-		for (int c = 0; c < 5; c++)
+		const unsigned char * src = view.GetSamplePtr(0,y,c);
+		if (view.m_sampleType == ImageView::kSampleType_U8)
+		{
+			for (int x = 0; x < view.m_width; x++)
+				dst[c][x] = float(src[x*view.m_pixelStride]) * (1.0f/255.0f);
+		}
+		else if (view.m_sampleType == ImageView::kSampleType_U16)
 		{
-			projData[r*5+c] = proj_trans[c][r];
+			for (int x = 0; x < view.m_width; x++)
+				dst[c][x] = float(*(const unsigned short *)(src + x*view.m_pixelStride)) * (1.0f/65535.0f);
+		}
+		else
+		{
+			for (int x = 0; x < view.m_width; x++)
+				dst[c][x] = *(const float *)(src + x*view.m_pixelStride);
 		}
 	}
+}
+
+// One row of texels with their directions (not normalized) and solid angles.
+struct EnvRow
+{
+	const ImageView * m_view;
+	int m_y;
+	std::vector < float > m_dirX;
+	std::vector < float > m_dirY;
+	std::vector < float > m_dirZ;
+	std::vector < float > m_weight;
+	std::vector < float > m_rgb[3];
+};
+
+// rows per reduction block
+static const int s_envBlockRows = 8;
+
+// Splits the rows into fixed blocks and sums the block results in order. buildRow(row, envRow) fills in one row.
+template <class BuildRowFunc>
+static void ProjectEnvRows(ColorSh3 & dst, int numRows, int width, int numThreads, const BuildRowFunc & buildRow)
+{
+	PROFILE_ZONE("ShUtil::ProjectEnvRows");
+
+	int numBlocks = ParallelUtil::CalcNumBlocks(numRows,s_envBlockRows);
+	std::vector < ColorSh3 > blockSums(numBlocks);
+
+	ParallelUtil::ParallelForBlocks(numRows,s_envBlockRows,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		EnvRow envRow;
+		envRow.m_dirX.resize(width+3);
+		envRow.m_dirY.resize(width+3);
+		envRow.m_dirZ.resize(width+3,1.0f); // keeps the padding lanes finite
+		envRow.m_weight.resize(width+3,0.0f); // padding lanes get a weight of 0
+		for (int c = 0; c < 3; c++)
+			envRow.m_rgb[c].resize(width+3,0.0f);
+
+		__m128 sums[9][3];
+		ClearColorSums(sums);
+
+		for (int row = begin; row < end; row++)
+		{
+			buildRow(row,envRow);
 
-	float tempVec[5];
-	MulMatVec5(tempVec,&matInv[0],src);
-	MulMatVec5(dst,&projData[0],tempVec);
+			LoadRowRgb(&envRow.m_rgb[0][0],&envRow.m_rgb[1][0],&envRow.m_rgb[2][0],*envRow.m_view,envRow.m_y);
 
+			for (int i = 0; i < width; i += 4)
+			{
+				__m128 x = _mm_loadu_ps(&envRow.m_dirX[i]);
+				__m128 y = _mm_loadu_ps(&envRow.m_dirY[i]);
+				__m128 z = _mm_loadu_ps(&envRow.m_dirZ[i]);
+				__m128 invLen = _mm_div_ps(_mm_set1_ps(1.0f),_mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(x,x),_mm_mul_ps(y,y)),_mm_mul_ps(z,z))));
+
+				__m128 basis[9];
+				ProjectNormalSimd4(basis,_mm_mul_ps(x,invLen),_mm_mul_ps(y,invLen),_mm_mul_ps(z,invLen));
+
+				__m128 w = _mm_loadu_ps(&envRow.m_weight[i]);
+				__m128 r = _mm_mul_ps(_mm_loadu_ps(&envRow.m_rgb[0][i]),w);
+				__m128 g = _mm_mul_ps(_mm_loadu_ps(&envRow.m_rgb[1][i]),w);
+				__m128 b = _mm_mul_ps(_mm_loadu_ps(&envRow.m_rgb[2][i]),w);
+				AccumulateColorSimd4(sums,basis,r,g,b);
+			}
+		}
+
+		StoreColorSums(blockSums[begin / s_envBlockRows],sums);
+	});
+
+	dst = ColorSh3();
+	for (int blockIter = 0; blockIter < numBlocks; blockIter++)
+	{
+		for (int j = 0; j < 9; j++)
+			dst.m_coefs[j] += blockSums[blockIter].m_coefs[j];
+	}
 }
 
-static void MulMatMat3(float dst[3][3], const float lhs[3][3], const float rhs[3][3])
+// integral of the solid angle over the face from the center to (u,v)
+static inline float CubeAreaElement(float u, float v)
 {
-	for (int r = 0; r < 3; r++)
+	return atan2f(u*v,sqrtf(u*u + v*v + 1.0f));
+}
+
+void ShUtil::ProjectCubemap(ColorSh3 & dst, const ImageView faces[6], int numThreads)
+{
+	int size = faces[0].m_width;
+	for (int f = 0; f < 6; f++)
+		ASSERT_ALWAYS(faces[f].m_width == size && faces[f].m_height == size);
+
+	float invSize = 1.0f / float(size);
+
+	// The texel solid angles are the same on every face, so the area element at the texel corners is computed
+	// once instead of per texel.
+	int numCorners = size + 1;
+	std::vector < float > cornerArea(numCorners*numCorners);
+	ParallelUtil::ParallelForBlocks(numCorners,s_envBlockRows,numThreads,[&](int /*threadIndex*/, int begin, int end)
 	{
-		for (int c = 0; c < 3; c++)
+		for (int y = begin; y < end; y++)
 		{
-			float sum = 0;
-			for (int i = 0; i < 3; i++)
+			float v = 2.0f*float(y)*invSize - 1.0f;
+			for (int x = 0; x < numCorners; x++)
+				cornerArea[y*numCorners + x] = CubeAreaElement(2.0f*float(x)*invSize - 1.0f,v);
+		}
+	});
+
+	ProjectEnvRows(dst,6*size,size,numThreads,[&](int row, EnvRow & envRow)
+	{
+		int face = row / size;
+		int y = row - face*size;
+		envRow.m_view = &faces[face];
+		envRow.m_y = y;
+
+		float v = (2.0f*float(y) + 1.0f)*invSize - 1.0f;
+		const float * area0 = &cornerArea[y*numCorners];
+		const float * area1 = &cornerArea[(y+1)*numCorners];
+		for (int x = 0; x < size; x++)
+		{
+			float u = (2.0f*float(x) + 1.0f)*invSize - 1.0f;
+			envRow.m_weight[x] = (area1[x+1] - area0[x+1]) - (area1[x] - area0[x]);
+
+			Vec3 dir;
+			switch (face)
 			{
-				sum += lhs[r][i] * rhs[i][c];
+			case 0: dir = Vec3(1.0f,-v,-u); break;
+			case 1: dir = Vec3(-1.0f,-v,u); break;
+			case 2: dir = Vec3(u,1.0f,v); break;
+			case 3: dir = Vec3(u,-1.0f,-v); break;
+			case 4: dir = Vec3(u,-v,1.0f); break;
+			default: dir = Vec3(-u,-v,-1.0f); break;
 			}
-			dst[r][c] = sum;
+			envRow.m_dirX[x] = dir.x;
+			envRow.m_dirY[x] = dir.y;
+			envRow.m_dirZ[x] = dir.z;
 		}
+	});
+}
+
+void ShUtil::ProjectLatLong(ColorSh3 & dst, const ImageView & src, int numThreads)
+{
+	int width = src.m_width;
+	int height = src.m_height;
+
+	const float pi = 3.14159265f;
+	std::vector < float > cosPhi(width);
+	std::vector < float > sinPhi(width);
+	for (int x = 0; x < width; x++)
+	{
+		float phi = 2.0f*pi*(float(x) + 0.5f)/float(width);
+		cosPhi[x] = cosf(phi);
+		sinPhi[x] = sinf(phi);
 	}
+
+	ProjectEnvRows(dst,height,width,numThreads,[&](int row, EnvRow & envRow)
+	{
+		envRow.m_view = &src;
+		envRow.m_y = row;
+
+		// exact solid angle of the row band, split evenly across the columns
+		float theta = pi*(float(row) + 0.5f)/float(height);
+		float theta0 = pi*float(row)/float(height);
+		float theta1 = pi*float(row+1)/float(height);
+		float weight = (cosf(theta0) - cosf(theta1)) * (2.0f*pi/float(width));
+
+		float sinTheta = sinf(theta);
+		float cosTheta = cosf(theta);
+		for (int x = 0; x < width; x++)
+		{
+			envRow.m_dirX[x] = sinTheta*cosPhi[x];
+			envRow.m_dirY[x] = cosTheta;
+			envRow.m_dirZ[x] = sinTheta*sinPhi[x];
+			envRow.m_weight[x] = weight;
+		}
+	});
 }
 
-void ShUtil::MakeRotationMatrixRadians(float dst[3][3], float thetaX, float thetaY, float thetaZ)
+void ShUtil::CompressSh(ColorSh3Fp16 & dst, const ColorSh3 & src)
 {
-	float rotX[3][3];
-	float rotY[3][3];
-	float rotZ[3][3];
+	for (int j = 0; j < 9; j++)
+	{
+		for (int c = 0; c < 3; c++)
+			dst.m_coefs[j*3 + c] = FloatToHalf(src.m_coefs[j].m_data[c]);
+	}
+	dst.m_coefs[27] = 0;
+}
 
-	float cx = cosf(thetaX);
-	float cy = cosf(thetaY);
-	float cz = cosf(thetaZ);
+ColorSh3 ShUtil::DecompressSh(const ColorSh3Fp16 & src)
+{
+	ColorSh3 ret;
+	for (int j = 0; j < 9; j++)
+	{
+		for (int c = 0; c < 3; c++)
+			ret.m_coefs[j].m_data[c] = HalfToFloat(src.m_coefs[j*3 + c]);
+	}
+	return ret;
+}
 
-	float sx = sinf(thetaX);
-	float sy = sinf(thetaY);
-	float sz = sinf(thetaZ);
+// sqrt(2l+1) for ratio i, which is coef 1 + i/3
+static float CalcNorm8RatioRange(int ratioIndex)
+{
+	return (ratioIndex < 9) ? 1.73205081f : 2.23606798f;
+}
 
-	memset(rotX,0,sizeof(rotX));
-	memset(rotY,0,sizeof(rotY));
-	memset(rotZ,0,sizeof(rotZ));
+void ShUtil::CompressSh(ColorSh3Norm8 & dst, const ColorSh3 & src)
+{
+	float band0[3];
+	for (int c = 0; c < 3; c++)
+	{
+		dst.m_band0[c] = FloatToHalf(src.m_coefs[0].m_data[c]);
+		band0[c] = HalfToFloat(dst.m_band0[c]);
+	}
+	dst.m_band0[3] = 0;
 
-	rotX[0][0] = 1.0f;
-	rotX[1][1] = cx;
-	rotX[1][2] = -sx;
-	rotX[2][1] = sx;
-	rotX[2][2] = cx;
+	// relative to the rounded band 0, so the decode error doesn't stack up
+	for (int i = 0; i < 24; i++)
+	{
+		int c = i % 3;
+		float range = CalcNorm8RatioRange(i) * band0[c];
+		float ratio = (fabsf(range) > 1e-20f) ? src.m_coefs[1 + i/3].m_data[c] / range : 0.0f;
+		ratio = MaxFloat(-1.0f,MinFloat(ratio,1.0f));
+		dst.m_ratios[i] = (signed char)floorf(ratio*127.0f + 0.5f);
+	}
+}
 
-	rotY[0][0] = cy;
-	rotY[0][2] = sy;
-	rotY[1][1] = 1.0f;
-	rotY[2][0] = -sy;
-	rotY[2][2] = cy;
+ColorSh3 ShUtil::DecompressSh(const ColorSh3Norm8 & src)
+{
+	ColorSh3 ret;
+	for (int c = 0; c < 3; c++)
+		ret.m_coefs[0].m_data[c] = HalfToFloat(src.m_band0[c]);
 
-	rotZ[0][0] = cz;
-	rotZ[0][1] = -sz;
-	rotZ[1][0] = sz;
-	rotZ[1][1] = cz;
-	rotZ[2][2] = 1.0f;
+	for (int i = 0; i < 24; i++)
+	{
+		int c = i % 3;
+		ret.m_coefs[1 + i/3].m_data[c] = float(src.m_ratios[i]) * (CalcNorm8RatioRange(i) / 127.0f) * ret.m_coefs[0].m_data[c];
+	}
+	return ret;
+}
 
-	float rotZY[3][3];
-	MulMatMat3(rotZY,rotZ,rotY);
-	MulMatMat3(dst,rotZY,rotX);
+static ColorSh3 ColorShFromCoefs(const float coefs[27])
+{
+	ColorSh3 ret;
+	for (int j = 0; j < 9; j++)
+		ret.m_coefs[j] = Vec3(coefs[j*3+0],coefs[j*3+1],coefs[j*3+2]);
+	return ret;
+}
+
+ColorSh3 ShUtil::BlendCompressedSh(const ColorSh3Fp16 * const srcs[], const float weights[], int numSrcs)
+{
+	__m128 sums[7];
+	for (int q = 0; q < 7; q++)
+		sums[q] = _mm_setzero_ps();
+
+	for (int i = 0; i < numSrcs; i++)
+	{
+		__m128 w = _mm_set1_ps(weights[i]);
+		for (int q = 0; q < 7; q++)
+			sums[q] = _mm_add_ps(sums[q],_mm_mul_ps(SimdHalfToFloat4(srcs[i]->m_coefs + q*4),w));
+	}
 
+	float coefs[28];
+	for (int q = 0; q < 7; q++)
+		_mm_storeu_ps(coefs + q*4,sums[q]);
+	return ColorShFromCoefs(coefs);
 }
 
-static const float s_degToRad = 3.14159f/180.0f;
+// sign extends 4 bytes to 4 floats
+static inline __m128 SignedBytesToFloat4(__m128i bytes)
+{
+	__m128i words = _mm_unpacklo_epi8(bytes,bytes);
+	__m128i dwords = _mm_unpacklo_epi16(words,words);
+	return _mm_cvtepi32_ps(_mm_srai_epi32(dwords,24));
+}
 
-void ShUtil::MakeRotationMatrixDegrees(float dst[3][3], float thetaX, float thetaY, float thetaZ)
+ColorSh3 ShUtil::BlendCompressedSh(const ColorSh3Norm8 * const srcs[], const float weights[], int numSrcs)
 {
-	float thetaRadX = s_degToRad * thetaX;
-	float thetaRadY = s_degToRad * thetaY;
-	float thetaRadZ = s_degToRad * thetaZ;
+	// the ratio range divided by 127, for each group of 4 ratios
+	__m128 ratioScale[6];
+	for (int q = 0; q < 6; q++)
+	{
+		ratioScale[q] = _mm_setr_ps(CalcNorm8RatioRange(q*4+0),CalcNorm8RatioRange(q*4+1),CalcNorm8RatioRange(q*4+2),CalcNorm8RatioRange(q*4+3));
+		ratioScale[q] = _mm_mul_ps(ratioScale[q],_mm_set1_ps(1.0f/127.0f));
+	}
 
-	MakeRotationMatrixRadians(dst,thetaRadX,thetaRadY,thetaRadZ);
+	__m128 band0Sum = _mm_setzero_ps();
+	__m128 ratioSums[6];
+	for (int q = 0; q < 6; q++)
+		ratioSums[q] = _mm_setzero_ps();
+
+	for (int i = 0; i < numSrcs; i++)
+	{
+		const ColorSh3Norm8 & src = *srcs[i];
+		__m128 w = _mm_set1_ps(weights[i]);
+
+		// band0 is rgb_, and the ratios cycle through the channels as rgbr gbrg brgb
+		__m128 band0 = SimdHalfToFloat4(src.m_band0);
+		__m128 band0Rgbr = _mm_shuffle_ps(band0,band0,_MM_SHUFFLE(0,2,1,0));
+		__m128 band0Gbrg = _mm_shuffle_ps(band0,band0,_MM_SHUFFLE(1,0,2,1));
+		__m128 band0Brgb = _mm_shuffle_ps(band0,band0,_MM_SHUFFLE(2,1,0,2));
+		__m128 band0Cycle[3] = { band0Rgbr, band0Gbrg, band0Brgb };
+
+		band0Sum = _mm_add_ps(band0Sum,_mm_mul_ps(band0,w));
+
+		__m128i ratiosLo = _mm_loadu_si128((const __m128i *)src.m_ratios);
+		__m128i ratiosHi = _mm_loadl_epi64((const __m128i *)(src.m_ratios + 16));
+		__m128i ratioBytes[6] = {
+			ratiosLo,
+			_mm_srli_si128(ratiosLo,4),
+			_mm_srli_si128(ratiosLo,8),
+			_mm_srli_si128(ratiosLo,12),
+			ratiosHi,
+			_mm_srli_si128(ratiosHi,4)
+		};
+
+		for (int q = 0; q < 6; q++)
+		{
+			__m128 coefs = _mm_mul_ps(_mm_mul_ps(SignedBytesToFloat4(ratioBytes[q]),ratioScale[q]),band0Cycle[q % 3]);
+			ratioSums[q] = _mm_add_ps(ratioSums[q],_mm_mul_ps(coefs,w));
+		}
+	}
+
+	float coefs[28];
+	_mm_storeu_ps(coefs,band0Sum);
+	for (int q = 0; q < 6; q++)
+		_mm_storeu_ps(coefs + 3 + q*4,ratioSums[q]);
+	return ColorShFromCoefs(coefs);
 }
 
+// One group of local lights in SoA form, the spot arrays are NULL for point lights.
+struct LocalLightArrays
+{
+	int m_num;
+	const float * m_pos[3];
+	const float * m_color[3];
+	const float * m_range;
+	const float * m_radius;
+	const float * m_spotDir[3];
+	const float * m_spotCosInner;
+	const float * m_spotCosOuter;
+};
+
+// Padding lanes have no color, and the distance clamp keeps them finite.
+static void AccumulateLocalLights(__m128 sums[9][3], Vec3 receiver, const LocalLightArrays & lights)
+{
+	__m128 zero = _mm_setzero_ps();
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 half = _mm_set1_ps(0.5f);
 
-GreySh3 ShUtil::RotateSh(const GreySh3 & lhs, const float mat[3][3])
+	for (int i = 0; i < lights.m_num; i += 4)
+	{
+		int num = MinInt(4,lights.m_num - i);
+
+		__m128 x = _mm_sub_ps(LoadPartial(lights.m_pos[0]+i,num),_mm_set1_ps(receiver.x));
+		__m128 y = _mm_sub_ps(LoadPartial(lights.m_pos[1]+i,num),_mm_set1_ps(receiver.y));
+		__m128 z = _mm_sub_ps(LoadPartial(lights.m_pos[2]+i,num),_mm_set1_ps(receiver.z));
+		__m128 distSqr = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x,x),_mm_mul_ps(y,y)),_mm_mul_ps(z,z));
+		distSqr = _mm_max_ps(distSqr,_mm_set1_ps(1e-8f));
+
+		__m128 invDist = _mm_div_ps(one,_mm_sqrt_ps(distSqr));
+		x = _mm_mul_ps(x,invDist);
+		y = _mm_mul_ps(y,invDist);
+		z = _mm_mul_ps(z,invDist);
+
+		__m128 band1Scale = one;
+		__m128 band2Scale = one;
+		__m128 falloffDistSqr = distSqr;
+		if (lights.m_radius != NULL)
+		{
+			// the light as a disk of half angle a, sin(a) = radius/d
+			__m128 radius = LoadPartial(lights.m_radius+i,num);
+			__m128 radiusSqr = _mm_mul_ps(radius,radius);
+			__m128 sinSqr = _mm_min_ps(one,_mm_div_ps(radiusSqr,distSqr));
+			__m128 cosA = _mm_sqrt_ps(_mm_sub_ps(one,sinSqr));
+			band1Scale = _mm_mul_ps(half,_mm_add_ps(one,cosA));
+			band2Scale = _mm_mul_ps(cosA,band1Scale);
+			falloffDistSqr = _mm_max_ps(distSqr,radiusSqr);
+		}
+
+		__m128 atten = _mm_div_ps(one,falloffDistSqr);
+		if (lights.m_range != NULL)
+		{
+			__m128 range = LoadPartial(lights.m_range+i,num);
+			__m128 ratioSqr = _mm_div_ps(distSqr,_mm_max_ps(_mm_mul_ps(range,range),_mm_set1_ps(1e-8f)));
+			__m128 window = _mm_max_ps(zero,_mm_sub_ps(one,_mm_mul_ps(ratioSqr,ratioSqr)));
+			atten = _mm_mul_ps(atten,_mm_mul_ps(window,window));
+		}
+
+		if (lights.m_spotDir[0] != NULL)
+		{
+			// the spot points away from the light, and (x,y,z) points toward it
+			__m128 cosAngle = _mm_mul_ps(x,LoadPartial(lights.m_spotDir[0]+i,num));
+			cosAngle = _mm_add_ps(cosAngle,_mm_mul_ps(y,LoadPartial(lights.m_spotDir[1]+i,num)));
+			cosAngle = _mm_add_ps(cosAngle,_mm_mul_ps(z,LoadPartial(lights.m_spotDir[2]+i,num)));
+			cosAngle = _mm_sub_ps(zero,cosAngle);
+
+			__m128 cosInner = LoadPartial(lights.m_spotCosInner+i,num);
+			__m128 cosOuter = LoadPartial(lights.m_spotCosOuter+i,num);
+			__m128 spot = _mm_div_ps(_mm_sub_ps(cosAngle,cosOuter),_mm_max_ps(_mm_sub_ps(cosInner,cosOuter),_mm_set1_ps(1e-6f)));
+			spot = SimdClamp(spot,0.0f,1.0f);
+			atten = _mm_mul_ps(atten,_mm_mul_ps(spot,spot));
+		}
+
+		__m128 basis[9];
+		ProjectNormalSimd4(basis,x,y,z);
+		for (int j = 1; j < 4; j++)
+			basis[j] = _mm_mul_ps(basis[j],band1Scale);
+		for (int j = 4; j < 9; j++)
+			basis[j] = _mm_mul_ps(basis[j],band2Scale);
+
+		__m128 r = _mm_mul_ps(LoadPartial(lights.m_color[0]+i,num),atten);
+		__m128 g = _mm_mul_ps(LoadPartial(lights.m_color[1]+i,num),atten);
+		__m128 b = _mm_mul_ps(LoadPartial(lights.m_color[2]+i,num),atten);
+		AccumulateColorSimd4(sums,basis,r,g,b);
+	}
+}
+
+// receivers per thread block in AccumulateLights()
+static const int s_lightBlockSize = 16;
+
+void ShUtil::AccumulateLights(ColorSh3 * dst, const Vec3 * receivers, int numReceivers, const ShLightBatch & lights, int numThreads)
 {
+	PROFILE_ZONE("ShUtil::AccumulateLights");
+
+	ColorSh3 directional;
+	AccumulateProjectedNormals(directional,lights.m_dirX,lights.m_dirY,lights.m_dirZ,lights.m_dirR,lights.m_dirG,lights.m_dirB,lights.m_numDirectional,1);
+
+	LocalLightArrays pointLights = {
+		lights.m_numPoint,
+		{ lights.m_pointX, lights.m_pointY, lights.m_pointZ },
+		{ lights.m_pointR, lights.m_pointG, lights.m_pointB },
+		lights.m_pointRange,
+		lights.m_pointRadius,
+		{ NULL, NULL, NULL },
+		NULL,
+		NULL
+	};
+
+	LocalLightArrays spotLights = {
+		lights.m_numSpot,
+		{ lights.m_spotX, lights.m_spotY, lights.m_spotZ },
+		{ lights.m_spotR, lights.m_spotG, lights.m_spotB },
+		lights.m_spotRange,
+		lights.m_spotRadius,
+		{ lights.m_spotDirX, lights.m_spotDirY, lights.m_spotDirZ },
+		lights.m_spotCosInner,
+		lights.m_spotCosOuter
+	};
+
+	ParallelUtil::ParallelForBlocks(numReceivers,s_lightBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+		{
+			__m128 sums[9][3];
+			ClearColorSums(sums);
 
-	GreySh3 ret;
+			AccumulateLocalLights(sums,receivers[i],pointLights);
+			AccumulateLocalLights(sums,receivers[i],spotLights);
+
+			ColorSh3 local;
+			StoreColorSums(local,sums);
+			for (int j = 0; j < 9; j++)
+				dst[i].m_coefs[j] += local.m_coefs[j] + directional.m_coefs[j];
+		}
+	});
+}
+
+// The non-zero entries of C_ijk with i <= j <= k, the rest follow from symmetry.
+struct TripleProductEntry
+{
+	int m_i;
+	int m_j;
+	int m_k;
+	float m_val;
+};
+
+static constexpr TripleProductEntry s_tripleProductEntries[] =
+{
+	{ 0, 0, 0, 0.282094792f },
+	{ 0, 1, 1, 0.282094792f },
+	{ 0, 2, 2, 0.282094792f },
+	{ 0, 3, 3, 0.282094792f },
+	{ 0, 4, 4, 0.282094792f },
+	{ 0, 5, 5, 0.282094792f },
+	{ 0, 6, 6, 0.282094792f },
+	{ 0, 7, 7, 0.282094792f },
+	{ 0, 8, 8, 0.282094792f },
+	{ 1, 1, 6, -0.126156626f },
+	{ 1, 1, 8, -0.218509686f },
+	{ 1, 2, 5, 0.218509686f },
+	{ 1, 3, 4, 0.218509686f },
+	{ 2, 2, 6, 0.252313252f },
+	{ 2, 3, 7, 0.218509686f },
+	{ 3, 3, 6, -0.126156626f },
+	{ 3, 3, 8, 0.218509686f },
+	{ 4, 4, 6, -0.180223752f },
+	{ 4, 5, 7, 0.156078347f },
+	{ 5, 5, 6, 0.090111876f },
+	{ 5, 5, 8, -0.156078347f },
+	{ 6, 6, 6, 0.180223752f },
+	{ 6, 7, 7, 0.090111876f },
+	{ 6, 8, 8, -0.180223752f },
+	{ 7, 7, 8, 0.156078347f },
+};
+
+static const int s_numTripleProductEntries = sizeof(s_tripleProductEntries)/sizeof(s_tripleProductEntries[0]);
+
+// Unrolled over the table, so the indices and the symmetry cases are all resolved at compile time. Each entry adds
+// every distinct permutation of (i,j,k) as (f index, g index, h index).
+template <int Index, bool Done = (Index >= s_numTripleProductEntries)>
+struct TripleProductStep
+{
+	template <class TH, class TF, class TG>
+	static inline void Apply(TH h[9], const TF f[9], const TG g[9])
+	{
+		const int i = s_tripleProductEntries[Index].m_i;
+		const int j = s_tripleProductEntries[Index].m_j;
+		const int k = s_tripleProductEntries[Index].m_k;
+		const float val = s_tripleProductEntries[Index].m_val;
+
+		if (i == j && j == k)
+			h[i] += f[i]*g[i]*val;
+		else if (i == j)
+		{
+			h[k] += f[i]*g[i]*val;
+			h[i] += (f[i]*g[k] + f[k]*g[i])*val;
+		}
+		else if (j == k)
+		{
+			h[i] += f[j]*g[j]*val;
+			h[j] += (f[i]*g[j] + f[j]*g[i])*val;
+		}
+		else
+		{
+			h[k] += (f[i]*g[j] + f[j]*g[i])*val;
+			h[j] += (f[i]*g[k] + f[k]*g[i])*val;
+			h[i] += (f[j]*g[k] + f[k]*g[j])*val;
+		}
 
+		TripleProductStep < Index+1 >::Apply(h,f,g);
+	}
+};
 
-	Rotate3rdOrderScalar(ret.m_coefs[0],ret.m_coefs[1],ret.m_coefs[2],ret.m_coefs[3],ret.m_coefs[4],ret.m_coefs[5],ret.m_coefs[6],ret.m_coefs[7],ret.m_coefs[8],
-						 lhs.m_coefs[0],lhs.m_coefs[1],lhs.m_coefs[2],lhs.m_coefs[3],lhs.m_coefs[4],lhs.m_coefs[5],lhs.m_coefs[6],lhs.m_coefs[7],lhs.m_coefs[8],
-						 mat[0][0],mat[0][1],mat[0][2],
-						 mat[1][0],mat[1][1],mat[1][2],
-						 mat[2][0],mat[2][1],mat[2][2]);
+template <int Index>
+struct TripleProductStep < Index, true >
+{
+	template <class TH, class TF, class TG>
+	static inline void Apply(TH [9], const TF [9], const TG [9])
+	{
+	}
+};
 
+GreySh3 ShUtil::MultiplySh(const GreySh3 & lhs, const GreySh3 & rhs)
+{
+	GreySh3 ret;
+	TripleProductStep < 0 >::Apply(ret.m_coefs,lhs.m_coefs,rhs.m_coefs);
+	return ret;
+}
+
+ColorSh3 ShUtil::MultiplySh(const ColorSh3 & lhs, const GreySh3 & rhs)
+{
+	ColorSh3 ret;
+	TripleProductStep < 0 >::Apply(ret.m_coefs,lhs.m_coefs,rhs.m_coefs);
+	return ret;
+}
+
+ColorSh3 ShUtil::MultiplySh(const ColorSh3 & lhs, const ColorSh3 & rhs)
+{
+	ColorSh3 ret;
+	TripleProductStep < 0 >::Apply(ret.m_coefs,lhs.m_coefs,rhs.m_coefs);
 	return ret;
 }
 
+// probes per thread block in MultiplyShBatch()
+static const int s_multiplyBlockSize = 256;
 
+void ShUtil::MultiplyShBatch(ColorSh3 * dst, const ColorSh3 * lighting, const GreySh3 * visibility, int numSh, int numThreads)
+{
+	PROFILE_ZONE("ShUtil::MultiplyShBatch");
 
+	ParallelUtil::ParallelForBlocks(numSh,s_multiplyBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		for (int i = begin; i < end; i++)
+			dst[i] = MultiplySh(lighting[i],visibility[i]);
+	});
+}
@@ -3,6 +3,8 @@
 
 #include "CoreHelpers.h"
 #include "Vec3.h"
+#include "Mat44.h"
+#include "ImageView.h"
 
 
 struct GreySh3
@@ -17,6 +19,18 @@ struct GreySh3
 };
 
 struct ColorSh3;
+struct ColorSh3Simd;
+struct ShIrradianceMatrices;
+struct ColorSh3Fp16;
+struct ColorSh3Norm8;
+struct ShLightBatch;
+
+// Band 1 and band 2 rotation matrices for one 3x3 rotation. Band 0 doesn't change.
+struct ShRotation
+{
+	float m_band1[3][3];
+	float m_band2[5][5];
+};
 
 class ShUtil
 {
@@ -24,7 +38,82 @@ public:
 	static float DotProduct(const GreySh3 & lhs, const GreySh3 & rhs);
 	static GreySh3 ProjectNormal(Vec3 N);
 
+	// Rotates the function by mat, so RotateSh(ProjectNormal(n),mat) == ProjectNormal(mat*n), with
+	// (mat*n)[r] = sum of mat[r][c]*n[c]. Works directly on the matrix, in float.
 	static GreySh3 RotateSh(const GreySh3 & lhs, const float mat[3][3]);
+	static ColorSh3 RotateSh(const ColorSh3 & lhs, const float mat[3][3]);
+
+	// Building the band matrices costs about as much as a few direct rotations, so it's for when many SH
+	// share one rotation.
+	static void BuildShRotation(ShRotation & dst, const float mat[3][3]);
+	static GreySh3 RotateSh(const GreySh3 & lhs, const ShRotation & rot);
+	static ColorSh3 RotateSh(const ColorSh3 & lhs, const ShRotation & rot);
+
+	// Many SH by one rotation, 4 channels at a time with SSE, or each SH by its own rotation. dst can be the
+	// same as src.
+	static void RotateShBatch(GreySh3 * dst, const GreySh3 * src, int numSh, const float mat[3][3], int numThreads);
+	static void RotateShBatch(ColorSh3 * dst, const ColorSh3 * src, int numSh, const float mat[3][3], int numThreads);
+	static void RotateShBatch(GreySh3 * dst, const GreySh3 * src, const float (*mats)[3][3], int numSh, int numThreads);
+	static void RotateShBatch(ColorSh3 * dst, const ColorSh3 * src, const float (*mats)[3][3], int numSh, int numThreads);
+
+	// Projects a stream of unit normals given as SoA x/y/z arrays. dstCoefs[i] gets coefficient i of every normal,
+	// so the output is SoA too.
+	static void ProjectNormalsSoa(float * const dstCoefs[9], const float * srcX, const float * srcY, const float * srcZ, int numNormals, int numThreads);
+
+	// Adds sum(weight[i] * ProjectNormal(n[i])) to accum without storing the per normal coefficients. weights
+	// can be NULL for a weight of 1. The partial sums are per fixed size block and added in block order, so the
+	// result doesn't depend on numThreads.
+	static void AccumulateProjectedNormals(GreySh3 & accum, const float * srcX, const float * srcY, const float * srcZ, const float * weights, int numNormals, int numThreads);
+	static void AccumulateProjectedNormals(ColorSh3 & accum, const float * srcX, const float * srcY, const float * srcZ, const float * colorR, const float * colorG, const float * colorB, int numNormals, int numThreads);
+
+	// Projects an environment map, weighting each texel by its solid angle. Faces are +X,-X,+Y,-Y,+Z,-Z with the
+	// D3D orientation, all square and the same size. The lat-long map has +Y at the top row and the direction for
+	// column x is (sin(theta)*cos(phi),cos(theta),sin(theta)*sin(phi)), phi = 2*pi*(x+.5)/width. Alpha is ignored.
+	// Rows are reduced in fixed size blocks in order, so the result doesn't depend on numThreads.
+	static void ProjectCubemap(ColorSh3 & dst, const ImageView faces[6], int numThreads);
+	static void ProjectLatLong(ColorSh3 & dst, const ImageView & src, int numThreads);
+
+	// Same result as ColorSh3::ProjectAndDot() for many normals. BuildColorSh3Simd() folds the basis constants
+	// into the coefs, so each normal costs 9 mul/add per channel. The Soa version expects unit normals, the
+	// octahedral version normalizes after decoding. Output is one plane per channel.
+	static void BuildColorSh3Simd(ColorSh3Simd & dst, const ColorSh3 & src);
+	static void EvalIrradianceSoa(float * dstR, float * dstG, float * dstB, const float * srcX, const float * srcY, const float * srcZ, int numNormals, const ColorSh3Simd & sh, int numThreads);
+	static void EvalIrradianceOct(float * dstR, float * dstG, float * dstB, const unsigned int * srcOct, int numNormals, const ColorSh3Simd & sh, int numThreads);
+
+	// Irradiance as n^T M n with n = (x,y,z,1), one matrix per channel. With convolveCosine the coefs are treated
+	// as radiance and convolved with the clamped cosine lobe, so the result is irradiance. Without it the result
+	// is the same as ProjectAndDot().
+	static void BuildIrradianceMatrices(ShIrradianceMatrices & dst, const ColorSh3 & src, bool convolveCosine);
+	static Vec3 EvalIrradianceMatrices(const ShIrradianceMatrices & src, Vec3 N);
+
+	// Adds the lights in the batch to the SH of every receiver. Lights are projected as zonal harmonics along the
+	// direction to the light, with the band scales of a uniform disk when they have a radius. Directional lights
+	// don't depend on the receiver and are projected once. Split across threads by receiver.
+	static void AccumulateLights(ColorSh3 * dst, const Vec3 * receivers, int numReceivers, const ShLightBatch & lights, int numThreads);
+
+	// Product of two functions, projected back to order 3: h_k = sum of C_ijk f_i g_j, C_ijk = integral of
+	// Y_i Y_j Y_k. C is symmetric and has 83 non-zero entries, which come from 25 unique ones with i <= j <= k.
+	// Only those are evaluated. Multiplying lighting by visibility gives the shadowed lighting, the color versions
+	// are per channel. The batch version can work in place.
+	static GreySh3 MultiplySh(const GreySh3 & lhs, const GreySh3 & rhs);
+	static ColorSh3 MultiplySh(const ColorSh3 & lhs, const GreySh3 & rhs);
+	static ColorSh3 MultiplySh(const ColorSh3 & lhs, const ColorSh3 & rhs);
+	static void MultiplyShBatch(ColorSh3 * dst, const ColorSh3 * lighting, const GreySh3 * visibility, int numSh, int numThreads);
+
+	// Compressed storage, see ColorSh3Fp16 and ColorSh3Norm8 for the layouts and error bounds.
+	static void CompressSh(ColorSh3Fp16 & dst, const ColorSh3 & src);
+	static void CompressSh(ColorSh3Norm8 & dst, const ColorSh3 & src);
+	static ColorSh3 DecompressSh(const ColorSh3Fp16 & src);
+	static ColorSh3 DecompressSh(const ColorSh3Norm8 & src);
+
+	// Weighted sum of compressed SH, decoding 4 coefs at a time, for interpolating probes without unpacking them
+	// first.
+	static ColorSh3 BlendCompressedSh(const ColorSh3Fp16 * const srcs[], const float weights[], int numSrcs);
+	static ColorSh3 BlendCompressedSh(const ColorSh3Norm8 * const srcs[], const float weights[], int numSrcs);
+
+	// octahedral normal, x in the low 16 bits and y in the high 16 bits, both unorm
+	static unsigned int EncodeNormalOct(Vec3 N);
+	static Vec3 DecodeNormalOct(unsigned int packed);
 
 	// assumes input in radians
 	static void MakeRotationMatrixRadians(float dst[3][3], float thetaX, float thetaY, float thetaZ);
@@ -60,6 +149,115 @@ struct ColorSh3
 	Vec3 m_coefs[9];
 };
 
+// A ColorSh3 as the polynomial 1, x, y, z, xy, yz, xz, zz, xx-yy with the basis constants folded in, each term
+// splatted to 4 lanes so the batch functions can load it directly.
+struct ColorSh3Simd
+{
+	enum
+	{
+		kTerm_Const,
+		kTerm_X,
+		kTerm_Y,
+		kTerm_Z,
+		kTerm_XY,
+		kTerm_YZ,
+		kTerm_XZ,
+		kTerm_ZZ,
+		kTerm_XXMinusYY,
+		kTerm_Num
+	};
+
+	float m_terms[kTerm_Num][3][4];
+};
+
+struct ShIrradianceMatrices
+{
+	Mat44 m_channels[3];
+};
+
+// SoA light arrays for ShUtil::AccumulateLights(), pointers marked optional can be NULL. Directions point toward
+// the light. Local lights fall off as color/max(d^2,radius^2), times (1-(d/range)^4)^2 when they have a range.
+// Spot lights are also scaled by s^2, s = saturate((cos(angle) - cosOuter)/(cosInner - cosOuter)).
+struct ShLightBatch
+{
+	ShLightBatch()
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		m_numDirectional = 0;
+		m_dirX = m_dirY = m_dirZ = NULL;
+		m_dirR = m_dirG = m_dirB = NULL;
+
+		m_numPoint = 0;
+		m_pointX = m_pointY = m_pointZ = NULL;
+		m_pointR = m_pointG = m_pointB = NULL;
+		m_pointRange = NULL;
+		m_pointRadius = NULL;
+
+		m_numSpot = 0;
+		m_spotX = m_spotY = m_spotZ = NULL;
+		m_spotR = m_spotG = m_spotB = NULL;
+		m_spotRange = NULL;
+		m_spotRadius = NULL;
+		m_spotDirX = m_spotDirY = m_spotDirZ = NULL;
+		m_spotCosInner = NULL;
+		m_spotCosOuter = NULL;
+	}
+
+	int m_numDirectional;
+	const float * m_dirX;
+	const float * m_dirY;
+	const float * m_dirZ;
+	const float * m_dirR;
+	const float * m_dirG;
+	const float * m_dirB;
+
+	int m_numPoint;
+	const float * m_pointX;
+	const float * m_pointY;
+	const float * m_pointZ;
+	const float * m_pointR;
+	const float * m_pointG;
+	const float * m_pointB;
+	const float * m_pointRange; // optional
+	const float * m_pointRadius; // optional
+
+	int m_numSpot;
+	const float * m_spotX;
+	const float * m_spotY;
+	const float * m_spotZ;
+	const float * m_spotR;
+	const float * m_spotG;
+	const float * m_spotB;
+	const float * m_spotRange; // optional
+	const float * m_spotRadius; // optional
+	const float * m_spotDirX; // the way the spot points, unit length
+	const float * m_spotDirY;
+	const float * m_spotDirZ;
+	const float * m_spotCosInner;
+	const float * m_spotCosOuter;
+};
+
+// The 27 coefs as halves, in ColorSh3 order with one pad so they decode 4 at a time. 56 bytes instead of 108,
+// and each coef keeps a relative error of 2^-11.
+struct ColorSh3Fp16
+{
+	unsigned short m_coefs[28];
+};
+
+// Band 0 as half RGB, and coefs 1-8 as 8 bit ratios to band 0 of the same channel, divided by sqrt(2l+1). 32
+// bytes. No non-negative function has a band l coef larger than sqrt(2l+1) times band 0, so for lighting only
+// rounding is lost: evaluated anywhere, the error is at most (.5/127)*(3^1.5 + 5^1.5) = 6.5% of the mean value
+// c0/sqrt(4pi), plus the half rounding of band 0. Functions with larger ratios (negative lobes) get clamped.
+struct ColorSh3Norm8
+{
+	unsigned short m_band0[4]; // RGB and a pad
+	signed char m_ratios[24]; // coefs 1-8, RGB each
+};
+
 
 
 
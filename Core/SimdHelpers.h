@@ -0,0 +1,72 @@
+#ifndef _SIMD_HELPERS_H_
+#define _SIMD_HELPERS_H_
+
+#include "CoreHelpers.h"
+
+#include <emmintrin.h>
+
+// SSE2 versions of the helpers in CoreHelpers.h, 4 floats at a time. These use exactly the same polynomials
+// as FastLog2/FastExp2/FastPow so that the scalar tail of a loop gives the same results as the vector body.
+
+inline __m128 SimdSelect(__m128 mask, __m128 a, __m128 b)
+{
+	return _mm_or_ps(_mm_and_ps(mask,a),_mm_andnot_ps(mask,b));
+}
+
+inline __m128 SimdClamp(__m128 x, float minVal, float maxVal)
+{
+	return _mm_max_ps(_mm_set1_ps(minVal),_mm_min_ps(_mm_set1_ps(maxVal),x));
+}
+
+inline __m128 SimdFastLog2(__m128 x)
+{
+	__m128i bits = _mm_castps_si128(x);
+	__m128i e = _mm_sub_epi32(_mm_and_si128(_mm_srli_epi32(bits,23),_mm_set1_epi32(255)),_mm_set1_epi32(127));
+	__m128 m = _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(bits,_mm_set1_epi32(0x007fffff)),_mm_set1_epi32(0x3f800000)));
+
+	// reduce the mantissa to [sqrt(.5),sqrt(2))
+	__m128 upper = _mm_cmpgt_ps(m,_mm_set1_ps(1.41421356f));
+	m = SimdSelect(upper,_mm_mul_ps(m,_mm_set1_ps(0.5f)),m);
+	__m128 ef = _mm_add_ps(_mm_cvtepi32_ps(e),_mm_and_ps(upper,_mm_set1_ps(1.0f)));
+
+	__m128 one = _mm_set1_ps(1.0f);
+	__m128 s = _mm_div_ps(_mm_sub_ps(m,one),_mm_add_ps(m,one));
+	__m128 s2 = _mm_mul_ps(s,s);
+
+	__m128 p = _mm_set1_ps(0.412198583f);
+	p = _mm_add_ps(_mm_mul_ps(p,s2),_mm_set1_ps(0.577078016f));
+	p = _mm_add_ps(_mm_mul_ps(p,s2),_mm_set1_ps(0.961796694f));
+	p = _mm_add_ps(_mm_mul_ps(p,s2),_mm_set1_ps(2.885390082f));
+
+	return _mm_add_ps(ef,_mm_mul_ps(p,s));
+}
+
+inline __m128 SimdFastExp2(__m128 x)
+{
+	x = SimdClamp(x,-126.0f,126.0f);
+
+	// floor
+	__m128 fi = _mm_cvtepi32_ps(_mm_cvttps_epi32(x));
+	fi = _mm_sub_ps(fi,_mm_and_ps(_mm_cmplt_ps(x,fi),_mm_set1_ps(1.0f)));
+	__m128 t = _mm_sub_ps(x,fi);
+
+	__m128 p = _mm_set1_ps(0.00189437942f);
+	p = _mm_add_ps(_mm_mul_ps(p,t),_mm_set1_ps(0.00894058253f));
+	p = _mm_add_ps(_mm_mul_ps(p,t),_mm_set1_ps(0.0558765569f));
+	p = _mm_add_ps(_mm_mul_ps(p,t),_mm_set1_ps(0.240131692f));
+	p = _mm_add_ps(_mm_mul_ps(p,t),_mm_set1_ps(0.693156777f));
+	p = _mm_add_ps(_mm_mul_ps(p,t),_mm_set1_ps(0.99999977f));
+
+	__m128i i = _mm_add_epi32(_mm_cvttps_epi32(fi),_mm_set1_epi32(127));
+	return _mm_mul_ps(p,_mm_castsi128_ps(_mm_slli_epi32(i,23)));
+}
+
+// x^y for x >= 0, 0 for x <= 0
+inline __m128 SimdFastPow(__m128 x, __m128 y)
+{
+	__m128 positive = _mm_cmpgt_ps(x,_mm_setzero_ps());
+	__m128 ret = SimdFastExp2(_mm_mul_ps(y,SimdFastLog2(x)));
+	return _mm_and_ps(positive,ret);
+}
+
+#endif
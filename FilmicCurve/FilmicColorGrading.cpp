@@ -1,5 +1,10 @@
 #include "FilmicColorGrading.h"
 
+#include <ParallelUtil.h>
+#include <SimdHelpers.h>
+#include <HashUtil.h>
+#include <ProfileUtil.h>
+
 float FilmicColorGrading::ApplyLiftInvGammaGain(const float lift, const float invGamma, const float gain, float v)
 {
 	// lerp gain
@@ -8,6 +13,83 @@ float FilmicColorGrading::ApplyLiftInvGammaGain(const float lift, const float in
 	return dst;
 }
 
+// SMPTE ST 2084 constants
+static const float s_pqM1 = 2610.0f/16384.0f;
+static const float s_pqM2 = 2523.0f/4096.0f*128.0f;
+static const float s_pqC1 = 3424.0f/4096.0f;
+static const float s_pqC2 = 2413.0f/4096.0f*32.0f;
+static const float s_pqC3 = 2392.0f/4096.0f*32.0f;
+static const float s_pqMaxNits = 10000.0f;
+
+float FilmicColorGrading::EncodeSRGB(float v)
+{
+	if (v <= 0.0031308f)
+		return 12.92f*v;
+	return 1.055f*powf(v,1.0f/2.4f) - 0.055f;
+}
+
+float FilmicColorGrading::EncodePQ(float v, float peakNits)
+{
+	float Y = MaxFloat(0.0f,v*(peakNits/s_pqMaxNits));
+	float Ym1 = powf(Y,s_pqM1);
+	return powf((s_pqC1 + s_pqC2*Ym1)/(1.0f + s_pqC3*Ym1),s_pqM2);
+}
+
+float FilmicColorGrading::EncodeSRGBFast(float v)
+{
+	float curve = 1.055f*FastPow(v,1.0f/2.4f) - 0.055f;
+	return (v <= 0.0031308f) ? 12.92f*v : curve;
+}
+
+float FilmicColorGrading::EncodePQFast(float v, float peakNits)
+{
+	float Y = MaxFloat(0.0f,v*(peakNits/s_pqMaxNits));
+	float Ym1 = FastPow(Y,s_pqM1);
+
+	// the ratio is in [c1,1], so it's always safe to take the log
+	float ratio = (s_pqC1 + s_pqC2*Ym1)/(1.0f + s_pqC3*Ym1);
+	return FastExp2(s_pqM2*FastLog2(ratio));
+}
+
+static __m128 SimdEncodeSRGB(__m128 v)
+{
+	__m128 curve = _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(1.055f),SimdFastPow(v,_mm_set1_ps(1.0f/2.4f))),_mm_set1_ps(0.055f));
+	__m128 linear = _mm_mul_ps(_mm_set1_ps(12.92f),v);
+	return SimdSelect(_mm_cmple_ps(v,_mm_set1_ps(0.0031308f)),linear,curve);
+}
+
+static __m128 SimdEncodePQ(__m128 v, __m128 nitsScale)
+{
+	__m128 Y = _mm_max_ps(_mm_setzero_ps(),_mm_mul_ps(v,nitsScale));
+	__m128 Ym1 = SimdFastPow(Y,_mm_set1_ps(s_pqM1));
+
+	__m128 num = _mm_add_ps(_mm_set1_ps(s_pqC1),_mm_mul_ps(_mm_set1_ps(s_pqC2),Ym1));
+	__m128 den = _mm_add_ps(_mm_set1_ps(1.0f),_mm_mul_ps(_mm_set1_ps(s_pqC3),Ym1));
+	__m128 ratio = _mm_div_ps(num,den);
+	return SimdFastExp2(_mm_mul_ps(_mm_set1_ps(s_pqM2),SimdFastLog2(ratio)));
+}
+
+void FilmicColorGrading::EncodeValuesFast(float * values, int numValues, eOutputEncoding encoding, float peakNits)
+{
+	int numSimd = numValues & ~3;
+
+	if (encoding == kOutputEncoding_sRGB)
+	{
+		for (int i = 0; i < numSimd; i += 4)
+			_mm_storeu_ps(values+i,SimdEncodeSRGB(_mm_loadu_ps(values+i)));
+		for (int i = numSimd; i < numValues; i++)
+			values[i] = EncodeSRGBFast(values[i]);
+	}
+	else if (encoding == kOutputEncoding_PQ)
+	{
+		__m128 nitsScale = _mm_set1_ps(peakNits/s_pqMaxNits);
+		for (int i = 0; i < numSimd; i += 4)
+			_mm_storeu_ps(values+i,SimdEncodePQ(_mm_loadu_ps(values+i),nitsScale));
+		for (int i = numSimd; i < numValues; i++)
+			values[i] = EncodePQFast(values[i],peakNits);
+	}
+}
+
 float FilmicColorGrading::ApplySpacing(float v, eTableSpacing spacing)
 {
 	if (spacing == kTableSpacing_Linear)
@@ -35,15 +117,23 @@ float FilmicColorGrading::ApplySpacingInv(float v, eTableSpacing spacing)
 }
 
 
-Vec3 FilmicColorGrading::EvalParams::EvalFullColor(Vec3 src) const
+int FilmicColorGrading::EvalParams::CalcStageMask() const
 {
-	Vec3 v = src;
-	v = EvalExposure(v);
-	v = EvalSaturation(v);
-	v = EvalContrast(v);
-	v = EvalFilmicCurve(v);
-	v = EvalLiftGammaGain(v);
-	return v;
+	int mask = 0;
+	if (m_saturation != 1.0f)
+		mask |= kStage_Saturation;
+	if (m_contrastStrength != 1.0f)
+		mask |= kStage_Contrast;
+	if (m_postGamma != 1.0f)
+		mask |= kStage_PostGamma;
+	for (int c = 0; c < 3; c++)
+	{
+		if (m_liftAdjust.m_data[c] != 0.0f || m_invGammaAdjust.m_data[c] != 1.0f || m_gainAdjust.m_data[c] != 1.0f)
+			mask |= kStage_LiftGammaGain;
+	}
+	if (m_outputEncoding != kOutputEncoding_None)
+		mask |= kStage_OutputEncoding;
+	return mask;
 }
 
 Vec3 FilmicColorGrading::EvalParams::EvalExposure(Vec3 v) const
@@ -111,6 +201,119 @@ Vec3 FilmicColorGrading::EvalParams::EvalLiftGammaGain(Vec3 v) const
 	return ret;
 }
 
+Vec3 FilmicColorGrading::EvalParams::EvalOutputEncoding(Vec3 v) const
+{
+	Vec3 ret = v;
+	if (m_outputEncoding == kOutputEncoding_sRGB)
+	{
+		ret.x = EncodeSRGB(v.x);
+		ret.y = EncodeSRGB(v.y);
+		ret.z = EncodeSRGB(v.z);
+	}
+	else if (m_outputEncoding == kOutputEncoding_PQ)
+	{
+		ret.x = EncodePQ(v.x,m_outputPeakNits);
+		ret.y = EncodePQ(v.y,m_outputPeakNits);
+		ret.z = EncodePQ(v.z,m_outputPeakNits);
+	}
+	return ret;
+}
+
+// Contrast through output encoding, which is also the part that goes into the baked tables. The stage
+// checks are on a template parameter, so the stages that are off are compiled out.
+template <int kStageMask>
+static Vec3 EvalCurveStages(const FilmicColorGrading::EvalParams & params, Vec3 v)
+{
+	if (kStageMask & FilmicColorGrading::kStage_Contrast)
+		v = params.EvalContrast(v);
+
+	if (kStageMask & FilmicColorGrading::kStage_PostGamma)
+	{
+		v = params.EvalFilmicCurve(v);
+	}
+	else
+	{
+		v.x = params.m_filmicCurve.Eval(v.x);
+		v.y = params.m_filmicCurve.Eval(v.y);
+		v.z = params.m_filmicCurve.Eval(v.z);
+	}
+
+	if (kStageMask & FilmicColorGrading::kStage_LiftGammaGain)
+	{
+		v = params.EvalLiftGammaGain(v);
+	}
+	else
+	{
+		v.x = Saturate(v.x);
+		v.y = Saturate(v.y);
+		v.z = Saturate(v.z);
+	}
+
+	if (kStageMask & FilmicColorGrading::kStage_OutputEncoding)
+		v = params.EvalOutputEncoding(v);
+
+	return v;
+}
+
+// Key modes: contrast, filmic curve and post gamma run on the key only, lift/gamma/gain is per channel.
+template <int kStageMask>
+static Vec3 EvalKeyStages(const FilmicColorGrading::EvalParams & params, float key)
+{
+	if (kStageMask & FilmicColorGrading::kStage_Contrast)
+		key = EvalLogContrastFunc(key,params.m_contrastEpsilon,params.m_contrastLogMidpoint,params.m_contrastStrength);
+
+	key = params.m_filmicCurve.Eval(key);
+	if (kStageMask & FilmicColorGrading::kStage_PostGamma)
+		key = powf(key,params.m_postGamma);
+
+	if (kStageMask & FilmicColorGrading::kStage_LiftGammaGain)
+		return params.EvalLiftGammaGain(Vec3(key));
+	return Vec3(Saturate(key));
+}
+
+template <int kStageMask>
+static Vec3 EvalFullColorKeyStages(const FilmicColorGrading::EvalParams & params, Vec3 v)
+{
+	v = params.EvalExposure(v);
+	if (kStageMask & FilmicColorGrading::kStage_Saturation)
+		v = params.EvalSaturation(v);
+
+	float key = FilmicColorGrading::CalcToneMapKey(v,params.m_luminanceWeights,params.m_toneMapMode);
+	v = FilmicColorGrading::ApplyToneMapRatio(EvalKeyStages<kStageMask>(params,key),v,key);
+
+	// the encoding has to come after the ratio
+	if (kStageMask & FilmicColorGrading::kStage_OutputEncoding)
+		v = params.EvalOutputEncoding(v);
+	return v;
+}
+
+template <int kStageMask>
+static Vec3 EvalFullColorStages(const FilmicColorGrading::EvalParams & params, Vec3 v)
+{
+	v = params.EvalExposure(v);
+	if (kStageMask & FilmicColorGrading::kStage_Saturation)
+		v = params.EvalSaturation(v);
+	return EvalCurveStages<kStageMask>(params,v);
+}
+
+typedef Vec3 (*EvalStagesFunc)(const FilmicColorGrading::EvalParams & params, Vec3 v);
+
+#define STAGE_FUNCS_4(func,base) &func<(base)+0>, &func<(base)+1>, &func<(base)+2>, &func<(base)+3>
+#define STAGE_FUNCS_ALL(func) STAGE_FUNCS_4(func,0), STAGE_FUNCS_4(func,4), STAGE_FUNCS_4(func,8), STAGE_FUNCS_4(func,12), \
+	STAGE_FUNCS_4(func,16), STAGE_FUNCS_4(func,20), STAGE_FUNCS_4(func,24), STAGE_FUNCS_4(func,28)
+
+// one specialization per stage mask
+static const EvalStagesFunc s_evalFullColorFuncs[FilmicColorGrading::kStage_All+1] = { STAGE_FUNCS_ALL(EvalFullColorStages) };
+static const EvalStagesFunc s_evalFullColorKeyFuncs[FilmicColorGrading::kStage_All+1] = { STAGE_FUNCS_ALL(EvalFullColorKeyStages) };
+static const EvalStagesFunc s_evalCurveFuncs[FilmicColorGrading::kStage_All+1] = { STAGE_FUNCS_ALL(EvalCurveStages) };
+
+Vec3 FilmicColorGrading::EvalParams::EvalFullColor(Vec3 src) const
+{
+	if (m_toneMapMode != kToneMapMode_PerChannel)
+		return s_evalFullColorKeyFuncs[m_stageMask & kStage_All](*this,src);
+	return s_evalFullColorFuncs[m_stageMask & kStage_All](*this,src);
+}
+
 // convert from gamma space to linear space, and then normalize it
 static Vec3 ColorLinearFromGammaNormalize(Vec3 val)
 {
@@ -211,6 +414,11 @@ void FilmicColorGrading::RawFromUserParams(RawParams & rawParams, const UserPara
 	
 	// gamma after filmic curve to convert to display space
 	rawParams.m_postGamma = userParams.m_postGamma;
+
+	rawParams.m_outputEncoding = userParams.m_outputEncoding;
+	rawParams.m_outputPeakNits = userParams.m_outputPeakNits;
+
+	rawParams.m_toneMapMode = userParams.m_toneMapMode;
 }
 
 void FilmicColorGrading::EvalFromRawParams(EvalParams & dstParams, const RawParams & rawParams)
@@ -234,18 +442,77 @@ void FilmicColorGrading::EvalFromRawParams(EvalParams & dstParams, const RawPara
 	dstParams.m_invGammaAdjust.y = 1.0f/(rawParams.m_gammaAdjust.y);
 	dstParams.m_invGammaAdjust.z = 1.0f/(rawParams.m_gammaAdjust.z);
 	dstParams.m_gainAdjust = rawParams.m_gainAdjust;
+
+	dstParams.m_outputEncoding = rawParams.m_outputEncoding;
+	dstParams.m_outputPeakNits = rawParams.m_outputPeakNits;
+
+	dstParams.m_toneMapMode = rawParams.m_toneMapMode;
+
+	dstParams.m_stageMask = dstParams.CalcStageMask();
+}
+
+// keys below this are treated as black
+static const float s_minToneMapKey = 1e-10f;
+
+float FilmicColorGrading::CalcToneMapKey(const Vec3 & rgb, const Vec3 & luminanceWeights, eToneMapMode mode)
+{
+	float key = (mode == kToneMapMode_MaxRGB) ? MaxFloat(rgb.x,MaxFloat(rgb.y,rgb.z)) : Vec3::Dot(rgb,luminanceWeights);
+
+	// also turns NaNs into 0
+	return MaxFloat(key,0.0f);
 }
 
-void FilmicColorGrading::BakeFromEvalParams(BakedParams & dstCurve, const EvalParams & srcParams, const int curveSize, const eTableSpacing spacing)
+Vec3 FilmicColorGrading::ApplyToneMapRatio(const Vec3 & mapped, const Vec3 & rgb, float key)
 {
+	if (!(key > s_minToneMapKey))
+		return mapped;
+
+	float invKey = 1.0f/key;
+	Vec3 ret;
+	ret.x = Saturate(mapped.x * rgb.x * invKey);
+	ret.y = Saturate(mapped.y * rgb.y * invKey);
+	ret.z = Saturate(mapped.z * rgb.z * invKey);
+	return ret;
+}
+
+Mat33 FilmicColorGrading::CalcSaturationMatrix(const Vec3 & luminanceWeights, float saturation)
+{
+	Mat33 ret;
+	for (int r = 0; r < 3; r++)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			float diag = (r == c) ? saturation : 0.0f;
+			ret.m_data[r*3+c] = diag + (1.0f - saturation)*luminanceWeights.m_data[c];
+		}
+	}
+	return ret;
+}
+
+void FilmicColorGrading::BakeFromEvalParams(BakedParams & dstCurve, const EvalParams & srcParams, const int curveSize, const eTableSpacing spacing, const Mat33 * inputMatrix, bool bakeOutputEncoding)
+{
+	PROFILE_ZONE("BakeFromEvalParams");
 
 	// in the curve, we are baking the following steps:
 	// v = EvalContrast(v);
 	// v = EvalFilmicCurve(v);
 	// v = EvalLiftGammaGain(v);
+	// v = EvalOutputEncoding(v); (unless bakeOutputEncoding is false)
+
+	// the key modes scale the rgb ratio by the table result, which only works before the encoding
+	if (srcParams.m_toneMapMode != kToneMapMode_PerChannel)
+		bakeOutputEncoding = false;
+
+	int stageMask = srcParams.m_stageMask & kStage_All;
+	if (!bakeOutputEncoding)
+		stageMask &= ~kStage_OutputEncoding;
+
+	EvalStagesFunc evalCurve = s_evalCurveFuncs[stageMask];
 
 	// So what is the maximum value to bake into the curve? It's filmic W with inverse contrast applied
-	float maxTableValue = EvalLogContrastFuncRev(srcParams.m_filmicCurve.m_W,srcParams.m_contrastEpsilon,srcParams.m_contrastLogMidpoint,srcParams.m_contrastStrength);
+	float maxTableValue = srcParams.m_filmicCurve.m_W;
+	if (stageMask & kStage_Contrast)
+		maxTableValue = EvalLogContrastFuncRev(srcParams.m_filmicCurve.m_W,srcParams.m_contrastEpsilon,srcParams.m_contrastLogMidpoint,srcParams.m_contrastStrength);
 
 	dstCurve.Reset();
 	dstCurve.m_curveSize = curveSize;
@@ -254,6 +521,27 @@ void FilmicColorGrading::BakeFromEvalParams(BakedParams & dstCurve, const EvalPa
 	dstCurve.m_saturation = srcParams.m_saturation;
 	dstCurve.m_linColorFilterExposure = srcParams.m_linColorFilterExposure * (1.0f / maxTableValue);
 	dstCurve.m_luminanceWeights = srcParams.m_luminanceWeights;
+	dstCurve.m_toneMapMode = srcParams.m_toneMapMode;
+
+	// fold the input color space, color filter, exposure and saturation into one matrix
+	{
+		Mat33 exposureMatrix;
+		exposureMatrix.m_data[0] = dstCurve.m_linColorFilterExposure.x;
+		exposureMatrix.m_data[4] = dstCurve.m_linColorFilterExposure.y;
+		exposureMatrix.m_data[8] = dstCurve.m_linColorFilterExposure.z;
+
+		Mat33 saturationMatrix = CalcSaturationMatrix(dstCurve.m_luminanceWeights,dstCurve.m_saturation);
+
+		dstCurve.m_colorMatrix = saturationMatrix * exposureMatrix;
+		if (inputMatrix != NULL)
+			dstCurve.m_colorMatrix = dstCurve.m_colorMatrix * (*inputMatrix);
+	}
+
+	if (!bakeOutputEncoding)
+	{
+		dstCurve.m_outputEncoding = srcParams.m_outputEncoding;
+		dstCurve.m_outputPeakNits = srcParams.m_outputPeakNits;
+	}
 
 	dstCurve.m_curveB.resize(curveSize);
 	dstCurve.m_curveG.resize(curveSize);
@@ -265,10 +553,7 @@ void FilmicColorGrading::BakeFromEvalParams(BakedParams & dstCurve, const EvalPa
 
 		t = ApplySpacing(t,spacing) * maxTableValue;
 
-		Vec3 rgb = Vec3(t,t,t);
-		rgb = srcParams.EvalContrast(rgb);
-		rgb = srcParams.EvalFilmicCurve(rgb);
-		rgb = srcParams.EvalLiftGammaGain(rgb);
+		Vec3 rgb = evalCurve(srcParams,Vec3(t,t,t));
 
 		dstCurve.m_curveR[i] = rgb.x;
 		dstCurve.m_curveG[i] = rgb.y;
@@ -299,29 +584,1040 @@ float FilmicColorGrading::BakedParams::SampleTable(const std::vector < float > &
 
 Vec3 FilmicColorGrading::BakedParams::EvalColor(const Vec3 srcColor) const
 {
-	Vec3 rgb = srcColor;
+	Vec3 rgb = (m_toneMapMode == kToneMapMode_PerChannel) ? EvalTables(EvalTableCoords(srcColor)) : EvalKeyToneMap(srcColor);
+	if (m_outputEncoding != kOutputEncoding_None)
+		rgb = EvalOutputEncoding(rgb);
+	return rgb;
+}
 
-	// exposure and color filter
-	rgb = rgb * m_linColorFilterExposure;
+Vec3 FilmicColorGrading::BakedParams::EvalOutputEncoding(const Vec3 x) const
+{
+	Vec3 rgb = x;
+	EncodeValuesFast(rgb.m_data,3,m_outputEncoding,m_outputPeakNits);
+	return rgb;
+}
 
-	// saturation
-	float grey = Vec3::Dot(rgb,m_luminanceWeights);
-	rgb = Vec3(grey) + m_saturation*(rgb - Vec3(grey));
+Vec3 FilmicColorGrading::BakedParams::EvalTableCoords(const Vec3 srcColor) const
+{
+	// input color space, exposure, color filter and saturation
+	Vec3 rgb = m_colorMatrix * srcColor;
 
 	rgb.x = ApplySpacingInv(rgb.x,m_spacing);
 	rgb.y = ApplySpacingInv(rgb.y,m_spacing);
 	rgb.z = ApplySpacingInv(rgb.z,m_spacing);
 
+	return rgb;
+}
+
+Vec3 FilmicColorGrading::BakedParams::EvalTables(const Vec3 coords) const
+{
 	// contrast, filmic curve, gamme 
-	rgb.x = SampleTable(m_curveR,rgb.x);
-	rgb.y = SampleTable(m_curveG,rgb.y);
-	rgb.z = SampleTable(m_curveB,rgb.z);
+	Vec3 rgb;
+	rgb.x = SampleTable(m_curveR,coords.x);
+	rgb.y = SampleTable(m_curveG,coords.y);
+	rgb.z = SampleTable(m_curveB,coords.z);
 
 	return rgb;
 }
 
+Vec3 FilmicColorGrading::BakedParams::EvalKeyToneMap(const Vec3 srcColor) const
+{
+	Vec3 rgb = m_colorMatrix * srcColor;
+	float key = CalcToneMapKey(rgb,m_luminanceWeights,m_toneMapMode);
+	float coord = ApplySpacingInv(key,m_spacing);
+
+	// same as SampleTable(), with the position shared by the three tables
+	int size = m_curveR.size();
+	float x = coord * float(size-1);
+	int x0 = MinInt((int)x,size-1);
+	int x1 = MinInt(x0+1,size-1);
+	float t = x - float(x0);
+
+	Vec3 mapped;
+	mapped.x = m_curveR[x0] + t*(m_curveR[x1] - m_curveR[x0]);
+	mapped.y = m_curveG[x0] + t*(m_curveG[x1] - m_curveG[x0]);
+	mapped.z = m_curveB[x0] + t*(m_curveB[x1] - m_curveB[x0]);
+
+	return ApplyToneMapRatio(mapped,rgb,key);
+}
+
+bool FilmicColorGrading::BakedParams::CalcSharedCoordsScale(float & coordsScale, const BakedParams & src, const BakedParams & dst)
+{
+	coordsScale = 1.0f;
+
+	// the key modes need more than the coords
+	if (src.m_toneMapMode != kToneMapMode_PerChannel || dst.m_toneMapMode != kToneMapMode_PerChannel)
+		return false;
+
+	if (src.m_spacing != dst.m_spacing)
+		return false;
+
+	// find the matrix scale from the largest entry, then check that all the others agree
+	int maxIndex = 0;
+	for (int i = 1; i < 9; i++)
+	{
+		if (Abs(src.m_colorMatrix.m_data[i]) > Abs(src.m_colorMatrix.m_data[maxIndex]))
+			maxIndex = i;
+	}
+
+	float srcMax = src.m_colorMatrix.m_data[maxIndex];
+	if (srcMax == 0.0f)
+		return false;
+
+	float scale = dst.m_colorMatrix.m_data[maxIndex] / srcMax;
+	if (!(scale > 0.0f))
+		return false;
+
+	for (int i = 0; i < 9; i++)
+	{
+		float expected = src.m_colorMatrix.m_data[i] * scale;
+		if (Abs(dst.m_colorMatrix.m_data[i] - expected) > 1e-6f * Abs(dst.m_colorMatrix.m_data[maxIndex]))
+			return false;
+	}
+
+	coordsScale = ApplySpacingInv(scale,src.m_spacing);
+	return true;
+}
+
+// the size goes in first so that an empty curve still changes the hash, and empty vectors aren't dereferenced
+static unsigned long long HashCurve(const std::vector < float > & curve, unsigned long long seed)
+{
+	size_t size = curve.size();
+	unsigned long long h = HashUtil::HashBytes(&size,sizeof(size),seed);
+	if (size > 0)
+		h = HashUtil::HashBytes(curve.data(),size*sizeof(float),h);
+	return h;
+}
+
+unsigned long long FilmicColorGrading::BakedParams::CalcHash() const
+{
+	unsigned long long h = 0;
+	h = HashUtil::HashBytes(m_colorMatrix.m_data,sizeof(m_colorMatrix.m_data),h);
+	h = HashUtil::HashBytes(&m_spacing,sizeof(m_spacing),h);
+	h = HashUtil::HashBytes(&m_outputEncoding,sizeof(m_outputEncoding),h);
+	h = HashUtil::HashBytes(&m_outputPeakNits,sizeof(m_outputPeakNits),h);
+	h = HashUtil::HashBytes(&m_toneMapMode,sizeof(m_toneMapMode),h);
+	h = HashUtil::HashBytes(m_luminanceWeights.m_data,sizeof(m_luminanceWeights.m_data),h);
+	h = HashCurve(m_curveR,h);
+	h = HashCurve(m_curveG,h);
+	h = HashCurve(m_curveB,h);
+	return h;
+}
+
+// pixels per block, small enough that the source block and the shared coords stay in L1/L2 between outputs
+static const int s_evalBlockSize = 1024;
+
+void FilmicColorGrading::EvalImage(Vec3 * dstImage, const Vec3 * srcImage, int numPixels, const BakedParams & params, int numThreads)
+{
+	Vec3 * dstImages[1] = { dstImage };
+	const BakedParams * paramsList[1] = { &params };
+	EvalImageMulti(dstImages,paramsList,1,srcImage,numPixels,numThreads);
+}
+
+// one stage at a time over the block, so each stage gets its own profile zone
+template <int kStageMask>
+static void EvalBlockStages(Vec3 * block, int count, const FilmicColorGrading::EvalParams & params)
+{
+	{
+		PROFILE_ZONE("EvalExposure");
+		for (int i = 0; i < count; i++)
+			block[i] = params.EvalExposure(block[i]);
+	}
+	if (kStageMask & FilmicColorGrading::kStage_Saturation)
+	{
+		PROFILE_ZONE("EvalSaturation");
+		for (int i = 0; i < count; i++)
+			block[i] = params.EvalSaturation(block[i]);
+	}
+	if (kStageMask & FilmicColorGrading::kStage_Contrast)
+	{
+		PROFILE_ZONE("EvalContrast");
+		for (int i = 0; i < count; i++)
+			block[i] = params.EvalContrast(block[i]);
+	}
+	{
+		PROFILE_ZONE("EvalFilmicCurve");
+		for (int i = 0; i < count; i++)
+		{
+			if (kStageMask & FilmicColorGrading::kStage_PostGamma)
+			{
+				block[i] = params.EvalFilmicCurve(block[i]);
+			}
+			else
+			{
+				block[i].x = params.m_filmicCurve.Eval(block[i].x);
+				block[i].y = params.m_filmicCurve.Eval(block[i].y);
+				block[i].z = params.m_filmicCurve.Eval(block[i].z);
+			}
+		}
+	}
+	{
+		PROFILE_ZONE("EvalLiftGammaGain");
+		if (kStageMask & FilmicColorGrading::kStage_LiftGammaGain)
+		{
+			for (int i = 0; i < count; i++)
+				block[i] = params.EvalLiftGammaGain(block[i]);
+		}
+		else
+		{
+			for (int i = 0; i < count; i++)
+				block[i] = Vec3(Saturate(block[i].x),Saturate(block[i].y),Saturate(block[i].z));
+		}
+	}
+	if (kStageMask & FilmicColorGrading::kStage_OutputEncoding)
+	{
+		PROFILE_ZONE("EvalOutputEncoding");
+		for (int i = 0; i < count; i++)
+			block[i] = params.EvalOutputEncoding(block[i]);
+	}
+}
+
+// key modes, the curve stages run on one float per pixel
+template <int kStageMask>
+static void EvalBlockKeyStages(Vec3 * block, int count, const FilmicColorGrading::EvalParams & params)
+{
+	float keys[s_evalBlockSize];
+	float mappedKeys[s_evalBlockSize];
+
+	{
+		PROFILE_ZONE("EvalExposure");
+		for (int i = 0; i < count; i++)
+			block[i] = params.EvalExposure(block[i]);
+	}
+	if (kStageMask & FilmicColorGrading::kStage_Saturation)
+	{
+		PROFILE_ZONE("EvalSaturation");
+		for (int i = 0; i < count; i++)
+			block[i] = params.EvalSaturation(block[i]);
+	}
+	{
+		PROFILE_ZONE("CalcToneMapKey");
+		for (int i = 0; i < count; i++)
+		{
+			keys[i] = FilmicColorGrading::CalcToneMapKey(block[i],params.m_luminanceWeights,params.m_toneMapMode);
+			mappedKeys[i] = keys[i];
+		}
+	}
+	if (kStageMask & FilmicColorGrading::kStage_Contrast)
+	{
+		PROFILE_ZONE("EvalContrast");
+		for (int i = 0; i < count; i++)
+			mappedKeys[i] = EvalLogContrastFunc(mappedKeys[i],params.m_contrastEpsilon,params.m_contrastLogMidpoint,params.m_contrastStrength);
+	}
+	{
+		PROFILE_ZONE("EvalFilmicCurve");
+		for (int i = 0; i < count; i++)
+		{
+			float v = params.m_filmicCurve.Eval(mappedKeys[i]);
+			if (kStageMask & FilmicColorGrading::kStage_PostGamma)
+				v = powf(v,params.m_postGamma);
+			mappedKeys[i] = v;
+		}
+	}
+	{
+		PROFILE_ZONE("EvalLiftGammaGain");
+		for (int i = 0; i < count; i++)
+		{
+			Vec3 mapped = (kStageMask & FilmicColorGrading::kStage_LiftGammaGain) ? params.EvalLiftGammaGain(Vec3(mappedKeys[i])) : Vec3(Saturate(mappedKeys[i]));
+			block[i] = FilmicColorGrading::ApplyToneMapRatio(mapped,block[i],keys[i]);
+		}
+	}
+	if (kStageMask & FilmicColorGrading::kStage_OutputEncoding)
+	{
+		PROFILE_ZONE("EvalOutputEncoding");
+		for (int i = 0; i < count; i++)
+			block[i] = params.EvalOutputEncoding(block[i]);
+	}
+}
+
+typedef void (*EvalBlockStagesFunc)(Vec3 * block, int count, const FilmicColorGrading::EvalParams & params);
+
+static const EvalBlockStagesFunc s_evalBlockFuncs[FilmicColorGrading::kStage_All+1] = { STAGE_FUNCS_ALL(EvalBlockStages) };
+static const EvalBlockStagesFunc s_evalBlockKeyFuncs[FilmicColorGrading::kStage_All+1] = { STAGE_FUNCS_ALL(EvalBlockKeyStages) };
+
+static EvalBlockStagesFunc GetEvalBlockStagesFunc(const FilmicColorGrading::EvalParams & params)
+{
+	int stageMask = params.m_stageMask & FilmicColorGrading::kStage_All;
+	return (params.m_toneMapMode != FilmicColorGrading::kToneMapMode_PerChannel) ? s_evalBlockKeyFuncs[stageMask] : s_evalBlockFuncs[stageMask];
+}
+
+void FilmicColorGrading::EvalImageFull(Vec3 * dstImage, const Vec3 * srcImage, int numPixels, const EvalParams & params, int numThreads)
+{
+	EvalBlockStagesFunc evalBlock = GetEvalBlockStagesFunc(params);
+
+	ParallelUtil::ParallelForBlocks(numPixels,s_evalBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		Vec3 block[s_evalBlockSize];
+		int count = end - begin;
+
+		memcpy(block,srcImage + begin,count*sizeof(Vec3));
+		evalBlock(block,count,params);
+		memcpy(dstImage + begin,block,count*sizeof(Vec3));
+	});
+}
+
+void FilmicColorGrading::EvalImageMulti(Vec3 * const dstImages[], const BakedParams * const params[], int numOutputs, const Vec3 * srcImage, int numPixels, int numThreads)
+{
+	// For each output, the first output that it can share table coords with. That one computes the coords for the group.
+	std::vector < int > coordsOwner(numOutputs);
+	std::vector < float > coordsScale(numOutputs);
+	for (int i = 0; i < numOutputs; i++)
+	{
+		coordsOwner[i] = i;
+		coordsScale[i] = 1.0f;
+		for (int j = 0; j < i; j++)
+		{
+			if (coordsOwner[j] == j && BakedParams::CalcSharedCoordsScale(coordsScale[i],*params[j],*params[i]))
+			{
+				coordsOwner[i] = j;
+				break;
+			}
+		}
+	}
+
+	int numGroups = 0;
+	for (int i = 0; i < numOutputs; i++)
+		numGroups += (coordsOwner[i] == i) ? 1 : 0;
+
+	ParallelUtil::ParallelForBlocks(numPixels,s_evalBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		Vec3 srcBlock[s_evalBlockSize];
+		Vec3 coords[s_evalBlockSize];
+		int count = end - begin;
+
+		// With several groups, every group reads the same block of the source. Copy it once so the
+		// source can also be one of the outputs.
+		const Vec3 * src = srcImage + begin;
+		if (numGroups > 1)
+		{
+			memcpy(srcBlock,src,count*sizeof(Vec3));
+			src = srcBlock;
+		}
+
+		for (int owner = 0; owner < numOutputs; owner++)
+		{
+			if (coordsOwner[owner] != owner)
+				continue;
+
+			const BakedParams & ownerParams = *params[owner];
+
+			// key modes never share coords, so the owner is the only output in its group
+			if (ownerParams.m_toneMapMode != kToneMapMode_PerChannel)
+			{
+				Vec3 * dst = dstImages[owner] + begin;
+				{
+					PROFILE_ZONE("EvalKeyToneMap");
+					for (int i = 0; i < count; i++)
+						dst[i] = ownerParams.EvalKeyToneMap(src[i]);
+				}
+
+				if (ownerParams.m_outputEncoding != kOutputEncoding_None)
+				{
+					PROFILE_ZONE("EncodeValuesFast");
+					EncodeValuesFast(dst[0].m_data,count*3,ownerParams.m_outputEncoding,ownerParams.m_outputPeakNits);
+				}
+				continue;
+			}
+
+			{
+				PROFILE_ZONE("EvalTableCoords");
+				for (int i = 0; i < count; i++)
+					coords[i] = ownerParams.EvalTableCoords(src[i]);
+			}
+
+			for (int out = owner; out < numOutputs; out++)
+			{
+				if (coordsOwner[out] != owner)
+					continue;
+
+				const BakedParams & outParams = *params[out];
+				Vec3 * dst = dstImages[out] + begin;
+				float scale = coordsScale[out];
+				{
+					PROFILE_ZONE("EvalTables");
+					if (scale == 1.0f)
+					{
+						for (int i = 0; i < count; i++)
+							dst[i] = outParams.EvalTables(coords[i]);
+					}
+					else
+					{
+						for (int i = 0; i < count; i++)
+							dst[i] = outParams.EvalTables(coords[i] * scale);
+					}
+				}
+
+				// unbaked encoding as a separate flat loop over the block, which is still in L1
+				if (outParams.m_outputEncoding != kOutputEncoding_None)
+				{
+					PROFILE_ZONE("EncodeValuesFast");
+					EncodeValuesFast(dst[0].m_data,count*3,outParams.m_outputEncoding,outParams.m_outputPeakNits);
+				}
+			}
+		}
+	});
+}
+
+static float DecodeInput(float v, FilmicColorGrading::eInputDecoding decoding)
+{
+	if (decoding == FilmicColorGrading::kInputDecoding_sRGB)
+	{
+		if (v <= 0.04045f)
+			return v/12.92f;
+		return powf((v + 0.055f)/1.055f,2.4f);
+	}
+	else if (decoding == FilmicColorGrading::kInputDecoding_BT1886)
+	{
+		return powf(MaxFloat(v,0.0f),2.4f);
+	}
+	else if (decoding == FilmicColorGrading::kInputDecoding_PQ)
+	{
+		float Vm2 = powf(MaxFloat(v,0.0f),1.0f/s_pqM2);
+		return powf(MaxFloat(Vm2 - s_pqC1,0.0f)/(s_pqC2 - s_pqC3*Vm2),1.0f/s_pqM1);
+	}
+	return v;
+}
+
+void FilmicColorGrading::BuildIntegerDecode(IntegerDecode & dstDecode, const BakedParams & params, int bitDepth, eInputDecoding decoding, float inputScale)
+{
+	ASSERT_ALWAYS(bitDepth == 8 || bitDepth == 16);
+
+	dstDecode.Reset();
+	dstDecode.m_bitDepth = bitDepth;
+	dstDecode.m_decoding = decoding;
+	dstDecode.m_inputScale = inputScale;
+	dstDecode.m_colorMatrix = params.m_colorMatrix;
+
+	int numCodes = 1 << bitDepth;
+	float invMaxCode = 1.0f / float(numCodes-1);
+
+	dstDecode.m_decodeTable.resize(numCodes);
+	for (int i = 0; i < numCodes; i++)
+		dstDecode.m_decodeTable[i] = DecodeInput(float(i)*invMaxCode,decoding) * inputScale;
+
+	if (bitDepth == 8)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			Vec3 column = Vec3(params.m_colorMatrix.m_data[0*3+c],params.m_colorMatrix.m_data[1*3+c],params.m_colorMatrix.m_data[2*3+c]);
+
+			dstDecode.m_channelTables[c].resize(numCodes);
+			for (int i = 0; i < numCodes; i++)
+			{
+				dstDecode.m_channelTables[c][i] = column * dstDecode.m_decodeTable[i];
+			}
+		}
+	}
+}
+
+static void ApplySpacingInvValues(float * values, int numValues, FilmicColorGrading::eTableSpacing spacing)
+{
+	if (spacing == FilmicColorGrading::kTableSpacing_Linear)
+		return;
+
+	int numSimd = numValues & ~3;
+	if (spacing == FilmicColorGrading::kTableSpacing_Quadratic)
+	{
+		for (int i = 0; i < numSimd; i += 4)
+			_mm_storeu_ps(values+i,_mm_sqrt_ps(_mm_loadu_ps(values+i)));
+	}
+	else
+	{
+		for (int i = 0; i < numSimd; i += 4)
+			_mm_storeu_ps(values+i,_mm_sqrt_ps(_mm_sqrt_ps(_mm_loadu_ps(values+i))));
+	}
+
+	for (int i = numSimd; i < numValues; i++)
+		values[i] = FilmicColorGrading::ApplySpacingInv(values[i],spacing);
+}
+
+// Same as SampleTable() for coords in [0,1], but the position is converted to 16.16 fixed point once so that the
+// index and the lerp weight both come out of a single float to int conversion. Tables must be <= 32768 entries.
+static inline float SampleTableFixed(const float * curve, float fixedScale, int maxFixed, float coord)
+{
+	// written so that NaNs (negative values through the spacing inverse) end up at 0
+	float clamped = (coord > 0.0f) ? MinFloat(coord,1.0f) : 0.0f;
+	int fx = MinInt((int)(clamped*fixedScale),maxFixed);
+	int index = fx >> 16;
+	float t = float(fx & 0xffff) * (1.0f/65536.0f);
+	return curve[index] + t*(curve[index+1] - curve[index]);
+}
+
+// linear values after the color matrix to final output, coords is overwritten
+static void EvalBlockFromLinear(Vec3 * dst, Vec3 * coords, int count, const FilmicColorGrading::BakedParams & params)
+{
+	int size = params.m_curveSize;
+	float fixedScale = float(size-1) * 65536.0f;
+	int maxFixed = ((size-1) << 16) - 1;
+
+	const float * curveR = &params.m_curveR[0];
+	const float * curveG = &params.m_curveG[0];
+	const float * curveB = &params.m_curveB[0];
+
+	if (params.m_toneMapMode != FilmicColorGrading::kToneMapMode_PerChannel)
+	{
+		// one key per pixel, so a third of the spacing inverse work, and one fixed point position for all three tables
+		float keys[s_evalBlockSize];
+		float keyCoords[s_evalBlockSize];
+		for (int i = 0; i < count; i++)
+		{
+			keys[i] = FilmicColorGrading::CalcToneMapKey(coords[i],params.m_luminanceWeights,params.m_toneMapMode);
+			keyCoords[i] = keys[i];
+		}
+
+		ApplySpacingInvValues(keyCoords,count,params.m_spacing);
+
+		for (int i = 0; i < count; i++)
+		{
+			int fx = MinInt((int)(MinFloat(keyCoords[i],1.0f)*fixedScale),maxFixed);
+			int index = fx >> 16;
+			float t = float(fx & 0xffff) * (1.0f/65536.0f);
+
+			Vec3 mapped;
+			mapped.x = curveR[index] + t*(curveR[index+1] - curveR[index]);
+			mapped.y = curveG[index] + t*(curveG[index+1] - curveG[index]);
+			mapped.z = curveB[index] + t*(curveB[index+1] - curveB[index]);
+
+			dst[i] = FilmicColorGrading::ApplyToneMapRatio(mapped,coords[i],keys[i]);
+		}
+	}
+	else
+	{
+		ApplySpacingInvValues(coords[0].m_data,count*3,params.m_spacing);
+
+		for (int i = 0; i < count; i++)
+		{
+			Vec3 rgb;
+			rgb.x = SampleTableFixed(curveR,fixedScale,maxFixed,coords[i].x);
+			rgb.y = SampleTableFixed(curveG,fixedScale,maxFixed,coords[i].y);
+			rgb.z = SampleTableFixed(curveB,fixedScale,maxFixed,coords[i].z);
+			dst[i] = rgb;
+		}
+	}
+
+	if (params.m_outputEncoding != FilmicColorGrading::kOutputEncoding_None)
+		FilmicColorGrading::EncodeValuesFast(dst[0].m_data,count*3,params.m_outputEncoding,params.m_outputPeakNits);
+}
+
+// The flat integer and cached entry points are single row views, ProcessViewBlocks() splits the row into chunks
+void FilmicColorGrading::EvalImageU8(Vec3 * dstImage, const unsigned char * srcImage, int numPixels, int srcNumChannels, const IntegerDecode & decode, const BakedParams & params, int numThreads)
+{
+	ASSERT_ALWAYS(decode.m_bitDepth == 8);
+
+	ImageView dstView = ImageView::MakeInterleaved(dstImage,numPixels,1,3,ImageView::kSampleType_Float);
+	ImageView srcView = ImageView::MakeInterleaved(const_cast < unsigned char * >(srcImage),numPixels,1,srcNumChannels,ImageView::kSampleType_U8);
+	EvalImageView(dstView,srcView,params,&decode,numThreads);
+}
+
+void FilmicColorGrading::EvalImageU16(Vec3 * dstImage, const unsigned short * srcImage, int numPixels, int srcNumChannels, const IntegerDecode & decode, const BakedParams & params, int numThreads)
+{
+	ASSERT_ALWAYS(decode.m_bitDepth == 16);
+
+	ImageView dstView = ImageView::MakeInterleaved(dstImage,numPixels,1,3,ImageView::kSampleType_Float);
+	ImageView srcView = ImageView::MakeInterleaved(const_cast < unsigned short * >(srcImage),numPixels,1,srcNumChannels,ImageView::kSampleType_U16);
+	EvalImageView(dstView,srcView,params,&decode,numThreads);
+}
+
+struct ColorCacheEntry
+{
+	unsigned int m_key[3];
+	Vec3 m_value;
+};
+
+static inline unsigned int HashColorBits(unsigned int r, unsigned int g, unsigned int b)
+{
+	unsigned int h = r*0x9E3779B1u ^ g*0x85EBCA77u ^ b*0xC2B2AE3Du;
+	return h ^ (h >> 15);
+}
+
+void FilmicColorGrading::EvalImageCached(Vec3 * dstImage, const Vec3 * srcImage, int numPixels, const BakedParams & params, int cacheSizeLog2, ColorCacheStats * stats, int numThreads)
+{
+	ImageView dstView = ImageView::MakeInterleaved(dstImage,numPixels,1,3,ImageView::kSampleType_Float);
+	ImageView srcView = ImageView::MakeInterleaved(const_cast < Vec3 * >(srcImage),numPixels,1,3,ImageView::kSampleType_Float);
+	EvalImageCachedView(dstView,srcView,params,NULL,cacheSizeLog2,stats,numThreads);
+}
+
+// segments in YCbCrDecode::m_transferTable
+static const int s_transferTableSegments = 4096;
+
+void FilmicColorGrading::BuildYCbCrDecode(YCbCrDecode & dstDecode, int bitDepth, eYCbCrMatrix matrix, bool fullRange, eInputDecoding decoding, float inputScale)
+{
+	ASSERT_ALWAYS(bitDepth == 8 || bitDepth == 10);
+
+	dstDecode.Reset();
+	dstDecode.m_bitDepth = bitDepth;
+	dstDecode.m_matrix = matrix;
+	dstDecode.m_fullRange = fullRange;
+	dstDecode.m_decoding = decoding;
+	dstDecode.m_inputScale = inputScale;
+
+	if (matrix == kYCbCrMatrix_Rec2020)
+	{
+		dstDecode.m_kr = 0.2627f;
+		dstDecode.m_kb = 0.0593f;
+	}
+	else
+	{
+		dstDecode.m_kr = 0.2126f;
+		dstDecode.m_kb = 0.0722f;
+	}
+
+	int numCodes = 1 << bitDepth;
+	float codeScale = float(1 << (bitDepth - 8));
+
+	dstDecode.m_maxCode = numCodes - 1;
+	if (fullRange)
+	{
+		dstDecode.m_lumaScale = float(numCodes - 1);
+		dstDecode.m_lumaOffset = 0.0f;
+		dstDecode.m_chromaScale = float(numCodes - 1);
+		dstDecode.m_chromaOffset = float(numCodes/2);
+	}
+	else
+	{
+		dstDecode.m_lumaScale = 219.0f*codeScale;
+		dstDecode.m_lumaOffset = 16.0f*codeScale;
+		dstDecode.m_chromaScale = 224.0f*codeScale;
+		dstDecode.m_chromaOffset = 128.0f*codeScale;
+	}
+
+	dstDecode.m_lumaTable.resize(numCodes);
+	dstDecode.m_chromaTable.resize(numCodes);
+	for (int i = 0; i < numCodes; i++)
+	{
+		dstDecode.m_lumaTable[i] = (float(i) - dstDecode.m_lumaOffset)/dstDecode.m_lumaScale;
+		dstDecode.m_chromaTable[i] = (float(i) - dstDecode.m_chromaOffset)/dstDecode.m_chromaScale;
+	}
+
+	dstDecode.m_transferTable.resize(s_transferTableSegments + 1);
+	for (int i = 0; i <= s_transferTableSegments; i++)
+		dstDecode.m_transferTable[i] = DecodeInput(float(i)/float(s_transferTableSegments),decoding) * inputScale;
+}
+
+static inline float SampleTransferTable(const float * table, float v)
+{
+	float x = Saturate(v) * float(s_transferTableSegments);
+	int index = MinInt((int)x,s_transferTableSegments-1);
+	float t = x - float(index);
+	return table[index] + t*(table[index+1] - table[index]);
+}
+
+static inline int ReadLumaCode(const FilmicColorGrading::YCbCrFrame & frame, int x, int y)
+{
+	const unsigned char * row = (const unsigned char *)frame.m_planes[0] + (size_t)y*frame.m_pitches[0];
+	if (frame.m_layout == FilmicColorGrading::kYCbCrLayout_P010)
+		return ((const unsigned short *)row)[x] >> 6;
+	return row[x];
+}
+
+static inline void WriteLumaCode(const FilmicColorGrading::YCbCrFrame & frame, int x, int y, int code)
+{
+	unsigned char * row = (unsigned char *)frame.m_planes[0] + (size_t)y*frame.m_pitches[0];
+	if (frame.m_layout == FilmicColorGrading::kYCbCrLayout_P010)
+		((unsigned short *)row)[x] = (unsigned short)(code << 6);
+	else
+		row[x] = (unsigned char)code;
+}
+
+static inline void ReadChromaCodes(const FilmicColorGrading::YCbCrFrame & frame, int cx, int cy, int & cb, int & cr)
+{
+	if (frame.m_layout == FilmicColorGrading::kYCbCrLayout_I420)
+	{
+		cb = ((const unsigned char *)frame.m_planes[1] + (size_t)cy*frame.m_pitches[1])[cx];
+		cr = ((const unsigned char *)frame.m_planes[2] + (size_t)cy*frame.m_pitches[2])[cx];
+		return;
+	}
+
+	const unsigned char * row = (const unsigned char *)frame.m_planes[1] + (size_t)cy*frame.m_pitches[1];
+	if (frame.m_layout == FilmicColorGrading::kYCbCrLayout_P010)
+	{
+		cb = ((const unsigned short *)row)[cx*2+0] >> 6;
+		cr = ((const unsigned short *)row)[cx*2+1] >> 6;
+	}
+	else
+	{
+		cb = row[cx*2+0];
+		cr = row[cx*2+1];
+	}
+}
+
+static inline void WriteChromaCodes(const FilmicColorGrading::YCbCrFrame & frame, int cx, int cy, int cb, int cr)
+{
+	if (frame.m_layout == FilmicColorGrading::kYCbCrLayout_I420)
+	{
+		((unsigned char *)frame.m_planes[1] + (size_t)cy*frame.m_pitches[1])[cx] = (unsigned char)cb;
+		((unsigned char *)frame.m_planes[2] + (size_t)cy*frame.m_pitches[2])[cx] = (unsigned char)cr;
+		return;
+	}
+
+	unsigned char * row = (unsigned char *)frame.m_planes[1] + (size_t)cy*frame.m_pitches[1];
+	if (frame.m_layout == FilmicColorGrading::kYCbCrLayout_P010)
+	{
+		((unsigned short *)row)[cx*2+0] = (unsigned short)(cb << 6);
+		((unsigned short *)row)[cx*2+1] = (unsigned short)(cr << 6);
+	}
+	else
+	{
+		row[cx*2+0] = (unsigned char)cb;
+		row[cx*2+1] = (unsigned char)cr;
+	}
+}
 
+static inline int QuantizeCode(float v, int maxCode)
+{
+	return MaxInt(0,MinInt((int)(v + 0.5f),maxCode));
+}
 
+void FilmicColorGrading::EvalImageYCbCr(const YCbCrFrame & dstFrame, const YCbCrFrame & srcFrame, const YCbCrDecode & decode, const BakedParams & params, int numThreads)
+{
+	ASSERT_ALWAYS(dstFrame.m_layout == srcFrame.m_layout);
+	ASSERT_ALWAYS(dstFrame.m_width == srcFrame.m_width && dstFrame.m_height == srcFrame.m_height);
+	ASSERT_ALWAYS(decode.m_bitDepth == ((srcFrame.m_layout == kYCbCrLayout_P010) ? 10 : 8));
+
+	const int width = srcFrame.m_width;
+	const int height = srcFrame.m_height;
+	const int chromaWidth = (width + 1)/2;
+	const int chromaHeight = (height + 1)/2;
+
+	const float kr = decode.m_kr;
+	const float kb = decode.m_kb;
+	const float kg = 1.0f - kr - kb;
+
+	// R' = Y' + crToR*Cr, G' = Y' + cbToG*Cb + crToG*Cr, B' = Y' + cbToB*Cb
+	const float crToR = 2.0f*(1.0f - kr);
+	const float cbToB = 2.0f*(1.0f - kb);
+	const float cbToG = -cbToB*kb/kg;
+	const float crToG = -crToR*kr/kg;
+
+	const float * lumaTable = &decode.m_lumaTable[0];
+	const float * chromaTable = &decode.m_chromaTable[0];
+	const float * transferTable = &decode.m_transferTable[0];
+	const Mat33 colorMatrix = params.m_colorMatrix;
+
+	// one pixel block per chunk of quads
+	const int quadsPerChunk = s_evalBlockSize/4;
+
+	ParallelUtil::ParallelForBlocks(chromaHeight,1,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		PROFILE_ZONE("EvalImageYCbCr");
+		Vec3 coords[s_evalBlockSize];
+		Vec3 graded[s_evalBlockSize];
 
+		for (int cy = begin; cy < end; cy++)
+		{
+			int py[2] = { 2*cy, MinInt(2*cy+1,height-1) };
+
+			for (int chunkBegin = 0; chunkBegin < chromaWidth; chunkBegin += quadsPerChunk)
+			{
+				int chunkEnd = MinInt(chunkBegin + quadsPerChunk,chromaWidth);
+
+				// Read the whole chunk before writing any of it, so the frames can be the same. Quads on odd edges
+				// repeat the last row/column.
+				for (int cx = chunkBegin; cx < chunkEnd; cx++)
+				{
+					int cb, cr;
+					ReadChromaCodes(srcFrame,cx,cy,cb,cr);
+					float cbNorm = chromaTable[cb];
+					float crNorm = chromaTable[cr];
+
+					float offsetR = crToR*crNorm;
+					float offsetG = cbToG*cbNorm + crToG*crNorm;
+					float offsetB = cbToB*cbNorm;
+
+					int px[2] = { 2*cx, MinInt(2*cx+1,width-1) };
+					Vec3 * quadCoords = coords + (cx - chunkBegin)*4;
+					for (int i = 0; i < 4; i++)
+					{
+						float luma = lumaTable[ReadLumaCode(srcFrame,px[i & 1],py[i >> 1])];
+
+						Vec3 lin;
+						lin.x = SampleTransferTable(transferTable,luma + offsetR);
+						lin.y = SampleTransferTable(transferTable,luma + offsetG);
+						lin.z = SampleTransferTable(transferTable,luma + offsetB);
+						quadCoords[i] = colorMatrix * lin;
+					}
+				}
+
+				EvalBlockFromLinear(graded,coords,(chunkEnd - chunkBegin)*4,params);
+
+				for (int cx = chunkBegin; cx < chunkEnd; cx++)
+				{
+					int px[2] = { 2*cx, MinInt(2*cx+1,width-1) };
+					const Vec3 * quadGraded = graded + (cx - chunkBegin)*4;
+
+					Vec3 sum = Vec3(0.0f);
+					for (int i = 0; i < 4; i++)
+					{
+						Vec3 rgb = quadGraded[i];
+						float luma = kr*rgb.x + kg*rgb.y + kb*rgb.z;
+						WriteLumaCode(dstFrame,px[i & 1],py[i >> 1],QuantizeCode(luma*decode.m_lumaScale + decode.m_lumaOffset,decode.m_maxCode));
+						sum = sum + rgb;
+					}
+
+					Vec3 avg = sum * 0.25f;
+					float avgLuma = kr*avg.x + kg*avg.y + kb*avg.z;
+					float cb = (avg.z - avgLuma)/cbToB;
+					float cr = (avg.x - avgLuma)/crToR;
+					WriteChromaCodes(dstFrame,cx,cy,
+						QuantizeCode(cb*decode.m_chromaScale + decode.m_chromaOffset,decode.m_maxCode),
+						QuantizeCode(cr*decode.m_chromaScale + decode.m_chromaOffset,decode.m_maxCode));
+				}
+			}
+		}
+	});
+}
 
+// interleaved float RGB without alpha is laid out like Vec3, so rows can be copied straight in and out
+static bool IsPackedFloatRgb(const ImageView & view)
+{
+	return view.m_sampleType == ImageView::kSampleType_Float && !view.HasAlpha() &&
+		view.m_pixelStride == sizeof(Vec3) && view.m_channelStride == sizeof(float);
+}
 
+// Reads count pixels of a row as linear values. Integer samples go through decodeTable, or are normalized if there
+// is none. 8 bit views can use the IntegerDecode channel tables instead, which also apply the color matrix. alpha is
+// optional and always normalized.
+static void ReadViewPixels(Vec3 * dst, float * alpha, const ImageView & view, int x, int y, int count, const float * decodeTable, const Vec3 * const * channelTables)
+{
+	const ptrdiff_t stride = view.m_pixelStride;
+	if (IsPackedFloatRgb(view))
+	{
+		memmove(dst,view.GetSamplePtr(x,y,0),count*sizeof(Vec3));
+	}
+	else if (channelTables != NULL)
+	{
+		const ptrdiff_t channelStride = view.m_channelStride;
+		const unsigned char * src = view.GetSamplePtr(x,y,0);
+		for (int i = 0; i < count; i++)
+		{
+			const unsigned char * pixel = src + i*stride;
+			dst[i] = channelTables[0][pixel[0]] + channelTables[1][pixel[channelStride]] + channelTables[2][pixel[2*channelStride]];
+		}
+	}
+
+	for (int c = 0; c < 3 && channelTables == NULL && !IsPackedFloatRgb(view); c++)
+	{
+		const unsigned char * src = view.GetSamplePtr(x,y,c);
+		if (view.m_sampleType == ImageView::kSampleType_Float)
+		{
+			for (int i = 0; i < count; i++)
+				dst[i].m_data[c] = *(const float *)(src + i*stride);
+		}
+		else if (view.m_sampleType == ImageView::kSampleType_U8)
+		{
+			for (int i = 0; i < count; i++)
+			{
+				int code = src[i*stride];
+				dst[i].m_data[c] = decodeTable ? decodeTable[code] : float(code)*(1.0f/255.0f);
+			}
+		}
+		else
+		{
+			for (int i = 0; i < count; i++)
+			{
+				int code = *(const unsigned short *)(src + i*stride);
+				dst[i].m_data[c] = decodeTable ? decodeTable[code] : float(code)*(1.0f/65535.0f);
+			}
+		}
+	}
+
+	if (alpha == NULL)
+		return;
+
+	if (!view.HasAlpha())
+	{
+		for (int i = 0; i < count; i++)
+			alpha[i] = 1.0f;
+		return;
+	}
+
+	const unsigned char * src = view.GetSamplePtr(x,y,3);
+	for (int i = 0; i < count; i++)
+	{
+		if (view.m_sampleType == ImageView::kSampleType_Float)
+			alpha[i] = *(const float *)(src + i*stride);
+		else if (view.m_sampleType == ImageView::kSampleType_U8)
+			alpha[i] = float(src[i*stride])*(1.0f/255.0f);
+		else
+			alpha[i] = float(*(const unsigned short *)(src + i*stride))*(1.0f/65535.0f);
+	}
+}
+
+static void WriteViewSamples(const ImageView & view, int x, int y, int c, int count, const float * values, int valueStride)
+{
+	const ptrdiff_t stride = view.m_pixelStride;
+	unsigned char * dst = view.GetSamplePtr(x,y,c);
+	if (view.m_sampleType == ImageView::kSampleType_Float)
+	{
+		for (int i = 0; i < count; i++)
+			*(float *)(dst + i*stride) = values[i*valueStride];
+	}
+	else if (view.m_sampleType == ImageView::kSampleType_U8)
+	{
+		for (int i = 0; i < count; i++)
+			dst[i*stride] = (unsigned char)QuantizeCode(Saturate(values[i*valueStride])*255.0f,255);
+	}
+	else
+	{
+		for (int i = 0; i < count; i++)
+			*(unsigned short *)(dst + i*stride) = (unsigned short)QuantizeCode(Saturate(values[i*valueStride])*65535.0f,65535);
+	}
+}
+
+static void WriteViewPixels(const ImageView & view, int x, int y, int count, const Vec3 * src, const float * alpha)
+{
+	if (IsPackedFloatRgb(view))
+	{
+		memmove(view.GetSamplePtr(x,y,0),src,count*sizeof(Vec3));
+		return;
+	}
+
+	for (int c = 0; c < 3; c++)
+		WriteViewSamples(view,x,y,c,count,&src[0].m_data[c],sizeof(Vec3)/sizeof(float));
+
+	if (view.HasAlpha())
+		WriteViewSamples(view,x,y,3,count,alpha,1);
+}
+
+static const float * GetViewDecodeTable(const ImageView & view, const FilmicColorGrading::IntegerDecode * decode)
+{
+	if (view.m_sampleType == ImageView::kSampleType_Float || decode == NULL)
+		return NULL;
+
+	ASSERT_ALWAYS(decode->m_bitDepth == ((view.m_sampleType == ImageView::kSampleType_U8) ? 8 : 16));
+	return &decode->m_decodeTable[0];
+}
+
+// Runs func(threadIndex, block, count) on every row chunk of the view, between reading from srcView and writing to
+// dstView. The chunks are split across threads, so a single long row still uses all of them. Each chunk is read
+// completely before it's written, so the views can be the same.
+template <typename BlockFunc>
+static void ProcessViewBlocks(const ImageView & dstView, const ImageView & srcView, const float * decodeTable, const Vec3 * const * channelTables, int numThreads, BlockFunc func)
+{
+	ASSERT_ALWAYS(dstView.m_width == srcView.m_width && dstView.m_height == srcView.m_height);
+
+	const int width = srcView.m_width;
+	const int chunksPerRow = ParallelUtil::CalcNumBlocks(width,s_evalBlockSize);
+	ParallelUtil::ParallelForBlocks(chunksPerRow*srcView.m_height,1,numThreads,[&](int threadIndex, int begin, int end)
+	{
+		Vec3 block[s_evalBlockSize];
+		float alpha[s_evalBlockSize];
+
+		for (int chunk = begin; chunk < end; chunk++)
+		{
+			int y = chunk / chunksPerRow;
+			int x = (chunk % chunksPerRow) * s_evalBlockSize;
+			int count = MinInt(s_evalBlockSize,width - x);
+			ReadViewPixels(block,dstView.HasAlpha() ? alpha : NULL,srcView,x,y,count,decodeTable,channelTables);
+			func(threadIndex,block,count);
+			WriteViewPixels(dstView,x,y,count,block,alpha);
+		}
+	});
+}
+
+void FilmicColorGrading::EvalImageView(const ImageView & dstView, const ImageView & srcView, const BakedParams & params, const IntegerDecode * decode, int numThreads)
+{
+	const float * decodeTable = GetViewDecodeTable(srcView,decode);
+	const Mat33 colorMatrix = params.m_colorMatrix;
+
+	// 8 bit sources use the tables with the matrix folded in, so the decode and the matrix are three lookups
+	const Vec3 * channelTables[3] = { NULL, NULL, NULL };
+	bool useChannelTables = (decodeTable != NULL && srcView.m_sampleType == ImageView::kSampleType_U8 && !decode->m_channelTables[0].empty());
+	if (useChannelTables)
+	{
+		ASSERT_ALWAYS(memcmp(decode->m_colorMatrix.m_data,colorMatrix.m_data,sizeof(colorMatrix.m_data)) == 0);
+		for (int c = 0; c < 3; c++)
+			channelTables[c] = &decode->m_channelTables[c][0];
+	}
+
+	ProcessViewBlocks(dstView,srcView,decodeTable,useChannelTables ? channelTables : NULL,numThreads,[&](int /*threadIndex*/, Vec3 * block, int count)
+	{
+		PROFILE_ZONE("EvalImageView");
+		Vec3 coords[s_evalBlockSize];
+		if (useChannelTables)
+		{
+			for (int i = 0; i < count; i++)
+				coords[i] = block[i];
+		}
+		else
+		{
+			for (int i = 0; i < count; i++)
+				coords[i] = colorMatrix * block[i];
+		}
+		EvalBlockFromLinear(block,coords,count,params);
+	});
+}
+
+void FilmicColorGrading::EvalImageFullView(const ImageView & dstView, const ImageView & srcView, const EvalParams & params, const IntegerDecode * decode, int numThreads)
+{
+	const float * decodeTable = GetViewDecodeTable(srcView,decode);
+	EvalBlockStagesFunc evalBlock = GetEvalBlockStagesFunc(params);
+
+	ProcessViewBlocks(dstView,srcView,decodeTable,NULL,numThreads,[&](int /*threadIndex*/, Vec3 * block, int count)
+	{
+		evalBlock(block,count,params);
+	});
+}
+
+void FilmicColorGrading::EvalImageCachedView(const ImageView & dstView, const ImageView & srcView, const BakedParams & params, const IntegerDecode * decode, int cacheSizeLog2, ColorCacheStats * stats, int numThreads)
+{
+	const float * decodeTable = GetViewDecodeTable(srcView,decode);
+
+	cacheSizeLog2 = MaxInt(1,MinInt(cacheSizeLog2,20));
+	int cacheSize = 1 << cacheSizeLog2;
+	unsigned int cacheMask = (unsigned int)(cacheSize-1);
+
+	numThreads = ParallelUtil::ResolveNumThreads(numThreads);
+
+	// Every entry starts out as black -> EvalColor(black), so there is no need for a valid flag.
+	ColorCacheEntry emptyEntry;
+	emptyEntry.m_key[0] = emptyEntry.m_key[1] = emptyEntry.m_key[2] = FloatAsInt(0.0f);
+	emptyEntry.m_value = params.EvalColor(Vec3(0.0f));
+
+	// caches are only filled for the threads that actually run
+	std::vector < std::vector < ColorCacheEntry > > caches(numThreads);
+	std::vector < long long > threadHits(numThreads,0);
+
+	ProcessViewBlocks(dstView,srcView,decodeTable,NULL,numThreads,[&](int threadIndex, Vec3 * block, int count)
+	{
+		PROFILE_ZONE("EvalImageCached");
+		std::vector < ColorCacheEntry > & cache = caches[threadIndex];
+		if (cache.empty())
+			cache.assign(cacheSize,emptyEntry);
+
+		ColorCacheEntry * entries = &cache[0];
+		long long numHits = 0;
+
+		for (int i = 0; i < count; i++)
+		{
+			Vec3 color = block[i];
+			unsigned int r = FloatAsInt(color.x);
+			unsigned int g = FloatAsInt(color.y);
+			unsigned int b = FloatAsInt(color.z);
+
+			ColorCacheEntry & entry = entries[HashColorBits(r,g,b) & cacheMask];
+			if (entry.m_key[0] == r && entry.m_key[1] == g && entry.m_key[2] == b)
+			{
+				numHits++;
+			}
+			else
+			{
+				entry.m_key[0] = r;
+				entry.m_key[1] = g;
+				entry.m_key[2] = b;
+				entry.m_value = params.EvalColor(color);
+			}
+
+			block[i] = entry.m_value;
+		}
+
+		threadHits[threadIndex] += numHits;
+	});
+
+	if (stats != NULL)
+	{
+		stats->m_numLookups += (long long)srcView.m_width*srcView.m_height;
+		for (int i = 0; i < numThreads; i++)
+			stats->m_numHits += threadHits[i];
+	}
+}
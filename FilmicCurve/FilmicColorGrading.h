@@ -4,6 +4,8 @@
 
 #include <Vec3.h>
 #include <Vec4.h>
+#include <Mat33.h>
+#include <ImageView.h>
 
 #include "FilmicToneCurve.h"
 
@@ -11,6 +13,39 @@ class FilmicColorGrading
 {
 public:
 
+	// Encoding applied at the very end, after lift/gamma/gain. Display referred 1.0 maps to sRGB 1.0,
+	// or to m_outputPeakNits for PQ (SMPTE ST 2084).
+	enum eOutputEncoding
+	{
+		kOutputEncoding_None,
+		kOutputEncoding_sRGB,
+		kOutputEncoding_PQ,
+		kOutputEncoding_Num
+	};
+
+	// What goes through the tone curve. Per channel maps R, G and B separately, which desaturates and shifts the
+	// hue of bright saturated colors. The other modes map a single key (luminance or max(R,G,B)) and scale the RGB
+	// ratio by the result, which keeps the hue. Max RGB also never pushes a channel past 1.0.
+	enum eToneMapMode
+	{
+		kToneMapMode_PerChannel,
+		kToneMapMode_Luminance,
+		kToneMapMode_MaxRGB,
+		kToneMapMode_Num
+	};
+
+	// Stages that can be identity for a given grade. The eval kernels are templated on this mask, so a stage that
+	// is off costs nothing instead of a log2f/exp2f/powf per channel. Exposure is a multiply, so it always runs.
+	enum eStageFlags
+	{
+		kStage_Saturation = 1 << 0, // m_saturation != 1
+		kStage_Contrast = 1 << 1, // m_contrastStrength != 1
+		kStage_PostGamma = 1 << 2, // m_postGamma != 1
+		kStage_LiftGammaGain = 1 << 3, // off is still a saturate, which is what neutral lift/gamma/gain does
+		kStage_OutputEncoding = 1 << 4,
+		kStage_All = (1 << 5) - 1
+	};
+
 	struct UserParams
 	{
 		UserParams()
@@ -48,6 +83,10 @@ public:
 			m_midtoneOffset = 0.0f;
 			m_highlightOffset = 0.0f;
 
+			m_outputEncoding = kOutputEncoding_None;
+			m_outputPeakNits = 1000.0f;
+
+			m_toneMapMode = kToneMapMode_PerChannel;
 		}
 
 		Vec3 m_colorFilter;
@@ -76,6 +115,10 @@ public:
 		float m_midtoneOffset;
 		float m_highlightOffset;
 
+		eOutputEncoding m_outputEncoding;
+		float m_outputPeakNits; // only used by PQ
+
+		eToneMapMode m_toneMapMode;
 	};
 
 
@@ -107,6 +150,11 @@ public:
 
 			// final adjustment to image, after all other curves
 			m_postGamma = 1.0f;
+
+			m_outputEncoding = kOutputEncoding_None;
+			m_outputPeakNits = 1000.0f;
+
+			m_toneMapMode = kToneMapMode_PerChannel;
 		}
 
 		// color filter
@@ -136,6 +184,11 @@ public:
 		Vec3 m_gammaAdjust;
 		Vec3 m_gainAdjust;
 
+		// sRGB or PQ encoding, after everything else
+		eOutputEncoding m_outputEncoding;
+		float m_outputPeakNits;
+
+		eToneMapMode m_toneMapMode;
 	};
 
 	// modified version of the the raw params which has precalculated values
@@ -164,9 +217,19 @@ public:
 			m_liftAdjust = Vec3(0.0f);
 			m_invGammaAdjust = Vec3(1.0f); // note that we invert gamma to skip the divide, also convolves the final gamma into it
 			m_gainAdjust = Vec3(1.0f);
+
+			m_outputEncoding = kOutputEncoding_None;
+			m_outputPeakNits = 1000.0f;
+
+			m_toneMapMode = kToneMapMode_PerChannel;
+
+			m_stageMask = kStage_All;
 		}
 
-		// performs all of these calculations in order
+		// which stages are not identity, from the current values
+		int CalcStageMask() const;
+
+		// performs all of these calculations in order, skipping the stages not in m_stageMask
 		Vec3 EvalFullColor(Vec3 v) const;
 
 		Vec3 EvalExposure(Vec3 v) const;
@@ -176,6 +239,7 @@ public:
 		Vec3 EvalFilmicCurve(Vec3 v) const; // also converts from linear to gamma
 
 		Vec3 EvalLiftGammaGain(Vec3 v) const;
+		Vec3 EvalOutputEncoding(Vec3 v) const;
 
 		// bake color filter and exposure bias together
 		Vec3 m_linColorFilterExposure;
@@ -194,6 +258,15 @@ public:
 		Vec3 m_liftAdjust;
 		Vec3 m_invGammaAdjust; // note that we invert gamma to skip the divide, also convolves the final gamma into it
 		Vec3 m_gainAdjust;
+
+		eOutputEncoding m_outputEncoding;
+		float m_outputPeakNits;
+
+		eToneMapMode m_toneMapMode;
+
+		// Set by EvalFromRawParams(). If you change the values above by hand, set it again from CalcStageMask(),
+		// kStage_All is always safe.
+		int m_stageMask;
 	};
 
 	enum eTableSpacing
@@ -225,17 +298,45 @@ public:
 
 			m_spacing = kTableSpacing_Quadratic;
 			m_luminanceWeights = Vec3(.25f,.5f,.25f);
+
+			m_colorMatrix.InitIdentity();
+
+			m_outputEncoding = kOutputEncoding_None;
+			m_outputPeakNits = 1000.0f;
+
+			m_toneMapMode = kToneMapMode_PerChannel;
 		}
 
 		static float SampleTable(const std::vector < float > & curve, float x);
 		Vec3 EvalColor(const Vec3 x) const;
 
+		// EvalColor split in two: the linear part (color matrix and spacing inverse) returns normalized table
+		// coordinates, which only depend on m_colorMatrix and m_spacing, and the table lookups.
+		Vec3 EvalTableCoords(const Vec3 x) const;
+		Vec3 EvalTables(const Vec3 coords) const;
+		Vec3 EvalOutputEncoding(const Vec3 x) const;
+
+		// the key modes of EvalColor, without the output encoding
+		Vec3 EvalKeyToneMap(const Vec3 x) const;
+
+		// hash of everything that affects EvalColor(), to detect grade changes between frames
+		unsigned long long CalcHash() const;
+
+		// The spacing inverse is a power function, so if dst.m_colorMatrix is a uniform scale of src.m_colorMatrix
+		// (the usual case when only the curve params differ), dst coords = src coords * coordsScale.
+		// Returns false if the coords can't be shared.
+		static bool CalcSharedCoordsScale(float & coordsScale, const BakedParams & src, const BakedParams & dst);
+
 		// params
 		Vec3 m_linColorFilterExposure;
 		Vec3 m_luminanceWeights;
 
 		float m_saturation;
 
+		// All of the linear steps in one matrix: saturation * (color filter and exposure) * input color space.
+		// This is what EvalColor actually uses, the separate values above are kept for reference.
+		Mat33 m_colorMatrix;
+
 		int m_curveSize;
 
 		std::vector < float > m_curveR;
@@ -244,17 +345,254 @@ public:
 
 		eTableSpacing m_spacing;
 
+		// Encoding that is applied after the table lookups with the fast approximations. If the encoding was baked
+		// into the tables this is kOutputEncoding_None.
+		eOutputEncoding m_outputEncoding;
+		float m_outputPeakNits;
+
+		// With a key mode the tables are still one per channel (lift/gamma/gain is per channel), but all three are
+		// read at the same position, so there is one spacing inverse and one index calculation per pixel.
+		eToneMapMode m_toneMapMode;
+	};
+
+
+
+	// How integer source pixels are converted to linear values. Codes are normalized to [0,1] first.
+	enum eInputDecoding
+	{
+		kInputDecoding_Linear,
+		kInputDecoding_sRGB,
+		kInputDecoding_BT1886, // pure 2.4 gamma, the usual SDR video EOTF
+		kInputDecoding_PQ, // 1.0 is 10000 nits, use the input scale to bring it to scene exposure
+		kInputDecoding_Num
+	};
+
+	// Precomputed decode for 8 and 16 bit sources. For 8 bit sources the color matrix is folded into the tables,
+	// so each channel is a Vec3 table with m_colorMatrix column * decode(code), and the matrix multiply becomes
+	// three lookups and two adds. A 16 bit version of that would be 2.3MB, so 16 bit sources use a single 256KB
+	// decode table followed by the matrix.
+	struct IntegerDecode
+	{
+		IntegerDecode()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			m_bitDepth = 8;
+			m_decoding = kInputDecoding_Linear;
+			m_inputScale = 1.0f;
+			m_colorMatrix.InitIdentity();
+			for (int i = 0; i < 3; i++)
+				m_channelTables[i].clear();
+			m_decodeTable.clear();
+		}
+
+		int m_bitDepth;
+		eInputDecoding m_decoding;
+		float m_inputScale;
+		Mat33 m_colorMatrix; // the BakedParams matrix in m_channelTables, the 8 bit paths assert that it still matches
+
+		std::vector < Vec3 > m_channelTables[3]; // 8 bit only
+		std::vector < float > m_decodeTable; // code to linear, without the matrix
 	};
 
+	// 4:2:0 video layouts. I420 is three 8 bit planes, NV12 is an 8 bit luma plane and an interleaved CbCr plane,
+	// and P010 is the same as NV12 with 16 bit samples holding 10 bit codes in the high bits.
+	enum eYCbCrLayout
+	{
+		kYCbCrLayout_I420,
+		kYCbCrLayout_NV12,
+		kYCbCrLayout_P010,
+		kYCbCrLayout_Num
+	};
 
+	enum eYCbCrMatrix
+	{
+		kYCbCrMatrix_Rec709,
+		kYCbCrMatrix_Rec2020, // non-constant luminance
+		kYCbCrMatrix_Num
+	};
+
+	// Pointers into a frame, pitches are in bytes. NV12 and P010 use planes 0 (Y) and 1 (CbCr), I420 uses
+	// Y, Cb and Cr. The chroma planes are (width+1)/2 by (height+1)/2.
+	struct YCbCrFrame
+	{
+		YCbCrFrame()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			m_layout = kYCbCrLayout_NV12;
+			m_width = 0;
+			m_height = 0;
+			for (int i = 0; i < 3; i++)
+			{
+				m_planes[i] = NULL;
+				m_pitches[i] = 0;
+			}
+		}
+
+		eYCbCrLayout m_layout;
+		int m_width;
+		int m_height;
+		void * m_planes[3];
+		int m_pitches[3];
+	};
+
+	// Tables to go from YCbCr codes to linear input for the grade, and the constants to go back. Built by
+	// BuildYCbCrDecode().
+	struct YCbCrDecode
+	{
+		YCbCrDecode()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			m_bitDepth = 8;
+			m_matrix = kYCbCrMatrix_Rec709;
+			m_fullRange = false;
+			m_decoding = kInputDecoding_BT1886;
+			m_inputScale = 1.0f;
+
+			m_lumaTable.clear();
+			m_chromaTable.clear();
+			m_transferTable.clear();
+
+			m_kr = 0.0f;
+			m_kb = 0.0f;
+			m_lumaScale = 0.0f;
+			m_lumaOffset = 0.0f;
+			m_chromaScale = 0.0f;
+			m_chromaOffset = 0.0f;
+			m_maxCode = 0;
+		}
+
+		int m_bitDepth;
+		eYCbCrMatrix m_matrix;
+		bool m_fullRange;
+		eInputDecoding m_decoding;
+		float m_inputScale;
+
+		std::vector < float > m_lumaTable; // code to normalized Y'
+		std::vector < float > m_chromaTable; // code to normalized Cb or Cr in [-.5,.5]
+		std::vector < float > m_transferTable; // R'G'B' in [0,1] to linear, sampled with a lerp
+
+		// matrix weights and the encode side of the code range
+		float m_kr;
+		float m_kb;
+		float m_lumaScale;
+		float m_lumaOffset;
+		float m_chromaScale;
+		float m_chromaOffset;
+		int m_maxCode;
+	};
+
+	// hit rate of EvalImageCached()
+	struct ColorCacheStats
+	{
+		ColorCacheStats()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			m_numLookups = 0;
+			m_numHits = 0;
+		}
+
+		float GetHitRate() const
+		{
+			return m_numLookups > 0 ? float(double(m_numHits)/double(m_numLookups)) : 0.0f;
+		}
+
+		long long m_numLookups;
+		long long m_numHits;
+	};
 
 	static float ApplySpacing(float v, eTableSpacing spacing);
 	static float ApplySpacingInv(float v, eTableSpacing spacing);
 
 	static void RawFromUserParams(RawParams & rawParams, const UserParams & userParams);
 	static void EvalFromRawParams(EvalParams & dstParams, const RawParams & rawParams);
-	static void BakeFromEvalParams(BakedParams & dstCurve, const EvalParams & srcParams, const int curveSize, const eTableSpacing spacing);
+
+	// inputMatrix is an optional conversion from the source color space (i.e. camera space) to the working space
+	// of the grade. It gets folded into BakedParams::m_colorMatrix, so it's free at eval time.
+	// If bakeOutputEncoding is false, the sRGB/PQ encoding is evaluated per pixel after the lookups instead. That costs a
+	// bit more but avoids the table precision problems in the darks, where PQ is very steep. In the luminance and max
+	// RGB tone map modes the encoding has to come after the ratio scale, so it's never baked and bakeOutputEncoding is
+	// ignored. Check BakedParams::m_outputEncoding to see what the tables hold.
+	static void BakeFromEvalParams(BakedParams & dstCurve, const EvalParams & srcParams, const int curveSize, const eTableSpacing spacing, const Mat33 * inputMatrix = NULL, bool bakeOutputEncoding = true);
+
+	// grey + saturation*(v - grey) as a matrix
+	static Mat33 CalcSaturationMatrix(const Vec3 & luminanceWeights, float saturation);
+
+	// For the key tone map modes. The mapped key is per channel because of lift/gamma/gain. ApplyToneMapRatio returns
+	// saturate(mapped * rgb/key), and just the mapped value for keys around 0 so that lift still works on black.
+	static float CalcToneMapKey(const Vec3 & rgb, const Vec3 & luminanceWeights, eToneMapMode mode);
+	static Vec3 ApplyToneMapRatio(const Vec3 & mapped, const Vec3 & rgb, float key);
 
 	static float ApplyLiftInvGammaGain(const float lift, const float invGamma, const float gain, float v);
+
+	// exact encodings, used for baking and the unbaked path
+	static float EncodeSRGB(float v);
+	static float EncodePQ(float v, float peakNits);
+
+	// FastPow based versions, within about 1e-5 relative of the exact ones
+	static float EncodeSRGBFast(float v);
+	static float EncodePQFast(float v, float peakNits);
+
+	// applies the fast encoding to numValues floats in place, 4 at a time with SSE2
+	static void EncodeValuesFast(float * values, int numValues, eOutputEncoding encoding, float peakNits);
+
+	// Grades numPixels pixels from srcImage into dstImage with BakedParams::EvalColor. dstImage can be the same as srcImage.
+	static void EvalImage(Vec3 * dstImage, const Vec3 * srcImage, int numPixels, const BakedParams & params, int numThreads);
+
+	// Unbaked version of EvalImage(), same result as EvalFullColor() on each pixel. Runs one stage at a time over each
+	// block with a profile zone per stage, so it's also the way to see where the time goes in the full eval.
+	static void EvalImageFull(Vec3 * dstImage, const Vec3 * srcImage, int numPixels, const EvalParams & params, int numThreads);
+
+	// Grades one source image into numOutputs images (i.e. SDR and HDR versions of the same frame) in a single pass
+	// over the source. Outputs whose color matrices only differ by a scale also share the EvalTableCoords() work.
+	static void EvalImageMulti(Vec3 * const dstImages[], const BakedParams * const params[], int numOutputs, const Vec3 * srcImage, int numPixels, int numThreads);
+
+	// Same as EvalImage(), but each thread keeps a direct mapped cache of (1 << cacheSizeLog2) entries keyed on the exact
+	// bits of the input color. Meant for UI assets, overlays and other content with few unique colors, where most
+	// pixels turn into a hash and a compare. stats is optional, and is added to rather than reset.
+	static void EvalImageCached(Vec3 * dstImage, const Vec3 * srcImage, int numPixels, const BakedParams & params, int cacheSizeLog2, ColorCacheStats * stats, int numThreads);
+
+	// bitDepth is 8 or 16. The 8 bit tables depend on params.m_colorMatrix, so rebuild them when the params change.
+	// The decoded value is decode(code/maxCode) * inputScale.
+	static void BuildIntegerDecode(IntegerDecode & dstDecode, const BakedParams & params, int bitDepth, eInputDecoding decoding, float inputScale);
+
+	// Grade integer pixels directly. srcNumChannels is 3 (RGB) or 4 (RGBA, alpha is ignored).
+	static void EvalImageU8(Vec3 * dstImage, const unsigned char * srcImage, int numPixels, int srcNumChannels, const IntegerDecode & decode, const BakedParams & params, int numThreads);
+	static void EvalImageU16(Vec3 * dstImage, const unsigned short * srcImage, int numPixels, int srcNumChannels, const IntegerDecode & decode, const BakedParams & params, int numThreads);
+
+	// Grades image views of any layout (interleaved, planar, padded rows, float or integer samples). Integer sources
+	// are decoded with decode, which needs the same bit depth, or are just normalized if decode is NULL. Integer
+	// destinations get the graded values quantized. Alpha is passed through, or set to 1 if the source has none.
+	// dstView can be the same as srcView. EvalImageU8/U16() and EvalImageCached() go through these. EvalImageMulti()
+	// and EvalImageYCbCr() don't, since they share work between outputs or between the pixels of a 2x2 chroma quad.
+	static void EvalImageView(const ImageView & dstView, const ImageView & srcView, const BakedParams & params, const IntegerDecode * decode, int numThreads);
+	static void EvalImageFullView(const ImageView & dstView, const ImageView & srcView, const EvalParams & params, const IntegerDecode * decode, int numThreads);
+
+	// EvalImageCached() over views. The cache is keyed on the decoded source color.
+	static void EvalImageCachedView(const ImageView & dstView, const ImageView & srcView, const BakedParams & params, const IntegerDecode * decode, int cacheSizeLog2, ColorCacheStats * stats, int numThreads);
+
+	// bitDepth is 8 for I420/NV12 and 10 for P010. Limited range is 16-235 luma and 16-240 chroma (times 4 at 10 bit).
+	static void BuildYCbCrDecode(YCbCrDecode & dstDecode, int bitDepth, eYCbCrMatrix matrix, bool fullRange, eInputDecoding decoding, float inputScale);
+
+	// Grades a 4:2:0 frame and writes it back as YCbCr in one pass, without going through a float RGB frame. The
+	// graded output is treated as the display signal (R'G'B'), so the grade should include the display gamma or an
+	// output encoding. Each 2x2 quad shares its source chroma, and the output chroma is the average of the quad.
+	// Both frames need the same layout and size, and dstFrame can be the same as srcFrame.
+	static void EvalImageYCbCr(const YCbCrFrame & dstFrame, const YCbCrFrame & srcFrame, const YCbCrDecode & decode, const BakedParams & params, int numThreads);
 };
 
@@ -0,0 +1,606 @@
+#include "FilmicGradeMatch.h"
+
+#include <ParallelUtil.h>
+#include <SimdHelpers.h>
+
+static const int s_matchBlockSize = 256;
+
+float FilmicGradeMatch::GetMatchParam(const FilmicColorGrading::UserParams & userParams, int paramIndex)
+{
+	switch (paramIndex)
+	{
+	case kMatchParam_ExposureBias:		return userParams.m_exposureBias;
+	case kMatchParam_Contrast:			return userParams.m_contrast;
+	case kMatchParam_Saturation:		return userParams.m_saturation;
+	case kMatchParam_ToeStrength:		return userParams.m_filmicToeStrength;
+	case kMatchParam_ToeLength:			return userParams.m_filmicToeLength;
+	case kMatchParam_ShoulderStrength:	return userParams.m_filmicShoulderStrength;
+	case kMatchParam_ShoulderLength:	return userParams.m_filmicShoulderLength;
+	case kMatchParam_ShoulderAngle:		return userParams.m_filmicShoulderAngle;
+	case kMatchParam_ShadowR:			return userParams.m_shadowColor.x;
+	case kMatchParam_ShadowG:			return userParams.m_shadowColor.y;
+	case kMatchParam_ShadowB:			return userParams.m_shadowColor.z;
+	case kMatchParam_MidtoneR:			return userParams.m_midtoneColor.x;
+	case kMatchParam_MidtoneG:			return userParams.m_midtoneColor.y;
+	case kMatchParam_MidtoneB:			return userParams.m_midtoneColor.z;
+	case kMatchParam_HighlightR:		return userParams.m_highlightColor.x;
+	case kMatchParam_HighlightG:		return userParams.m_highlightColor.y;
+	case kMatchParam_HighlightB:		return userParams.m_highlightColor.z;
+	case kMatchParam_ShadowOffset:		return userParams.m_shadowOffset;
+	case kMatchParam_MidtoneOffset:		return userParams.m_midtoneOffset;
+	case kMatchParam_HighlightOffset:	return userParams.m_highlightOffset;
+	}
+
+	ASSERT_ALWAYS(0);
+	return 0.0f;
+}
+
+void FilmicGradeMatch::SetMatchParam(FilmicColorGrading::UserParams & userParams, int paramIndex, float val)
+{
+	switch (paramIndex)
+	{
+	case kMatchParam_ExposureBias:		userParams.m_exposureBias = val; break;
+	case kMatchParam_Contrast:			userParams.m_contrast = val; break;
+	case kMatchParam_Saturation:		userParams.m_saturation = val; break;
+	case kMatchParam_ToeStrength:		userParams.m_filmicToeStrength = val; break;
+	case kMatchParam_ToeLength:			userParams.m_filmicToeLength = val; break;
+	case kMatchParam_ShoulderStrength:	userParams.m_filmicShoulderStrength = val; break;
+	case kMatchParam_ShoulderLength:	userParams.m_filmicShoulderLength = val; break;
+	case kMatchParam_ShoulderAngle:		userParams.m_filmicShoulderAngle = val; break;
+	case kMatchParam_ShadowR:			userParams.m_shadowColor.x = val; break;
+	case kMatchParam_ShadowG:			userParams.m_shadowColor.y = val; break;
+	case kMatchParam_ShadowB:			userParams.m_shadowColor.z = val; break;
+	case kMatchParam_MidtoneR:			userParams.m_midtoneColor.x = val; break;
+	case kMatchParam_MidtoneG:			userParams.m_midtoneColor.y = val; break;
+	case kMatchParam_MidtoneB:			userParams.m_midtoneColor.z = val; break;
+	case kMatchParam_HighlightR:		userParams.m_highlightColor.x = val; break;
+	case kMatchParam_HighlightG:		userParams.m_highlightColor.y = val; break;
+	case kMatchParam_HighlightB:		userParams.m_highlightColor.z = val; break;
+	case kMatchParam_ShadowOffset:		userParams.m_shadowOffset = val; break;
+	case kMatchParam_MidtoneOffset:		userParams.m_midtoneOffset = val; break;
+	case kMatchParam_HighlightOffset:	userParams.m_highlightOffset = val; break;
+	default:
+		ASSERT_ALWAYS(0);
+	}
+}
+
+void FilmicGradeMatch::GetMatchParamRange(float & minVal, float & maxVal, int paramIndex)
+{
+	// These are wider than the UI sliders. The colors are relative to their channel average, so the
+	// ranges alone don't keep lift/gamma/gain valid, the solver also checks IsMatchValid().
+	switch (paramIndex)
+	{
+	case kMatchParam_ExposureBias:		minVal = -10.0f; maxVal = 10.0f; break;
+	case kMatchParam_Contrast:			minVal = 0.1f; maxVal = 4.0f; break;
+	case kMatchParam_Saturation:		minVal = 0.0f; maxVal = 4.0f; break;
+	case kMatchParam_ToeStrength:		minVal = 0.0f; maxVal = 1.0f; break;
+	case kMatchParam_ToeLength:			minVal = 0.0f; maxVal = 1.0f; break;
+	case kMatchParam_ShoulderStrength:	minVal = 0.0f; maxVal = 10.0f; break;
+	case kMatchParam_ShoulderLength:	minVal = 0.0f; maxVal = 1.0f; break;
+	case kMatchParam_ShoulderAngle:		minVal = 0.0f; maxVal = 1.0f; break;
+	case kMatchParam_ShadowOffset:		minVal = -0.4f; maxVal = 0.4f; break;
+	case kMatchParam_MidtoneOffset:		minVal = -0.4f; maxVal = 0.4f; break;
+	case kMatchParam_HighlightOffset:	minVal = -0.4f; maxVal = 0.4f; break;
+	default:
+		// shadow/midtone/highlight colors
+		minVal = 0.0f;
+		maxVal = 2.0f;
+		break;
+	}
+}
+
+bool FilmicGradeMatch::IsMatchValid(const FilmicColorGrading::UserParams & userParams)
+{
+	FilmicColorGrading::RawParams rawParams;
+	FilmicColorGrading::RawFromUserParams(rawParams,userParams);
+
+	// catches midGrey outside of (0,1) and lift above the midpoint or gain, NaNs fail the compare
+	for (int c = 0; c < 3; c++)
+	{
+		float gamma = rawParams.m_gammaAdjust.m_data[c];
+		if (!(gamma > 0.0f && gamma < 1e30f))
+			return false;
+	}
+	return true;
+}
+
+void FilmicGradeMatch::AddSamplesFromLut1D(std::vector < SamplePair > & dstSamples, const std::vector < Vec3 > & lut, float maxInput, FilmicColorGrading::eTableSpacing spacing)
+{
+	int lutSize = lut.size();
+	ASSERT_ALWAYS(lutSize >= 2);
+
+	for (int i = 0; i < lutSize; i++)
+	{
+		float t = float(i)/float(lutSize-1);
+		float x = FilmicColorGrading::ApplySpacing(t,spacing) * maxInput;
+		dstSamples.push_back(SamplePair(Vec3(x),lut[i],1.0f));
+	}
+}
+
+void FilmicGradeMatch::AddSamplesFromLut3D(std::vector < SamplePair > & dstSamples, const std::vector < Vec3 > & lut, int lutSize, float maxInput, FilmicColorGrading::eTableSpacing spacing)
+{
+	ASSERT_ALWAYS(lutSize >= 2);
+	ASSERT_ALWAYS(lut.size() == (size_t)lutSize*lutSize*lutSize);
+
+	std::vector < float > coords(lutSize);
+	for (int i = 0; i < lutSize; i++)
+	{
+		float t = float(i)/float(lutSize-1);
+		coords[i] = FilmicColorGrading::ApplySpacing(t,spacing) * maxInput;
+	}
+
+	for (int b = 0; b < lutSize; b++)
+	{
+		for (int g = 0; g < lutSize; g++)
+		{
+			for (int r = 0; r < lutSize; r++)
+			{
+				Vec3 src = Vec3(coords[r],coords[g],coords[b]);
+				dstSamples.push_back(SamplePair(src,lut[(b*lutSize+g)*lutSize+r],1.0f));
+			}
+		}
+	}
+}
+
+static void EvalFromUserParams(FilmicColorGrading::EvalParams & dstParams, const FilmicColorGrading::UserParams & userParams)
+{
+	FilmicColorGrading::RawParams rawParams;
+	FilmicColorGrading::RawFromUserParams(rawParams,userParams);
+	FilmicColorGrading::EvalFromRawParams(dstParams,rawParams);
+}
+
+// samples with a stride so that we don't have more than maxSamples
+static void GatherSamples(std::vector < FilmicGradeMatch::SamplePair > & dstSamples, const std::vector < FilmicGradeMatch::SamplePair > & srcSamples, int maxSamples)
+{
+	int numSrc = srcSamples.size();
+	if (maxSamples <= 0 || numSrc <= maxSamples)
+	{
+		dstSamples = srcSamples;
+		return;
+	}
+
+	dstSamples.resize(maxSamples);
+	for (int i = 0; i < maxSamples; i++)
+	{
+		int srcIndex = (int)(((long long)i * numSrc) / maxSamples);
+		dstSamples[i] = srcSamples[srcIndex];
+	}
+}
+
+// Weighted MSE per channel. Partial sums are stored per block and added in block order so that the
+// result doesn't depend on the thread count.
+static float CalcErrorEval(const std::vector < FilmicGradeMatch::SamplePair > & samples, const FilmicColorGrading::EvalParams & evalParams, int numThreads)
+{
+	int numSamples = samples.size();
+	if (numSamples == 0)
+		return 0.0f;
+
+	int numBlocks = ParallelUtil::CalcNumBlocks(numSamples,s_matchBlockSize);
+	std::vector < double > blockErr(numBlocks,0.0);
+	std::vector < double > blockWeight(numBlocks,0.0);
+
+	ParallelUtil::ParallelForBlocks(numSamples,s_matchBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		double err = 0.0;
+		double weight = 0.0;
+		for (int i = begin; i < end; i++)
+		{
+			const FilmicGradeMatch::SamplePair & sample = samples[i];
+			Vec3 diff = evalParams.EvalFullColor(sample.m_src) - sample.m_dst;
+			err += sample.m_weight * diff.LengthSqr();
+			weight += sample.m_weight;
+		}
+		blockErr[begin/s_matchBlockSize] = err;
+		blockWeight[begin/s_matchBlockSize] = weight;
+	});
+
+	double totalErr = 0.0;
+	double totalWeight = 0.0;
+	for (int i = 0; i < numBlocks; i++)
+	{
+		totalErr += blockErr[i];
+		totalWeight += blockWeight[i];
+	}
+
+	return (float)(totalErr / MaxFloat(1e-20f,(float)(3.0*totalWeight)));
+}
+
+float FilmicGradeMatch::CalcError(const std::vector < SamplePair > & samples, const FilmicColorGrading::UserParams & userParams, int numThreads)
+{
+	FilmicColorGrading::EvalParams evalParams;
+	EvalFromUserParams(evalParams,userParams);
+	return CalcErrorEval(samples,evalParams,numThreads);
+}
+
+// Solves A x = b with partial pivoting. A is n*n, row major, and is destroyed.
+static bool SolveLinearSystem(std::vector < double > & x, std::vector < double > & A, std::vector < double > & b, int n)
+{
+	for (int c = 0; c < n; c++)
+	{
+		int pivot = c;
+		for (int r = c+1; r < n; r++)
+		{
+			if (fabs(A[r*n+c]) > fabs(A[pivot*n+c]))
+				pivot = r;
+		}
+
+		if (fabs(A[pivot*n+c]) < 1e-30)
+			return false;
+
+		if (pivot != c)
+		{
+			for (int i = 0; i < n; i++)
+				Swap(A[c*n+i],A[pivot*n+i]);
+			Swap(b[c],b[pivot]);
+		}
+
+		double invDiag = 1.0 / A[c*n+c];
+		for (int r = c+1; r < n; r++)
+		{
+			double scale = A[r*n+c] * invDiag;
+			if (scale == 0.0)
+				continue;
+			for (int i = c; i < n; i++)
+				A[r*n+i] -= scale * A[c*n+i];
+			b[r] -= scale * b[c];
+		}
+	}
+
+	x.resize(n);
+	for (int r = n-1; r >= 0; r--)
+	{
+		double sum = b[r];
+		for (int i = r+1; i < n; i++)
+			sum -= A[r*n+i] * x[i];
+		x[r] = sum / A[r*n+r];
+	}
+
+	return true;
+}
+
+// SSE2 version of EvalParams::EvalFullColor() for 4 samples at a time, with the colors split into one register
+// per channel. It uses the FastLog2/FastExp2 polynomials in place of powf/logf/expf, so it's only used for the
+// Jacobian. The error is about 1e-6 (1e-5 with PQ) and nearly the same for the base and perturbed params, so
+// it mostly cancels in the differences. Steps are still accepted or rejected with the exact CalcError().
+static __m128 SimdSelectSegment(__m128 inToe, __m128 inLinear, float toeVal, float linearVal, float shoulderVal)
+{
+	return SimdSelect(inToe,_mm_set1_ps(toeVal),SimdSelect(inLinear,_mm_set1_ps(linearVal),_mm_set1_ps(shoulderVal)));
+}
+
+static __m128 SimdEvalFilmicCurve(const FilmicToneCurve::FullCurve & curve, __m128 x)
+{
+	const FilmicToneCurve::CurveSegment * segs = curve.m_segments;
+
+	__m128 normX = _mm_mul_ps(x,_mm_set1_ps(curve.m_invW));
+	__m128 inToe = _mm_cmplt_ps(normX,_mm_set1_ps(curve.m_x0));
+	__m128 inLinear = _mm_cmplt_ps(normX,_mm_set1_ps(curve.m_x1));
+
+	// the segments are e^(lnA + B*ln(x)), which is 2^(lnA*log2(e) + B*log2(x))
+	const float log2e = 1.44269504f;
+	__m128 offsetX = SimdSelectSegment(inToe,inLinear,segs[0].m_offsetX,segs[1].m_offsetX,segs[2].m_offsetX);
+	__m128 scaleX = SimdSelectSegment(inToe,inLinear,segs[0].m_scaleX,segs[1].m_scaleX,segs[2].m_scaleX);
+	__m128 log2A = SimdSelectSegment(inToe,inLinear,segs[0].m_lnA*log2e,segs[1].m_lnA*log2e,segs[2].m_lnA*log2e);
+	__m128 B = SimdSelectSegment(inToe,inLinear,segs[0].m_B,segs[1].m_B,segs[2].m_B);
+	__m128 scaleY = SimdSelectSegment(inToe,inLinear,segs[0].m_scaleY,segs[1].m_scaleY,segs[2].m_scaleY);
+	__m128 offsetY = SimdSelectSegment(inToe,inLinear,segs[0].m_offsetY,segs[1].m_offsetY,segs[2].m_offsetY);
+
+	__m128 x0 = _mm_mul_ps(_mm_sub_ps(normX,offsetX),scaleX);
+	__m128 y0 = SimdFastExp2(_mm_add_ps(log2A,_mm_mul_ps(B,SimdFastLog2(x0))));
+	y0 = _mm_and_ps(_mm_cmpgt_ps(x0,_mm_setzero_ps()),y0);
+
+	return _mm_add_ps(_mm_mul_ps(y0,scaleY),offsetY);
+}
+
+static __m128 SimdEvalLogContrast(const FilmicColorGrading::EvalParams & params, __m128 x)
+{
+	__m128 eps = _mm_set1_ps(params.m_contrastEpsilon);
+	__m128 logMidpoint = _mm_set1_ps(params.m_contrastLogMidpoint);
+
+	// Saturation above 1 can push a channel below 0, and log2f() makes those a NaN that the filmic curve then
+	// takes to the shoulder. Keep the NaN so that the base colors agree with CalcError().
+	__m128 biasedX = _mm_add_ps(x,eps);
+	__m128 logX = _mm_or_ps(SimdFastLog2(biasedX),_mm_cmplt_ps(biasedX,_mm_setzero_ps()));
+	__m128 adjX = _mm_add_ps(logMidpoint,_mm_mul_ps(_mm_sub_ps(logX,logMidpoint),_mm_set1_ps(params.m_contrastStrength)));
+	return _mm_max_ps(_mm_setzero_ps(),_mm_sub_ps(SimdFastExp2(adjX),eps));
+}
+
+static __m128 SimdEvalLiftGammaGain(const FilmicColorGrading::EvalParams & params, int c, __m128 v)
+{
+	__m128 lerpV = SimdClamp(SimdFastPow(v,_mm_set1_ps(params.m_invGammaAdjust.m_data[c])),0.0f,1.0f);
+	__m128 gain = _mm_mul_ps(_mm_set1_ps(params.m_gainAdjust.m_data[c]),lerpV);
+	__m128 lift = _mm_mul_ps(_mm_set1_ps(params.m_liftAdjust.m_data[c]),_mm_sub_ps(_mm_set1_ps(1.0f),lerpV));
+	return _mm_add_ps(gain,lift);
+}
+
+// contrast, filmic curve and post gamma, on one channel or on the key
+static __m128 SimdEvalToneStages(const FilmicColorGrading::EvalParams & params, __m128 v)
+{
+	if (params.m_stageMask & FilmicColorGrading::kStage_Contrast)
+		v = SimdEvalLogContrast(params,v);
+
+	v = SimdEvalFilmicCurve(params.m_filmicCurve,v);
+	if (params.m_stageMask & FilmicColorGrading::kStage_PostGamma)
+		v = SimdFastPow(v,_mm_set1_ps(params.m_postGamma));
+	return v;
+}
+
+static __m128 SimdEvalLiftGammaGainOrSaturate(const FilmicColorGrading::EvalParams & params, int c, __m128 v)
+{
+	if (params.m_stageMask & FilmicColorGrading::kStage_LiftGammaGain)
+		return SimdEvalLiftGammaGain(params,c,v);
+	return SimdClamp(v,0.0f,1.0f);
+}
+
+static __m128 SimdDotLuminance(const __m128 v[3], const Vec3 & luminanceWeights)
+{
+	__m128 ret = _mm_mul_ps(v[0],_mm_set1_ps(luminanceWeights.x));
+	ret = _mm_add_ps(ret,_mm_mul_ps(v[1],_mm_set1_ps(luminanceWeights.y)));
+	return _mm_add_ps(ret,_mm_mul_ps(v[2],_mm_set1_ps(luminanceWeights.z)));
+}
+
+static void SimdEvalFullColor(__m128 dst[3], const __m128 src[3], const FilmicColorGrading::EvalParams & params)
+{
+	__m128 v[3];
+	for (int c = 0; c < 3; c++)
+		v[c] = _mm_mul_ps(src[c],_mm_set1_ps(params.m_linColorFilterExposure.m_data[c]));
+
+	if (params.m_stageMask & FilmicColorGrading::kStage_Saturation)
+	{
+		__m128 grey = SimdDotLuminance(v,params.m_luminanceWeights);
+		__m128 saturation = _mm_set1_ps(params.m_saturation);
+		for (int c = 0; c < 3; c++)
+			v[c] = _mm_add_ps(grey,_mm_mul_ps(saturation,_mm_sub_ps(v[c],grey)));
+	}
+
+	if (params.m_toneMapMode == FilmicColorGrading::kToneMapMode_PerChannel)
+	{
+		for (int c = 0; c < 3; c++)
+			dst[c] = SimdEvalLiftGammaGainOrSaturate(params,c,SimdEvalToneStages(params,v[c]));
+	}
+	else
+	{
+		// same as CalcToneMapKey() and ApplyToneMapRatio(), the max with 0 also turns NaNs into 0
+		__m128 key;
+		if (params.m_toneMapMode == FilmicColorGrading::kToneMapMode_MaxRGB)
+			key = _mm_max_ps(v[0],_mm_max_ps(v[1],v[2]));
+		else
+			key = SimdDotLuminance(v,params.m_luminanceWeights);
+		key = _mm_max_ps(key,_mm_setzero_ps());
+
+		__m128 useRatio = _mm_cmpgt_ps(key,_mm_set1_ps(1e-10f));
+		__m128 invKey = _mm_div_ps(_mm_set1_ps(1.0f),SimdSelect(useRatio,key,_mm_set1_ps(1.0f)));
+
+		__m128 mappedKey = SimdEvalToneStages(params,key);
+		for (int c = 0; c < 3; c++)
+		{
+			__m128 mapped = SimdEvalLiftGammaGainOrSaturate(params,c,mappedKey);
+			__m128 ratio = SimdClamp(_mm_mul_ps(_mm_mul_ps(mapped,v[c]),invKey),0.0f,1.0f);
+			dst[c] = SimdSelect(useRatio,ratio,mapped);
+		}
+	}
+
+	if (params.m_stageMask & FilmicColorGrading::kStage_OutputEncoding)
+	{
+		float values[12];
+		for (int c = 0; c < 3; c++)
+			_mm_storeu_ps(values+c*4,dst[c]);
+		FilmicColorGrading::EncodeValuesFast(values,12,params.m_outputEncoding,params.m_outputPeakNits);
+		for (int c = 0; c < 3; c++)
+			dst[c] = _mm_loadu_ps(values+c*4);
+	}
+}
+
+FilmicGradeMatch::MatchResult FilmicGradeMatch::MatchUserParams(FilmicColorGrading::UserParams & userParams, const std::vector < SamplePair > & srcSamples, const MatchSettings & settings)
+{
+	MatchResult result;
+
+	std::vector < SamplePair > samples;
+	GatherSamples(samples,srcSamples,settings.m_maxSamples);
+
+	int numSamples = samples.size();
+	result.m_numSamples = numSamples;
+
+	std::vector < int > activeParams;
+	for (int i = 0; i < kMatchParam_Num; i++)
+	{
+		if (settings.m_paramMask & (1u << i))
+			activeParams.push_back(i);
+	}
+
+	int numParams = activeParams.size();
+	int numThreads = ParallelUtil::ResolveNumThreads(settings.m_numThreads);
+
+	result.m_initialError = CalcError(samples,userParams,numThreads);
+	result.m_finalError = result.m_initialError;
+
+	if (numSamples == 0 || numParams == 0 || !IsMatchValid(userParams))
+		return result;
+
+	// the layout of each block's partial sums: JtJ (n*n), then Jtr (n)
+	int blockStride = numParams*numParams + numParams;
+	int numBlocks = ParallelUtil::CalcNumBlocks(numSamples,s_matchBlockSize);
+	std::vector < double > blockSums(numBlocks*blockStride);
+
+	std::vector < FilmicColorGrading::EvalParams > perturbedParams(numParams);
+	std::vector < float > paramSteps(numParams);
+
+	std::vector < double > JtJ(numParams*numParams);
+	std::vector < double > Jtr(numParams);
+	std::vector < double > A(numParams*numParams);
+	std::vector < double > b(numParams);
+	std::vector < double > delta(numParams);
+
+	float currErr = result.m_initialError;
+	double damping = settings.m_initialDamping;
+
+	for (int iter = 0; iter < settings.m_maxIterations; iter++)
+	{
+		result.m_numIterations = iter+1;
+
+		FilmicColorGrading::EvalParams baseParams;
+		EvalFromUserParams(baseParams,userParams);
+
+		// Forward differences. Step downwards if we are at the top of the range or the step makes the
+		// grade invalid. If neither way works the param is held for this iteration.
+		for (int p = 0; p < numParams; p++)
+		{
+			int paramIndex = activeParams[p];
+			float minVal, maxVal;
+			GetMatchParamRange(minVal,maxVal,paramIndex);
+
+			float val = GetMatchParam(userParams,paramIndex);
+			float step = settings.m_finiteDiffStep * MaxFloat(1.0f,Abs(val));
+			if (val + step > maxVal)
+				step = -step;
+
+			FilmicColorGrading::UserParams perturbed = userParams;
+			SetMatchParam(perturbed,paramIndex,val+step);
+			if (!IsMatchValid(perturbed))
+			{
+				step = -step;
+				SetMatchParam(perturbed,paramIndex,val+step);
+				if (!IsMatchValid(perturbed))
+					step = 0.0f;
+			}
+
+			if (step != 0.0f)
+				EvalFromUserParams(perturbedParams[p],perturbed);
+			else
+				perturbedParams[p] = baseParams;
+			paramSteps[p] = step;
+		}
+
+		// Accumulate the normal equations. Samples are evaluated 4 at a time with the base params and every
+		// perturbed param set while they're still in cache.
+		ParallelUtil::ParallelForBlocks(numSamples,s_matchBlockSize,numThreads,[&](int /*threadIndex*/, int begin, int end)
+		{
+			double * dstJtJ = &blockSums[(begin/s_matchBlockSize)*blockStride];
+			double * dstJtr = dstJtJ + numParams*numParams;
+			for (int i = 0; i < blockStride; i++)
+				dstJtJ[i] = 0.0;
+
+			float jacobian[3][kMatchParam_Num][4];
+			float residual[3][4];
+
+			for (int s = begin; s < end; s += 4)
+			{
+				// the last group repeats its first sample in the unused lanes, and only the used lanes are accumulated
+				int numLanes = MinInt(4,end-s);
+				float src[3][4];
+				float dst[3][4];
+				for (int lane = 0; lane < 4; lane++)
+				{
+					const SamplePair & sample = samples[s + (lane < numLanes ? lane : 0)];
+					for (int c = 0; c < 3; c++)
+					{
+						src[c][lane] = sample.m_src.m_data[c];
+						dst[c][lane] = sample.m_dst.m_data[c];
+					}
+				}
+
+				__m128 simdSrc[3];
+				for (int c = 0; c < 3; c++)
+					simdSrc[c] = _mm_loadu_ps(src[c]);
+
+				__m128 base[3];
+				SimdEvalFullColor(base,simdSrc,baseParams);
+				for (int c = 0; c < 3; c++)
+					_mm_storeu_ps(residual[c],_mm_sub_ps(base[c],_mm_loadu_ps(dst[c])));
+
+				for (int p = 0; p < numParams; p++)
+				{
+					__m128 curr[3];
+					SimdEvalFullColor(curr,simdSrc,perturbedParams[p]);
+
+					__m128 invStep = _mm_set1_ps((paramSteps[p] != 0.0f) ? 1.0f/paramSteps[p] : 0.0f);
+					for (int c = 0; c < 3; c++)
+						_mm_storeu_ps(jacobian[c][p],_mm_mul_ps(_mm_sub_ps(curr[c],base[c]),invStep));
+				}
+
+				for (int lane = 0; lane < numLanes; lane++)
+				{
+					float weight = samples[s+lane].m_weight;
+					for (int c = 0; c < 3; c++)
+					{
+						float r = residual[c][lane];
+						for (int row = 0; row < numParams; row++)
+						{
+							float wJ = weight * jacobian[c][row][lane];
+							for (int col = row; col < numParams; col++)
+								dstJtJ[row*numParams+col] += wJ * jacobian[c][col][lane];
+							dstJtr[row] += wJ * r;
+						}
+					}
+				}
+			}
+		});
+
+		for (int i = 0; i < numParams*numParams; i++)
+			JtJ[i] = 0.0;
+		for (int i = 0; i < numParams; i++)
+			Jtr[i] = 0.0;
+
+		for (int block = 0; block < numBlocks; block++)
+		{
+			const double * srcJtJ = &blockSums[block*blockStride];
+			const double * srcJtr = srcJtJ + numParams*numParams;
+			for (int i = 0; i < numParams*numParams; i++)
+				JtJ[i] += srcJtJ[i];
+			for (int i = 0; i < numParams; i++)
+				Jtr[i] += srcJtr[i];
+		}
+
+		// only the upper triangle was accumulated
+		for (int row = 0; row < numParams; row++)
+			for (int col = 0; col < row; col++)
+				JtJ[row*numParams+col] = JtJ[col*numParams+row];
+
+		// Try steps with increasing damping until the error goes down.
+		bool accepted = false;
+		float prevErr = currErr;
+		while (!accepted && damping < 1e10)
+		{
+			A = JtJ;
+			for (int p = 0; p < numParams; p++)
+			{
+				A[p*numParams+p] += damping * (JtJ[p*numParams+p] + 1e-9);
+				b[p] = -Jtr[p];
+			}
+
+			if (SolveLinearSystem(delta,A,b,numParams))
+			{
+				FilmicColorGrading::UserParams candidate = userParams;
+				for (int p = 0; p < numParams; p++)
+				{
+					int paramIndex = activeParams[p];
+					float minVal, maxVal;
+					GetMatchParamRange(minVal,maxVal,paramIndex);
+
+					float val = GetMatchParam(userParams,paramIndex) + (float)delta[p];
+					SetMatchParam(candidate,paramIndex,MaxFloat(minVal,MinFloat(maxVal,val)));
+				}
+
+				// NaN errors fail the comparison, so bad steps get rejected too
+				float candidateErr = IsMatchValid(candidate) ? CalcError(samples,candidate,numThreads) : currErr;
+				if (candidateErr < currErr)
+				{
+					userParams = candidate;
+					currErr = candidateErr;
+					accepted = true;
+				}
+			}
+
+			damping = accepted ? MaxFloat(1e-7f,(float)(damping*0.3)) : damping*10.0;
+		}
+
+		if (!accepted)
+			break;
+
+		if (prevErr - currErr <= settings.m_relTolerance * prevErr)
+			break;
+	}
+
+	result.m_finalError = currErr;
+	return result;
+}
+
@@ -0,0 +1,148 @@
+#pragma once
+
+#include <CoreHelpers.h>
+
+#include <Vec3.h>
+
+#include "FilmicColorGrading.h"
+
+// Fits FilmicColorGrading::UserParams to a reference look, given either pairs of input/output colors
+// or a reference 1D/3D LUT. The solver is Levenberg-Marquardt on the squared error of EvalFullColor,
+// with the Jacobian built from forward differences. The base and all perturbed EvalParams are evaluated
+// 4 samples at a time with SSE2 in the same pass over the samples, and the samples are split into blocks
+// across threads. Steps are accepted with the exact scalar EvalFullColor.
+class FilmicGradeMatch
+{
+public:
+
+	// The user params that the solver is allowed to change. Note that the color wheels are normalized
+	// by their average in RawFromUserParams, so the RGB components and the offset are somewhat redundant.
+	// The damping term handles that fine, but you will usually get better behaved results by fitting
+	// either the colors or the offsets, not both.
+	enum eMatchParam
+	{
+		kMatchParam_ExposureBias,
+		kMatchParam_Contrast,
+		kMatchParam_Saturation,
+		kMatchParam_ToeStrength,
+		kMatchParam_ToeLength,
+		kMatchParam_ShoulderStrength,
+		kMatchParam_ShoulderLength,
+		kMatchParam_ShoulderAngle,
+		kMatchParam_ShadowR,
+		kMatchParam_ShadowG,
+		kMatchParam_ShadowB,
+		kMatchParam_MidtoneR,
+		kMatchParam_MidtoneG,
+		kMatchParam_MidtoneB,
+		kMatchParam_HighlightR,
+		kMatchParam_HighlightG,
+		kMatchParam_HighlightB,
+		kMatchParam_ShadowOffset,
+		kMatchParam_MidtoneOffset,
+		kMatchParam_HighlightOffset,
+		kMatchParam_Num
+	};
+
+	static const unsigned int kMatchMask_Exposure = (1u << kMatchParam_ExposureBias);
+	static const unsigned int kMatchMask_Contrast = (1u << kMatchParam_Contrast);
+	static const unsigned int kMatchMask_Saturation = (1u << kMatchParam_Saturation);
+	static const unsigned int kMatchMask_ToeShoulder =
+		(1u << kMatchParam_ToeStrength) | (1u << kMatchParam_ToeLength) |
+		(1u << kMatchParam_ShoulderStrength) | (1u << kMatchParam_ShoulderLength) | (1u << kMatchParam_ShoulderAngle);
+	static const unsigned int kMatchMask_LiftGammaGainColors =
+		(1u << kMatchParam_ShadowR) | (1u << kMatchParam_ShadowG) | (1u << kMatchParam_ShadowB) |
+		(1u << kMatchParam_MidtoneR) | (1u << kMatchParam_MidtoneG) | (1u << kMatchParam_MidtoneB) |
+		(1u << kMatchParam_HighlightR) | (1u << kMatchParam_HighlightG) | (1u << kMatchParam_HighlightB);
+	static const unsigned int kMatchMask_LiftGammaGainOffsets =
+		(1u << kMatchParam_ShadowOffset) | (1u << kMatchParam_MidtoneOffset) | (1u << kMatchParam_HighlightOffset);
+	static const unsigned int kMatchMask_Default =
+		kMatchMask_Exposure | kMatchMask_Contrast | kMatchMask_ToeShoulder | kMatchMask_LiftGammaGainColors;
+
+	struct SamplePair
+	{
+		SamplePair()
+		{
+			m_src = Vec3(0.0f);
+			m_dst = Vec3(0.0f);
+			m_weight = 1.0f;
+		}
+
+		SamplePair(Vec3 src, Vec3 dst, float weight)
+		{
+			m_src = src;
+			m_dst = dst;
+			m_weight = weight;
+		}
+
+		Vec3 m_src; // scene linear input
+		Vec3 m_dst; // graded output, in the same space as EvalFullColor returns
+		float m_weight;
+	};
+
+	struct MatchSettings
+	{
+		MatchSettings()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			m_paramMask = kMatchMask_Default;
+			m_maxIterations = 50;
+			m_relTolerance = 1e-5f;
+			m_finiteDiffStep = 1e-3f;
+			m_initialDamping = 1e-3f;
+			m_maxSamples = 8192;
+			m_numThreads = 0;
+		}
+
+		unsigned int m_paramMask; // bitmask of eMatchParam
+		int m_maxIterations;
+		float m_relTolerance; // stop when the relative error improvement drops below this
+		float m_finiteDiffStep;
+		float m_initialDamping;
+		int m_maxSamples; // larger sample sets are strided down to this many samples, 0 for no limit
+		int m_numThreads; // 0 for all hardware threads
+	};
+
+	struct MatchResult
+	{
+		MatchResult()
+		{
+			m_initialError = 0.0f;
+			m_finalError = 0.0f;
+			m_numIterations = 0;
+			m_numSamples = 0;
+		}
+
+		// weighted mean squared error per channel
+		float m_initialError;
+		float m_finalError;
+		int m_numIterations;
+		int m_numSamples;
+	};
+
+	static float GetMatchParam(const FilmicColorGrading::UserParams & userParams, int paramIndex);
+	static void SetMatchParam(FilmicColorGrading::UserParams & userParams, int paramIndex, float val);
+	static void GetMatchParamRange(float & minVal, float & maxVal, int paramIndex);
+
+	// False if the lift/gamma/gain colors and offsets give a midGrey outside of (0,1) or otherwise make
+	// RawFromUserParams produce a NaN or non-positive gamma. MatchUserParams never steps into those, and
+	// returns without iterating if it starts from one.
+	static bool IsMatchValid(const FilmicColorGrading::UserParams & userParams);
+
+	// Appends one sample per LUT entry. Lut coordinates in [0,1] are mapped to scene linear input via
+	// ApplySpacing(t,spacing) * maxInput, which is the same mapping BakeFromEvalParams uses.
+	static void AddSamplesFromLut1D(std::vector < SamplePair > & dstSamples, const std::vector < Vec3 > & lut, float maxInput, FilmicColorGrading::eTableSpacing spacing);
+
+	// 3D lut is stored with red changing fastest, then green, then blue.
+	static void AddSamplesFromLut3D(std::vector < SamplePair > & dstSamples, const std::vector < Vec3 > & lut, int lutSize, float maxInput, FilmicColorGrading::eTableSpacing spacing);
+
+	static float CalcError(const std::vector < SamplePair > & samples, const FilmicColorGrading::UserParams & userParams, int numThreads);
+
+	// userParams is both the initial guess and the result. Params not in the mask are left untouched.
+	static MatchResult MatchUserParams(FilmicColorGrading::UserParams & userParams, const std::vector < SamplePair > & samples, const MatchSettings & settings);
+};
+
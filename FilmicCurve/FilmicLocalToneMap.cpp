@@ -0,0 +1,227 @@
+#include "FilmicLocalToneMap.h"
+
+#include <ParallelUtil.h>
+#include <ProfileUtil.h>
+
+// smallest luminance we take the log of, well below m_logLumMin for any sane setting
+static const float s_minLum = 1.0f / (1024.0f*1024.0f*1024.0f);
+
+static float CalcLogLum(const Vec3 & rgb, const Vec3 & luminanceWeights)
+{
+	float lum = Vec3::Dot(rgb,luminanceWeights);
+	return FastLog2(MaxFloat(s_minLum,lum));
+}
+
+void FilmicLocalToneMap::BuildGrid(BilateralGrid & dstGrid, const Vec3 * srcImage, int width, int height, const Vec3 & luminanceWeights, const LocalParams & params, int numThreads)
+{
+	PROFILE_ZONE("BuildGrid");
+	int cellSize = MaxInt(1,params.m_gridCellSize);
+	float binStops = MaxFloat(1e-3f,params.m_binStops);
+
+	dstGrid.m_cellSize = cellSize;
+	dstGrid.m_sizeX = (width-1)/cellSize + 2;
+	dstGrid.m_sizeY = (height-1)/cellSize + 2;
+	dstGrid.m_sizeZ = MaxInt(2,(int)ceilf((params.m_logLumMax - params.m_logLumMin)/binStops) + 1);
+	dstGrid.m_logLumMin = params.m_logLumMin;
+	dstGrid.m_invBinStops = 1.0f / binStops;
+
+	int numCells = dstGrid.m_sizeX*dstGrid.m_sizeY*dstGrid.m_sizeZ;
+	dstGrid.m_sumLogLum.assign(numCells,0.0f);
+	dstGrid.m_weight.assign(numCells,0.0f);
+
+	int halfCell = cellSize/2;
+	float maxZ = float(dstGrid.m_sizeZ-1);
+
+	// Each pixel is splatted to its nearest cell, so every grid row owns a fixed range of image rows
+	// and the rows can be built in parallel without any atomics or per thread grids.
+	ParallelUtil::ParallelForBlocks(dstGrid.m_sizeY,1,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		std::vector < float > rowLogLum(width);
+
+		for (int gy = begin; gy < end; gy++)
+		{
+			int rowBegin = MaxInt(0,gy*cellSize - halfCell);
+			int rowEnd = MinInt(height,gy*cellSize + cellSize - halfCell);
+
+			float * dstSum = &dstGrid.m_sumLogLum[dstGrid.CellIndex(0,gy,0)];
+			float * dstWeight = &dstGrid.m_weight[dstGrid.CellIndex(0,gy,0)];
+
+			for (int py = rowBegin; py < rowEnd; py++)
+			{
+				// log in its own loop so it vectorizes, the splat is a scatter
+				const Vec3 * srcRow = srcImage + py*width;
+				for (int px = 0; px < width; px++)
+					rowLogLum[px] = CalcLogLum(srcRow[px],luminanceWeights);
+
+				for (int px = 0; px < width; px++)
+				{
+					float logLum = rowLogLum[px];
+					float z = MaxFloat(0.0f,MinFloat(maxZ,(logLum - dstGrid.m_logLumMin)*dstGrid.m_invBinStops));
+
+					int gx = (px + halfCell)/cellSize;
+					int gz = (int)(z + .5f);
+
+					int index = gx*dstGrid.m_sizeZ + gz;
+					dstSum[index] += logLum;
+					dstWeight[index] += 1.0f;
+				}
+			}
+		}
+	});
+
+	// image average in log space, summed in a fixed order
+	double totalSum = 0.0;
+	double totalWeight = 0.0;
+	for (int i = 0; i < numCells; i++)
+	{
+		totalSum += dstGrid.m_sumLogLum[i];
+		totalWeight += dstGrid.m_weight[i];
+	}
+	dstGrid.m_averageLogLum = totalWeight > 0.0 ? (float)(totalSum/totalWeight) : 0.0f;
+}
+
+// one [1 2 1]/4 pass along a single axis (0 = x, 1 = y, 2 = z), clamped at the edges
+static void BlurGridAxis(std::vector < float > & dst, const std::vector < float > & src, const FilmicLocalToneMap::BilateralGrid & grid, int axis, int numThreads)
+{
+	const int strides[3] = { grid.m_sizeZ, grid.m_sizeX*grid.m_sizeZ, 1 };
+	const int sizes[3] = { grid.m_sizeX, grid.m_sizeY, grid.m_sizeZ };
+
+	int stride = strides[axis];
+	int size = sizes[axis];
+
+	ParallelUtil::ParallelForBlocks(grid.m_sizeY,1,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		for (int y = begin; y < end; y++)
+		{
+			for (int x = 0; x < grid.m_sizeX; x++)
+			{
+				int base = grid.CellIndex(x,y,0);
+				for (int z = 0; z < grid.m_sizeZ; z++)
+				{
+					int coord = (axis == 0) ? x : ((axis == 1) ? y : z);
+					int index = base + z;
+					int lo = (coord > 0) ? index - stride : index;
+					int hi = (coord < size-1) ? index + stride : index;
+					dst[index] = .25f*(src[lo] + src[hi]) + .5f*src[index];
+				}
+			}
+		}
+	});
+}
+
+void FilmicLocalToneMap::BlurGrid(BilateralGrid & grid, int numPasses, int numThreads)
+{
+	PROFILE_ZONE("BlurGrid");
+	std::vector < float > temp(grid.m_sumLogLum.size());
+
+	for (int pass = 0; pass < numPasses; pass++)
+	{
+		for (int axis = 0; axis < 3; axis++)
+		{
+			BlurGridAxis(temp,grid.m_sumLogLum,grid,axis,numThreads);
+			grid.m_sumLogLum.swap(temp);
+
+			BlurGridAxis(temp,grid.m_weight,grid,axis,numThreads);
+			grid.m_weight.swap(temp);
+		}
+	}
+}
+
+void FilmicLocalToneMap::SliceAndApply(Vec3 * dstImage, const Vec3 * srcImage, int width, int height, const BilateralGrid & grid,
+	const FilmicColorGrading::BakedParams & bakedParams, const LocalParams & params, int numThreads)
+{
+	PROFILE_ZONE("SliceAndApply");
+	int sizeX = grid.m_sizeX;
+	int sizeZ = grid.m_sizeZ;
+	float invCellSize = 1.0f / float(grid.m_cellSize);
+	float maxZ = float(sizeZ-1);
+
+	// the x interpolation is the same for every row
+	std::vector < int > colIndex(width);
+	std::vector < float > colFrac(width);
+	for (int px = 0; px < width; px++)
+	{
+		float gx = (float(px) + .5f)*invCellSize;
+		int x0 = MinInt((int)gx,sizeX-2);
+		colIndex[px] = x0*sizeZ;
+		colFrac[px] = gx - float(x0);
+	}
+
+	const Vec3 luminanceWeights = bakedParams.m_luminanceWeights;
+	const float compression = params.m_compression;
+	const float detail = params.m_detailScale - 1.0f;
+	const float averageLogLum = grid.m_averageLogLum;
+
+	ParallelUtil::ParallelForBlocks(height,8,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		// Grid rows interpolated in y, so each pixel only needs a bilinear lookup in (x,z). The sums and weights are
+		// interpolated separately and divided per pixel, so sparse cells only count as much as the data in them.
+		std::vector < float > sumSlab(sizeX*sizeZ);
+		std::vector < float > weightSlab(sizeX*sizeZ);
+		std::vector < float > rowLogLum(width);
+		std::vector < float > rowScale(width);
+
+		for (int py = begin; py < end; py++)
+		{
+			float gy = (float(py) + .5f)*invCellSize;
+			int y0 = MinInt((int)gy,grid.m_sizeY-2);
+			float fy = gy - float(y0);
+
+			const float * sum0 = &grid.m_sumLogLum[grid.CellIndex(0,y0,0)];
+			const float * sum1 = &grid.m_sumLogLum[grid.CellIndex(0,y0+1,0)];
+			const float * weight0 = &grid.m_weight[grid.CellIndex(0,y0,0)];
+			const float * weight1 = &grid.m_weight[grid.CellIndex(0,y0+1,0)];
+			for (int i = 0; i < sizeX*sizeZ; i++)
+			{
+				sumSlab[i] = sum0[i] + fy*(sum1[i] - sum0[i]);
+				weightSlab[i] = weight0[i] + fy*(weight1[i] - weight0[i]);
+			}
+
+			const Vec3 * srcRow = srcImage + py*width;
+			Vec3 * dstRow = dstImage + py*width;
+
+			// Split into passes so that the log/exp loops vectorize, only the lookup in the middle is a gather.
+			for (int px = 0; px < width; px++)
+				rowLogLum[px] = CalcLogLum(srcRow[px],luminanceWeights);
+
+			for (int px = 0; px < width; px++)
+			{
+				float logLum = rowLogLum[px];
+				float z = MaxFloat(0.0f,MinFloat(maxZ,(logLum - grid.m_logLumMin)*grid.m_invBinStops));
+				int z0 = MinInt((int)z,sizeZ-2);
+				float fz = z - float(z0);
+				float fx = colFrac[px];
+
+				const float * sumCell = &sumSlab[colIndex[px] + z0];
+				float sum0 = sumCell[0] + fz*(sumCell[1] - sumCell[0]);
+				float sum1 = sumCell[sizeZ] + fz*(sumCell[sizeZ+1] - sumCell[sizeZ]);
+				float sum = sum0 + fx*(sum1 - sum0);
+
+				const float * weightCell = &weightSlab[colIndex[px] + z0];
+				float weight0 = weightCell[0] + fz*(weightCell[1] - weightCell[0]);
+				float weight1 = weightCell[sizeZ] + fz*(weightCell[sizeZ+1] - weightCell[sizeZ]);
+				float weight = weight0 + fx*(weight1 - weight0);
+
+				// no data around this pixel at all, so it's its own base and only gets the global part
+				float base = (weight > 1e-4f) ? sum/weight : logLum;
+
+				rowScale[px] = compression*(averageLogLum - base) + detail*(logLum - base);
+			}
+
+			for (int px = 0; px < width; px++)
+				rowScale[px] = FastExp2(rowScale[px]);
+
+			for (int px = 0; px < width; px++)
+				dstRow[px] = bakedParams.EvalColor(srcRow[px] * rowScale[px]);
+		}
+	});
+}
+
+void FilmicLocalToneMap::ApplyLocalToneMap(Vec3 * dstImage, const Vec3 * srcImage, int width, int height, BilateralGrid & grid,
+	const FilmicColorGrading::BakedParams & bakedParams, const LocalParams & params, int numThreads)
+{
+	BuildGrid(grid,srcImage,width,height,bakedParams.m_luminanceWeights,params,numThreads);
+	BlurGrid(grid,params.m_blurPasses,numThreads);
+	SliceAndApply(dstImage,srcImage,width,height,grid,bakedParams,params,numThreads);
+}
+
@@ -0,0 +1,99 @@
+#pragma once
+
+#include <CoreHelpers.h>
+
+#include <Vec3.h>
+
+#include "FilmicColorGrading.h"
+
+// Local tone mapping in front of the global filmic curve. We build a bilateral grid of log luminance
+// (x, y, log2 luminance), blur it, and slice it per pixel to get the large scale "base" luminance
+// around each pixel. The base is pulled towards the image average, which turns into a per pixel
+// exposure offset, and then the regular BakedParams curves are applied.
+class FilmicLocalToneMap
+{
+public:
+
+	struct LocalParams
+	{
+		LocalParams()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			m_gridCellSize = 32;
+			m_logLumMin = -16.0f;
+			m_logLumMax = 8.0f;
+			m_binStops = 1.5f;
+			m_blurPasses = 1;
+
+			m_compression = 0.5f;
+			m_detailScale = 1.0f;
+		}
+
+		int m_gridCellSize; // in pixels
+		float m_logLumMin; // range of the grid, in stops
+		float m_logLumMax;
+		float m_binStops; // stops per luminance bin, which is the range sigma of the bilateral filter
+		int m_blurPasses; // number of [1 2 1] passes along each axis
+
+		// offset (in stops) = m_compression * (average - base) + (m_detailScale - 1) * (pixel - base)
+		float m_compression; // 0 is global only, 1 flattens the base layer completely
+		float m_detailScale; // 1 keeps local detail as is
+	};
+
+	struct BilateralGrid
+	{
+		BilateralGrid()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			m_sizeX = 0;
+			m_sizeY = 0;
+			m_sizeZ = 0;
+			m_cellSize = 1;
+			m_logLumMin = 0.0f;
+			m_invBinStops = 1.0f;
+			m_averageLogLum = 0.0f;
+			m_sumLogLum.clear();
+			m_weight.clear();
+		}
+
+		// cell index is (y*m_sizeX + x)*m_sizeZ + z, so a slice only touches contiguous z runs
+		int CellIndex(int x, int y, int z) const
+		{
+			return (y*m_sizeX + x)*m_sizeZ + z;
+		}
+
+		int m_sizeX;
+		int m_sizeY;
+		int m_sizeZ;
+		int m_cellSize;
+		float m_logLumMin;
+		float m_invBinStops;
+
+		float m_averageLogLum;
+
+		// Sum of log luminance and pixel count per cell. They stay separate through the blur and the slice, and are
+		// only divided per pixel.
+		std::vector < float > m_sumLogLum;
+		std::vector < float > m_weight;
+	};
+
+	static void BuildGrid(BilateralGrid & dstGrid, const Vec3 * srcImage, int width, int height, const Vec3 & luminanceWeights, const LocalParams & params, int numThreads);
+	static void BlurGrid(BilateralGrid & grid, int numPasses, int numThreads);
+
+	// Applies the local exposure offset and then bakedParams.EvalColor(). dstImage can be the same as srcImage.
+	static void SliceAndApply(Vec3 * dstImage, const Vec3 * srcImage, int width, int height, const BilateralGrid & grid,
+		const FilmicColorGrading::BakedParams & bakedParams, const LocalParams & params, int numThreads);
+
+	// all of the above in one call, the grid is kept by the caller so its memory is reused across frames
+	static void ApplyLocalToneMap(Vec3 * dstImage, const Vec3 * srcImage, int width, int height, BilateralGrid & grid,
+		const FilmicColorGrading::BakedParams & bakedParams, const LocalParams & params, int numThreads);
+};
+
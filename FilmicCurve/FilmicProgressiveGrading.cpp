@@ -0,0 +1,99 @@
+#include "FilmicProgressiveGrading.h"
+
+#include <ParallelUtil.h>
+#include <ProfileUtil.h>
+
+// roughly how many pixels each thread grades between time checks
+static const int s_pixelsPerThreadPerBatch = 4096;
+
+float FilmicProgressiveGrading::EvalImageProgressive(Vec3 * dstImage, const Vec3 * srcImage, int width, int height, const FilmicColorGrading::BakedParams & params,
+	ProgressiveState & state, unsigned long long timeBudgetMicroSec, int numThreads)
+{
+	// the coarse passes fill whole blocks of the destination, which would stomp on source pixels we still need
+	ASSERT_ALWAYS(dstImage != srcImage);
+
+	unsigned long long startTime = GetQualityTimeMicroSec();
+
+	// new grade or new size, so start over with the proxy
+	unsigned long long paramsHash = params.CalcHash();
+	if (state.m_width != width || state.m_height != height || state.m_paramsHash != paramsHash)
+	{
+		int initialStride = 1;
+		while (initialStride*2 <= state.m_initialStride)
+			initialStride *= 2;
+
+		state.m_width = width;
+		state.m_height = height;
+		state.m_paramsHash = paramsHash;
+		state.m_stride = initialStride;
+		state.m_nextBlockRow = 0;
+		state.m_numGraded = 0;
+	}
+
+	numThreads = ParallelUtil::ResolveNumThreads(numThreads);
+
+	while (state.m_stride != 0)
+	{
+		const int stride = state.m_stride;
+		const bool isFirstPass = (stride*2 > state.m_initialStride);
+
+		int numBlockRows = (height + stride - 1)/stride;
+		int blocksPerRow = (width + stride - 1)/stride;
+		int batchRows = MaxInt(1,(numThreads*s_pixelsPerThreadPerBatch)/MaxInt(1,blocksPerRow));
+
+		int rowBegin = state.m_nextBlockRow;
+		int rowEnd = MinInt(rowBegin + batchRows,numBlockRows);
+		std::vector < int > rowCounts(rowEnd - rowBegin,0);
+
+		ParallelUtil::ParallelForBlocks(rowEnd - rowBegin,1,numThreads,[&](int /*threadIndex*/, int begin, int end)
+		{
+			PROFILE_ZONE("EvalImageProgressive rows");
+			for (int r = begin; r < end; r++)
+			{
+				int by = (rowBegin + r)*stride;
+				int byEnd = MinInt(by + stride,height);
+
+				// pixels on the 2*stride grid were graded by an earlier pass
+				bool isCoarseRow = !isFirstPass && (by % (2*stride)) == 0;
+
+				const Vec3 * srcRow = srcImage + by*width;
+				int count = 0;
+
+				for (int bx = 0; bx < width; bx += stride)
+				{
+					if (isCoarseRow && (bx % (2*stride)) == 0)
+						continue;
+
+					Vec3 color = params.EvalColor(srcRow[bx]);
+					count++;
+
+					int bxEnd = MinInt(bx + stride,width);
+					for (int y = by; y < byEnd; y++)
+					{
+						Vec3 * dstRow = dstImage + y*width;
+						for (int x = bx; x < bxEnd; x++)
+							dstRow[x] = color;
+					}
+				}
+
+				rowCounts[r] = count;
+			}
+		});
+
+		for (int i = 0; i < (int)rowCounts.size(); i++)
+			state.m_numGraded += rowCounts[i];
+
+		state.m_nextBlockRow = rowEnd;
+		if (rowEnd == numBlockRows)
+		{
+			state.m_stride = stride/2;
+			state.m_nextBlockRow = 0;
+		}
+
+		if (GetQualityTimeMicroSec() - startTime >= timeBudgetMicroSec)
+			break;
+	}
+
+	return state.GetCompletedFraction();
+}
+
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <CoreHelpers.h>
+
+#include <Vec3.h>
+
+#include "FilmicColorGrading.h"
+
+// Progressive grading for interactive slider response. The first pass grades every Nth pixel in x and y and fills
+// the NxN block around it, so a full frame proxy shows up right away. Each following pass halves the stride and
+// grades the pixels that haven't been graded yet, until the last pass at stride 1. Each call works until its time
+// budget runs out and returns the fraction of the frame that has been graded exactly.
+//
+// When the BakedParams change between calls (the user moved a slider again), the state restarts from the coarsest
+// pass automatically. If the source image changes, call Restart().
+class FilmicProgressiveGrading
+{
+public:
+
+	struct ProgressiveState
+	{
+		ProgressiveState()
+		{
+			m_initialStride = 8;
+			Restart();
+		}
+
+		void Restart()
+		{
+			m_width = 0;
+			m_height = 0;
+			m_paramsHash = 0;
+			m_stride = 0;
+			m_nextBlockRow = 0;
+			m_numGraded = 0;
+		}
+
+		bool IsComplete() const
+		{
+			return m_width > 0 && m_stride == 0;
+		}
+
+		float GetCompletedFraction() const
+		{
+			long long total = (long long)m_width * (long long)m_height;
+			return total > 0 ? float(double(m_numGraded)/double(total)) : 0.0f;
+		}
+
+		int m_initialStride; // power of 2, stride of the first (proxy) pass
+
+		int m_width;
+		int m_height;
+		unsigned long long m_paramsHash;
+
+		int m_stride; // stride of the pass in progress, 0 once the frame is complete
+		int m_nextBlockRow; // next row of stride x stride blocks in the current pass
+		long long m_numGraded; // pixels that have been graded exactly
+	};
+
+	// Returns the completed fraction. At least one batch of rows is done per call, even if the budget is tiny,
+	// so the caller always makes progress.
+	static float EvalImageProgressive(Vec3 * dstImage, const Vec3 * srcImage, int width, int height, const FilmicColorGrading::BakedParams & params,
+		ProgressiveState & state, unsigned long long timeBudgetMicroSec, int numThreads);
+};
+
@@ -0,0 +1,183 @@
+#include "FilmicStripGrading.h"
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+
+#include <ProfileUtil.h>
+
+bool FilmicStripGrading::RawFileReader::ReadRows(Vec3 * dstRows, int width, int /*firstRow*/, int numRows)
+{
+	size_t numPixels = (size_t)width * (size_t)numRows;
+	if (sizeof(Vec3) == 3*sizeof(float))
+		return fread(dstRows,sizeof(Vec3),numPixels,m_file) == numPixels;
+
+	for (size_t i = 0; i < numPixels; i++)
+	{
+		if (fread(dstRows[i].m_data,sizeof(float),3,m_file) != 3)
+			return false;
+	}
+	return true;
+}
+
+bool FilmicStripGrading::RawFileWriter::WriteRows(const Vec3 * srcRows, int width, int /*firstRow*/, int numRows)
+{
+	size_t numPixels = (size_t)width * (size_t)numRows;
+	if (sizeof(Vec3) == 3*sizeof(float))
+		return fwrite(srcRows,sizeof(Vec3),numPixels,m_file) == numPixels;
+
+	for (size_t i = 0; i < numPixels; i++)
+	{
+		if (fwrite(srcRows[i].m_data,sizeof(float),3,m_file) != 3)
+			return false;
+	}
+	return true;
+}
+
+// Queue of strip buffer indices. -1 is used to signal the end of the image.
+class StripQueue
+{
+public:
+	void Push(int val)
+	{
+		{
+			std::lock_guard < std::mutex > lock(m_mutex);
+			m_items.push_back(val);
+		}
+		m_cond.notify_one();
+	}
+
+	int Pop()
+	{
+		std::unique_lock < std::mutex > lock(m_mutex);
+		m_cond.wait(lock,[&]() { return !m_items.empty(); });
+		int val = m_items.front();
+		m_items.pop_front();
+		return val;
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_cond;
+	std::deque < int > m_items;
+};
+
+FilmicStripGrading::StripResult FilmicStripGrading::GradeImageStrips(StripReader & reader, StripWriter & writer, int width, int height, const FilmicColorGrading::BakedParams & params, const StripSettings & settings)
+{
+	StripResult result;
+
+	if (width <= 0 || height <= 0)
+	{
+		result.m_success = true;
+		return result;
+	}
+
+	int numBuffers = MaxInt(3,settings.m_numBuffers);
+	long long rowBytes = (long long)width * sizeof(Vec3);
+
+	// at least one row per strip, even if that goes over the budget
+	long long maxStripRows = settings.m_maxWorkingSetBytes / (rowBytes * numBuffers);
+	int stripHeight = (maxStripRows < (long long)height) ? MaxInt(1,(int)maxStripRows) : height;
+	int numStrips = (height + stripHeight - 1)/stripHeight;
+
+	// no point in having more buffers than strips
+	numBuffers = MinInt(numBuffers,numStrips);
+
+	result.m_numStrips = numStrips;
+	result.m_stripHeight = stripHeight;
+	result.m_workingSetBytes = rowBytes * stripHeight * numBuffers;
+
+	std::vector < std::vector < Vec3 > > buffers(numBuffers);
+	std::vector < int > bufferFirstRow(numBuffers);
+	std::vector < int > bufferNumRows(numBuffers);
+	for (int i = 0; i < numBuffers; i++)
+		buffers[i].resize((size_t)width * stripHeight);
+
+	StripQueue freeQueue;
+	StripQueue gradeQueue;
+	StripQueue writeQueue;
+	std::atomic < bool > failed(false);
+
+	for (int i = 0; i < numBuffers; i++)
+		freeQueue.Push(i);
+
+	// read ahead
+	std::thread readThread([&]()
+	{
+		for (int strip = 0; strip < numStrips && !failed; strip++)
+		{
+			int buf = freeQueue.Pop();
+
+			int firstRow = strip*stripHeight;
+			int numRows = MinInt(stripHeight,height - firstRow);
+			bufferFirstRow[buf] = firstRow;
+			bufferNumRows[buf] = numRows;
+
+			bool readOk;
+			{
+				PROFILE_ZONE("ReadStrip");
+				readOk = reader.ReadRows(&buffers[buf][0],width,firstRow,numRows);
+			}
+
+			if (!readOk)
+			{
+				failed = true;
+				freeQueue.Push(buf);
+				break;
+			}
+
+			gradeQueue.Push(buf);
+		}
+
+		gradeQueue.Push(-1);
+	});
+
+	// write behind
+	std::thread writeThread([&]()
+	{
+		for (;;)
+		{
+			int buf = writeQueue.Pop();
+			if (buf < 0)
+				break;
+
+			if (!failed)
+			{
+				PROFILE_ZONE("WriteStrip");
+				if (!writer.WriteRows(&buffers[buf][0],width,bufferFirstRow[buf],bufferNumRows[buf]))
+					failed = true;
+			}
+
+			// always recycle, otherwise the reader could wait forever after a failure
+			freeQueue.Push(buf);
+		}
+	});
+
+	// grade on this thread, in place
+	for (;;)
+	{
+		int buf = gradeQueue.Pop();
+		if (buf < 0)
+			break;
+
+		if (!failed)
+		{
+			PROFILE_ZONE("GradeStrip");
+			Vec3 * data = &buffers[buf][0];
+			FilmicColorGrading::EvalImage(data,data,width*bufferNumRows[buf],params,settings.m_numThreads);
+		}
+
+		writeQueue.Push(buf);
+	}
+
+	writeQueue.Push(-1);
+
+	readThread.join();
+	writeThread.join();
+
+	result.m_success = !failed;
+	return result;
+}
+
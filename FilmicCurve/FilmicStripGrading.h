@@ -0,0 +1,88 @@
+#pragma once
+
+#include <CoreHelpers.h>
+
+#include <Vec3.h>
+
+#include "FilmicColorGrading.h"
+
+// Out of core grading for images that don't fit in memory (gigapixel panoramas, stitched scans). The image is
+// processed in horizontal strips through a small ring of strip buffers: one thread reads ahead, the calling
+// thread (plus workers) grades, and another thread writes behind. Peak memory is the ring, which is sized from
+// StripSettings::m_maxWorkingSetBytes and doesn't depend on the image size.
+class FilmicStripGrading
+{
+public:
+
+	// Rows are always requested in order, top to bottom, so implementations can stream.
+	class StripReader
+	{
+	public:
+		virtual ~StripReader() {}
+		virtual bool ReadRows(Vec3 * dstRows, int width, int firstRow, int numRows) = 0;
+	};
+
+	class StripWriter
+	{
+	public:
+		virtual ~StripWriter() {}
+		virtual bool WriteRows(const Vec3 * srcRows, int width, int firstRow, int numRows) = 0;
+	};
+
+	// Raw interleaved float RGB, top to bottom. The caller opens the file and seeks past any header.
+	class RawFileReader : public StripReader
+	{
+	public:
+		RawFileReader(FILE * file) : m_file(file) {}
+		virtual bool ReadRows(Vec3 * dstRows, int width, int firstRow, int numRows);
+
+		FILE * m_file;
+	};
+
+	class RawFileWriter : public StripWriter
+	{
+	public:
+		RawFileWriter(FILE * file) : m_file(file) {}
+		virtual bool WriteRows(const Vec3 * srcRows, int width, int firstRow, int numRows);
+
+		FILE * m_file;
+	};
+
+	struct StripSettings
+	{
+		StripSettings()
+		{
+			Reset();
+		}
+
+		void Reset()
+		{
+			m_maxWorkingSetBytes = 256ll*1024*1024;
+			m_numBuffers = 3;
+			m_numThreads = 0;
+		}
+
+		long long m_maxWorkingSetBytes; // total size of all strip buffers
+		int m_numBuffers; // at least 3, so that reading, grading and writing can all happen at once
+		int m_numThreads; // grading threads, 0 for all hardware threads
+	};
+
+	struct StripResult
+	{
+		StripResult()
+		{
+			m_success = false;
+			m_numStrips = 0;
+			m_stripHeight = 0;
+			m_workingSetBytes = 0;
+		}
+
+		bool m_success;
+		int m_numStrips;
+		int m_stripHeight;
+		long long m_workingSetBytes; // the actual size of the strip buffers
+	};
+
+	static StripResult GradeImageStrips(StripReader & reader, StripWriter & writer, int width, int height, const FilmicColorGrading::BakedParams & params, const StripSettings & settings);
+};
+
@@ -0,0 +1,75 @@
+#include "FilmicTemporalGrading.h"
+
+#include <ParallelUtil.h>
+#include <HashUtil.h>
+#include <ProfileUtil.h>
+
+void FilmicTemporalGrading::EvalImageTemporal(Vec3 * dstImage, const Vec3 * srcImage, int width, int height, const FilmicColorGrading::BakedParams & params, TemporalCache & cache, int numThreads)
+{
+	ASSERT_ALWAYS(dstImage != srcImage);
+
+	int tileSize = MaxInt(8,cache.m_tileSize);
+	int numTilesX = (width + tileSize - 1)/tileSize;
+	int numTilesY = (height + tileSize - 1)/tileSize;
+	int numTiles = numTilesX*numTilesY;
+
+	unsigned long long paramsHash = params.CalcHash();
+
+	// any change in layout or params means that nothing from the previous frame is usable
+	bool reuseAllowed = (cache.m_width == width && cache.m_height == height && cache.m_tileSize == tileSize &&
+		cache.m_paramsHash == paramsHash && (int)cache.m_tileHashes.size() == numTiles);
+
+	if (!reuseAllowed)
+	{
+		cache.m_width = width;
+		cache.m_height = height;
+		cache.m_tileSize = tileSize;
+		cache.m_paramsHash = paramsHash;
+		cache.m_tileHashes.assign(numTiles,0);
+	}
+
+	std::vector < unsigned char > skipped(numTiles,0);
+
+	ParallelUtil::ParallelForBlocks(numTiles,1,numThreads,[&](int /*threadIndex*/, int begin, int end)
+	{
+		for (int tile = begin; tile < end; tile++)
+		{
+			PROFILE_ZONE("EvalImageTemporal tile");
+			int x0 = (tile % numTilesX)*tileSize;
+			int y0 = (tile / numTilesX)*tileSize;
+			int x1 = MinInt(x0 + tileSize,width);
+			int y1 = MinInt(y0 + tileSize,height);
+			int rowBytes = (x1 - x0)*sizeof(Vec3);
+
+			unsigned long long tileHash = (unsigned long long)tile;
+			for (int y = y0; y < y1; y++)
+				tileHash = HashUtil::HashBytes(srcImage + y*width + x0,rowBytes,tileHash);
+
+			if (reuseAllowed && cache.m_tileHashes[tile] == tileHash)
+			{
+				skipped[tile] = 1;
+				continue;
+			}
+
+			cache.m_tileHashes[tile] = tileHash;
+
+			for (int y = y0; y < y1; y++)
+			{
+				const Vec3 * srcRow = srcImage + y*width;
+				Vec3 * dstRow = dstImage + y*width;
+				for (int x = x0; x < x1; x++)
+					dstRow[x] = params.EvalColor(srcRow[x]);
+			}
+		}
+	});
+
+	int numSkipped = 0;
+	for (int i = 0; i < numTiles; i++)
+		numSkipped += skipped[i];
+
+	cache.m_lastNumTiles = numTiles;
+	cache.m_lastNumSkipped = numSkipped;
+	cache.m_totalNumTiles += numTiles;
+	cache.m_totalNumSkipped += numSkipped;
+}
+
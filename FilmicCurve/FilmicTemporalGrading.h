@@ -0,0 +1,66 @@
+#pragma once
+
+#include <CoreHelpers.h>
+
+#include <Vec3.h>
+
+#include "FilmicColorGrading.h"
+
+// Grades a stream of frames, skipping tiles whose input didn't change since the previous frame. Each tile of the
+// input is hashed, and if the hash and the BakedParams both match the previous frame, the tile in the destination
+// is left alone. So the destination buffer must still hold the previous frame's output, which is the usual case
+// for a playback service that grades into the same buffer every frame.
+class FilmicTemporalGrading
+{
+public:
+
+	struct TemporalCache
+	{
+		TemporalCache()
+		{
+			Reset();
+		}
+
+		// forces a full regrade on the next frame
+		void Reset()
+		{
+			m_width = 0;
+			m_height = 0;
+			m_tileSize = 64;
+			m_paramsHash = 0;
+			m_tileHashes.clear();
+
+			m_lastNumTiles = 0;
+			m_lastNumSkipped = 0;
+			m_totalNumTiles = 0;
+			m_totalNumSkipped = 0;
+		}
+
+		float GetLastSkippedFraction() const
+		{
+			return m_lastNumTiles > 0 ? float(m_lastNumSkipped)/float(m_lastNumTiles) : 0.0f;
+		}
+
+		float GetTotalSkippedFraction() const
+		{
+			return m_totalNumTiles > 0 ? float(double(m_totalNumSkipped)/double(m_totalNumTiles)) : 0.0f;
+		}
+
+		int m_width;
+		int m_height;
+		int m_tileSize; // in pixels, can be changed before a frame (which resets the hashes)
+
+		unsigned long long m_paramsHash;
+		std::vector < unsigned long long > m_tileHashes;
+
+		// stats for the last frame and since the last Reset()
+		int m_lastNumTiles;
+		int m_lastNumSkipped;
+		long long m_totalNumTiles;
+		long long m_totalNumSkipped;
+	};
+
+	// dstImage must hold the previous output of this cache, and can't be the same as srcImage.
+	static void EvalImageTemporal(Vec3 * dstImage, const Vec3 * srcImage, int width, int height, const FilmicColorGrading::BakedParams & params, TemporalCache & cache, int numThreads);
+};
+